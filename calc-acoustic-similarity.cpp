@@ -8,6 +8,11 @@
 #include <profile.h>
 
 #include <cdtw.h>
+#include <sim_matrix.h>
+#include <score_cache.h>
+#include <model_io.h>
+#include <feature_arena.h>
+#include <frame_reduction.h>
 
 using namespace DtwUtil;
 using namespace std;
@@ -17,7 +22,10 @@ typedef Matrix2D<float> mat;
 void dumpMfccAsKaldiArk(const Array<string>& lists);
 void normalize(mat& m, int type = 1);
 double cdtw(const string& f1, const string& f2);
+double cdtw(const FeatureArena& arena, size_t i, size_t j);
+void loadFeatures(const vector<DtwParm>& parms, FrameReducer& reducer, FeatureArena& arena);
 void chooseLargestGranularity(const string& path, Array<string>& lists);
+uint64_t hashDtwParm(const DtwParm& parm);
 enum DTW_TYPE { FIXDTW, FFDTW, SCDTW, CDTW };
 DTW_TYPE getDtwType(const string& typeStr);
 
@@ -76,6 +84,21 @@ int main (int argc, char* argv[]) {
     .add("--theta", "specify the file containing the diagnol term of Mahalanobis distance (dim=39)", false)
     .add("--eta", "Specify the coefficient in the smoothing minimum", false, "-4");
 
+  cmdParser
+    .addGroup("Preprocessing options")
+    .add("--frame-reduction", "shorten every segment once when it is loaded: \"skip:N\", \"average:N\"\n"
+			      "or \"merge:T\" (see frame_reduction.h). --dtw-type=cdtw only", false);
+
+  cmdParser
+    .addGroup("Output options")
+    .add("--format", "\"text\" or \"bin\" (binary similarity matrix, see sim_matrix.h)", false, "text")
+    .add("--layout", "for --format=bin: \"lower\" (packed lower triangle) or \"full\"", false, "lower")
+    .add("--precision", "for --format=bin: \"float32\" or \"float16\"", false, "float32");
+
+  cmdParser
+    .addGroup("Cache options")
+    .add("--cache", "score cache file (see score_cache.h), shared by runs and tools", false);
+
   if(!cmdParser.isOptionLegal())
     cmdParser.showUsageAndExit();
 
@@ -88,11 +111,40 @@ int main (int argc, char* argv[]) {
   string list_filename = cmdParser.find("--list");
   string theta_fn = cmdParser.find("--theta");
   SMIN::eta = str2double(cmdParser.find("--eta"));
+  string format = cmdParser.find("--format");
+  int layout = parseSimMatrixLayout(cmdParser.find("--layout"));
+  int precision = parseSimMatrixType(cmdParser.find("--precision"));
+  string cache_fn = cmdParser.find("--cache");
+  FrameReducer reducer(cmdParser.find("--frame-reduction"));
+
+  if (format != "text" && format != "bin") {
+    fprintf(stderr, "--format must be either \"text\" or \"bin\"\n");
+    return -1;
+  }
 
   Bhattacharyya::setDiagFromFile(theta_fn);
 
   DTW_TYPE type = getDtwType(cmdParser.find("--dtw-type"));
 
+  if (reducer.isEnabled() && type != CDTW) {
+    fprintf(stderr, "--frame-reduction needs --dtw-type=cdtw\n");
+    return -1;
+  }
+
+  // Only with --cache: the table alone takes tens of MB
+  ScoreCache* cache = NULL;
+  if (!cache_fn.empty()) {
+    cache = new ScoreCache;
+    if (!cache->open(cache_fn)) {
+      fprintf(stderr, "Cannot open score cache %s\n", cache_fn.c_str());
+      return -1;
+    }
+  }
+  uint64_t context = (type == CDTW)
+    ? ScoreCache::makeContext("bhattacharyya", ScoreCache::hashFile(theta_fn), SMIN::eta,
+	reducer.isEnabled() ? "cdtw+" + reducer.getSpec() : "cdtw")
+    : ScoreCache::makeContext("euclidean", 0, 0, cmdParser.find("--dtw-type"));
+
   Array<string> lists(list_filename);
   chooseLargestGranularity(path, lists);
 
@@ -102,6 +154,19 @@ int main (int argc, char* argv[]) {
   foreach (i, lists)
     parms.push_back(DtwParm(lists[i]));
 
+  vector<uint64_t> hash;
+  if (cache) {
+    foreach (i, parms)
+      hash.push_back(hashDtwParm(parms[i]));
+  }
+
+  // Reduced segments are kept in memory and aligned from there
+  FeatureArena arena;
+  if (reducer.isEnabled()) {
+    loadFeatures(parms, reducer, arena);
+    reducer.printStats();
+  }
+
   mat scores(nSegment, nSegment);
 
   range (i, nSegment) {
@@ -109,10 +174,20 @@ int main (int argc, char* argv[]) {
     range (j, nSegment) {
       if (j > i) break;
 
+      uint64_t key = 0;
+      float cached;
+      if (cache) {
+	key = ScoreCache::makeKey(hash[i], hash[j], context);
+	if (cache->get(key, cached)) {
+	  scores[i][j] = scores[j][i] = cached;
+	  continue;
+	}
+      }
+
       double score = 0;
       switch (type) {
 	case CDTW:
-	  score = cdtw(lists[i], lists[j]);
+	  score = reducer.isEnabled() ? cdtw(arena, i, j) : cdtw(lists[i], lists[j]);
 	  break;
 	case FIXDTW:
 	  score = other_dtw<FixFrameDtwRunner>(parms[i], parms[j]);
@@ -127,11 +202,28 @@ int main (int argc, char* argv[]) {
       }
 
       scores[i][j] = scores[j][i] = score;
+
+      if (cache)
+	cache->put(key, score);
     }
   }
 
+  if (cache) {
+    cache->flush();
+    cache->printStats();
+    delete cache;
+  }
+
   normalize(scores, 1);
-  scores.saveas(mat_filename);
+
+  if (format == "bin") {
+    vector<float> m(nSegment * nSegment);
+    range (i, nSegment)
+      std::copy(scores[i], scores[i] + nSegment, m.begin() + i * nSegment);
+    saveSimMatrix(mat_filename, m.data(), nSegment, layout, precision);
+  }
+  else
+    scores.saveas(mat_filename);
 
   cout << endl;
   profile.toc();
@@ -161,6 +253,18 @@ void dumpMfccAsKaldiArk(const Array<string>& lists) {
   }
 }
 
+// Same as ScoreCache::hashFeature() over all frames, one row at a time
+uint64_t hashDtwParm(const DtwParm& parm) {
+  size_t feat_dim = parm.Feat().LF();
+  size_t totalTime = parm.Feat().LT();
+
+  uint64_t hash = fnv1a(NULL, 0);
+  for (size_t t=0; t<totalTime; ++t)
+    hash = fnv1a(parm.Feat()[t], feat_dim * sizeof(float), hash);
+
+  return hash;
+}
+
 double cdtw(const string& f1, const string& f2) {
   vector<float> hypo_score;
   vector<pair<int, int> > hypo_bound;
@@ -177,6 +281,35 @@ double cdtw(const string& f1, const string& f2) {
   return -cScoreInLog;
 }
 
+// Same score as above, on frames already in memory
+double cdtw(const FeatureArena& arena, size_t i, size_t j) {
+  ArenaDtwRunner dtwRunner(Bhattacharyya::fn);
+  dtwRunner.init(arena.data(i), arena.length(i), arena.data(j), arena.length(j), arena.getDim());
+  dtwRunner.DTW(true);
+
+  return -dtwRunner.getCumulativeScore();
+}
+
+void loadFeatures(const vector<DtwParm>& parms, FrameReducer& reducer, FeatureArena& arena) {
+  vector<float> frames;
+
+  foreach (i, parms) {
+    const DenseFeature& feat = parms[i].Feat();
+    size_t T = feat.LT(), dim = feat.LF();
+
+    if (i == 0)
+      arena.setDim(dim);
+
+    frames.resize(T * dim);
+    range (t, T)
+      std::copy(feat[t], feat[t] + dim, frames.begin() + t * dim);
+
+    size_t n = reducer.reduce(frames.data(), T, dim, frames.data());
+    reducer.count(T, n);
+    arena.push_back(frames.data(), n);
+  }
+}
+
 DTW_TYPE getDtwType(const string& typeStr) {
   if (typeStr == "fixdtw")
     return FIXDTW;
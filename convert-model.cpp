@@ -0,0 +1,65 @@
+#include <iostream>
+#include <string>
+
+#include <cmdparser.h>
+#include <utility.h>
+#include <perf.h>
+
+#include <model.h>
+#include <model_io.h>
+
+using namespace std;
+
+int main (int argc, char* argv[]) {
+
+  CmdParser cmdParser(argc, argv);
+  cmdParser
+    .add("--type", "choose \"dnn\" (DTW-DNN model) or \"diag\" (theta of dtwdiag)")
+    .add("-i", "input model: a folder (dnn) or a file (diag), either in text or binary")
+    .add("-o", "output model. Binary if it ends with \".bin\", text otherwise");
+
+  cmdParser
+    .addGroup("Example: ./convert-model --type=dnn -i data/dtwdnn.model/ -o data/dtwdnn.bin")
+    .addGroup("Example: ./convert-model --type=diag -i exp/theta/theta.rand.1 -o exp/theta/theta.rand.1.bin")
+    .addGroup("Example: ./convert-model --type=diag -i exp/theta/theta.rand.1.bin -o exp/theta/theta.rand.1");
+
+  if(!cmdParser.isOptionLegal())
+    cmdParser.showUsageAndExit();
+
+  string type	= cmdParser.find("--type");
+  string input	= cmdParser.find("-i");
+  string output = cmdParser.find("-o");
+
+  perf::Timer timer;
+  timer.start();
+
+  if (type == "dnn") {
+    Model model;
+    model.load(input);
+    model.save(output);
+  }
+  else if (type == "diag") {
+    vector<double> theta;
+    loadTheta(theta, input);
+
+    if (ends_with(output, ".bin")) {
+      ModelFileWriter writer(DIAG_MODEL_FILE);
+      writer.add(theta);
+      if (!writer.save(output)) {
+	fprintf(stderr, "Cannot save theta to %s\n", output.c_str());
+	return -1;
+      }
+    }
+    else
+      ext::save(theta, output);
+  }
+  else {
+    fprintf(stderr, "--type unspecified or unknown\n");
+    return -1;
+  }
+
+  printf("%s => %s\n", input.c_str(), output.c_str());
+  timer.elapsed();
+
+  return 0;
+}
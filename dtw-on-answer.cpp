@@ -8,6 +8,7 @@
 
 #include <array.h>
 #include <fast_dtw.h>
+#include <sim_matrix.h>
 using namespace std;
 
 /*void selfTest();
@@ -24,9 +25,9 @@ void getSubData(float** sub_data, unsigned int** sub_offset, const float* data,
 void getSubData(float** sub_data, float** sub_offset, const float* data, const unsigned int* offset, int N, int dim);
 float computeDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta, int i, int j);
 void printSimilarity(Matrix2D<float> m, const vector<string>& docid);
+Matrix2D<float> getSubMatrix(string filename, const vector<size_t>& positions);
 typedef map<string, vector<string> > Answer;
 Answer loadAnswer(string filename);
-void cutoffWaveFilename(vector<string> &docid);
 int find(const vector<string>& arr, const string s);
 
 int main (int argc, char* argv[]) {
@@ -65,12 +66,15 @@ int main (int argc, char* argv[]) {
   // string query = "COMPACT";
   string query = "ITERATION";
   string archive_fn = "/share/hypothesis/OOV_g2p.kaldi/posterior/" + query + ".76.ark";
-  float* data;
-  unsigned int* offset;
-  int N, dim;
-  vector<string> docid;
 
-  loadFeatureArchive(archive_fn, data, offset, N, dim, &docid);
+  // Only the utterance IDs are needed to find the recalled documents
+  KaldiArchiveIndex index;
+  if (!index.open(archive_fn)) {
+    fprintf(stderr, "Cannot open archive %s\n", archive_fn.c_str());
+    exit(-1);
+  }
+
+  vector<string> docid = index.getKeys();
   cutoffWaveFilename(docid);
 
   /*foreach (i, docid) {
@@ -103,18 +107,8 @@ int main (int argc, char* argv[]) {
 	 s1_fn = root + set1 + "/mul-sim/" + query + ".mul-sim",
 	 s2_fn = root + set2 + "/mul-sim/" + query + ".mul-sim";
 
-  Matrix2D<float> s1(s1_fn);
-  Matrix2D<float> s2(s2_fn);
-
-  Matrix2D<float> a1(M, M);
-  Matrix2D<float> a2(M, M);
-
-  range (i, M) {
-    range (j, M) {
-      a1[i][j] = s1[pos[i]][pos[j]];
-      a2[i][j] = s2[pos[i]][pos[j]];
-    }
-  }
+  Matrix2D<float> a1 = getSubMatrix(s1_fn, pos);
+  Matrix2D<float> a2 = getSubMatrix(s2_fn, pos);
 
   vector<string> relDocIds = getRecalledDocId(docid, ans[query]);
 
@@ -135,9 +129,19 @@ int main (int argc, char* argv[]) {
   mylog(ustr);
   mylog(uindex);
 
+  // Load just the two utterances to align instead of the whole archive
+  vector<string> ids;
+  ids.push_back(index.getKeys()[pos[0]]);
+  ids.push_back(index.getKeys()[pos[1]]);
+
+  float* data;
+  unsigned int* offset;
+  int N, dim;
+  loadFeatureArchive(archive_fn, ids, data, offset, N, dim);
+
   mahalanobis_fn fn(dim);
 
-  computeDTW(data, offset, N, dim, fn, eta, pos[0], pos[1]);
+  computeDTW(data, offset, N, dim, fn, eta, 0, 1);
   /*range (i, M) {
     printf("%s vs. %s \n", ustr.c_str(), relDocIds[i].c_str());
     computeDTW(data, offset, N, dim, fn, eta, uindex, pos[i]);
@@ -187,6 +191,31 @@ float computeDTW(const float* data, const unsigned int* offset, int N, int dim,
   return s;
 }
 
+// Only the M x M entries are read from a binary similarity matrix. A text
+// matrix has to be parsed as a whole.
+Matrix2D<float> getSubMatrix(string filename, const vector<size_t>& positions) {
+  size_t M = positions.size();
+  Matrix2D<float> sub(M, M);
+
+  if (SimMatrix::isSimMatrix(filename)) {
+    SimMatrix m;
+    if (!m.open(filename))
+      exit(-1);
+
+    range (i, M)
+      range (j, M)
+	sub[i][j] = m.get(positions[i], positions[j]);
+  }
+  else {
+    Matrix2D<float> m(filename);
+    range (i, M)
+      range (j, M)
+	sub[i][j] = m[positions[i]][positions[j]];
+  }
+
+  return sub;
+}
+
 void printSimilarity(Matrix2D<float> m, const vector<string>& docids) {
   size_t M = m.getRows();
 
@@ -223,14 +252,6 @@ vector<size_t> getRecalls(const vector<string>& retrieved, const vector<string>&
   return positions;
 }
 
-void cutoffWaveFilename(vector<string> &docid) {
-  foreach (i, docid) {
-    size_t begin = docid[i].find_last_of('/');
-    size_t end = docid[i].find_last_of('_');
-    docid[i] = docid[i].substr(begin + 1, end - begin - 1);
-  }
-}
-
 int find(const vector<string>& arr, const string s) {
   foreach (i, arr)
     if (arr[i] == s) return i;
@@ -19,12 +19,17 @@ int main(int argc, char* argv[]) {
     .add("-p", "phone table")
     .add("-m", "model")
     .add("--feat-ark", "feature archive where mfcc extracted from")
-    .add("--mfcc-output-folder", "destination folder for saving mfcc files");
+    .add("--mfcc-output-folder", "destination folder for saving mfcc files", false)
+    .add("--phone-store", "save all phone instances into one packed file instead (see phone_store.h)", false)
+    .add("--threads", "number of threads slicing and writing phone instances (0 for all cores)", false, "0");
 
   cmdParser
     .addGroup("Examples: ./extract -a data/train.ali.txt -p data/phones.txt"
 	" -m data/final.mdl --feat-ark=/share/LectureDSP_script/feat/train.39.ark"
-	" --mfcc-output-folder=data/mfcc/");
+	" --mfcc-output-folder=data/mfcc/")
+    .addGroup("         ./extract -a data/train.ali.txt -p data/phones.txt"
+	" -m data/final.mdl --feat-ark=/share/LectureDSP_script/feat/train.39.ark"
+	" --phone-store=data/mfcc.phs");
 
   if(!cmdParser.isOptionLegal())
     cmdParser.showUsageAndExit();
@@ -34,6 +39,13 @@ int main(int argc, char* argv[]) {
   string modelFile = cmdParser.find("-m");
   string featArk = cmdParser.find("--feat-ark");
   string outputFolder = cmdParser.find("--mfcc-output-folder");
+  string phoneStore = cmdParser.find("--phone-store");
+  size_t nThreads = str2int(cmdParser.find("--threads"));
+
+  if (outputFolder.empty() && phoneStore.empty()) {
+    fprintf(stderr, "Either --mfcc-output-folder or --phone-store is needed.\n");
+    return -1;
+  }
 
   debug(alignmentFile);
   debug(phoneTableFile);
@@ -46,23 +58,16 @@ int main(int argc, char* argv[]) {
   size_t nInstance = load(alignmentFile, modelFile, phoneLabels);
   printf(GREEN"[Done]"COLOREND"\n");
 
-  map<size_t, vector<FeatureSeq> > phoneInstances;
-
   if (featArk.empty()) {
     printf("No feature archive provided.\n");
     return 0;
   }
 
-  printf("Loading feature archive...\n");
-  size_t n = loadFeatureArchive(featArk, phoneLabels, phoneInstances);
+  printf("Extracting phone instances from feature archive...\n");
+  size_t n = extractPhoneInstances(featArk, phoneLabels, phones, outputFolder, phoneStore, nThreads);
   check_equal(n, nInstance);
   printf(GREEN"[Done]"COLOREND"\n");
 
-  printf("Saving feature sequences into files...\n");
-  size_t nMfccFiles = saveFeatureAsMFCC(phoneInstances, phones, outputFolder);
-  check_equal(nMfccFiles, nInstance);
-  printf(GREEN"[Done]"COLOREND"\n");
-
   return 0;
 }
 
@@ -0,0 +1,284 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <mutex>
+#include <color.h>
+#include <perf.h>
+#include <cmdparser.h>
+
+#include <thread_pool.h>
+#include <rerank.h>
+using namespace std;
+
+vector<double> parseSweep(string sweep);
+void loadFirstPass(string filename, vector<string>& docids, vector<double>& scores);
+vector<string> rankDocuments(const vector<string>& docids, const vector<double>& scores);
+
+int main (int argc, char* argv[]) {
+
+  CmdParser cmdParser(argc, argv);
+  cmdParser
+    .add("-q", "query list, one query per line")
+    .add("-a", "answers, one \"<qid> <query> <doc ID> <relevance>\" line per relevant doc")
+    .add("-d", "experiment directory, holding mul-sim/ and seglist/", false)
+    .add("-o", "output MAP table, one \"p MAP\" line per p (default: stdout)", false);
+
+  cmdParser
+    .addGroup("Input options")
+    .add("--sim", "similarity matrix of each query, text or binary (see sim_matrix.h)", false, "{dir}/mul-sim/{query}.mul-sim")
+    .add("--list", "first-pass results of each query, one \"<utterance ID> <score>\" line per\n"
+		   "row of the similarity matrix. The doc ID is what lies between the\n"
+		   "last '/' and the last '_' of the utterance ID", false, "{dir}/seglist/{query}.lst");
+
+  cmdParser
+    .addGroup("Re-ranking options")
+    .add("--method", "\"graph\" (random walk) or \"prf\" (pseudo-relevance feedback), see rerank.h", false, "graph")
+    .add("-p", "values of p to sweep, as start:step:end", false, "0.02:0.02:1")
+    .add("--knn", "for --method=graph: keep only the knn most similar neighbours of each\n"
+		  "segment and walk a sparse graph (0 for the dense one)", false, "0")
+    .add("--prf-top", "for --method=prf: number of first-pass results taken as relevant", false, "10")
+    .add("--at", "also report P@k for this k, as a third column of -o and --detail\n"
+		 "(0 for MAP only)", false, "0")
+    .add("--detail", "also write \"query AP\" per query for each p, to a file pattern\n"
+		     "containing {p}", false)
+    .add("--threads", "number of threads (0 for all cores)", false, "0");
+
+  cmdParser
+    .addGroup("Example: ./graph-rerank -q 110.query -a 110.ans -d /share/preparsed_files/OOV_g2p_dtw -o OOV.map");
+
+  if(!cmdParser.isOptionLegal())
+    cmdParser.showUsageAndExit();
+
+  string query_fn   = cmdParser.find("-q");
+  string answer_fn  = cmdParser.find("-a");
+  string dir	    = cmdParser.find("-d");
+  string output_fn  = cmdParser.find("-o");
+  string sim_pattern= cmdParser.find("--sim");
+  string lst_pattern= cmdParser.find("--list");
+  string method	    = cmdParser.find("--method");
+  vector<double> ps = parseSweep(cmdParser.find("-p"));
+  size_t knn	    = str2int(cmdParser.find("--knn"));
+  size_t prfTop	    = str2int(cmdParser.find("--prf-top"));
+  size_t at	    = str2int(cmdParser.find("--at"));
+  string detail	    = cmdParser.find("--detail");
+  size_t nThreads   = str2int(cmdParser.find("--threads"));
+
+  if (dir.empty() && (sim_pattern.find("{dir}") != string::npos || lst_pattern.find("{dir}") != string::npos)) {
+    fprintf(stderr, "Either -d, or both --sim and --list without {dir}, must be given\n");
+    return -1;
+  }
+
+  if (method != "graph" && method != "prf") {
+    fprintf(stderr, "--method must be either \"graph\" or \"prf\"\n");
+    return -1;
+  }
+
+  if (!detail.empty() && detail.find("{p}") == string::npos) {
+    fprintf(stderr, "--detail must contain {p}\n");
+    return -1;
+  }
+
+  sim_pattern = replace_all(sim_pattern, "{dir}", dir);
+  lst_pattern = replace_all(lst_pattern, "{dir}", dir);
+
+  perf::Timer timer;
+  timer.start();
+
+  vector<string> queries = loadQueryList(query_fn);
+  map<string, QueryAnswer> answers = loadAnswers(answer_fn);
+
+  // Queries without any answer do not count, as in trec_eval
+  vector<string> evaluated;
+  foreach (i, queries) {
+    if (answers.count(queries[i]))
+      evaluated.push_back(queries[i]);
+    else
+      fprintf(stderr, ORANGE"[Warning]"COLOREND" No answer for query %s, skipped\n", queries[i].c_str());
+  }
+
+  size_t nP = ps.size(), nQ = evaluated.size();
+  printf("[Info] # of query: "GREEN"%lu"COLOREND", # of p: "GREEN"%lu"COLOREND"\n", nQ, nP);
+
+  // ap[k * nQ + q], for the k-th p and the q-th query
+  vector<double> ap(nP * nQ), precision(nP * nQ);
+  std::mutex mutex;
+  size_t nFinished = 0;
+
+  // Each query is loaded once and re-ranked for every p
+  ThreadPool pool(nThreads);
+  foreach (q, evaluated) {
+    pool.submit([&, q] () {
+      string query = evaluated[q];
+      const QueryAnswer& answer = answers.find(query)->second;
+
+      vector<string> docids;
+      vector<double> first;
+      loadFirstPass(replace_all(lst_pattern, "{query}", query), docids, first);
+
+      vector<float> S;
+      size_t N;
+      string sim_fn = replace_all(sim_pattern, "{query}", query);
+      if (!loadScoreMatrix(sim_fn, S, N)) {
+	fprintf(stderr, "[Error] Cannot load similarity matrix %s\n", sim_fn.c_str());
+	exit(-1);
+      }
+
+      if (N != docids.size()) {
+	fprintf(stderr, "[Error] %s is %lu x %lu, but its first-pass list has %lu results\n",
+	    sim_fn.c_str(), N, N, docids.size());
+	exit(-1);
+      }
+
+      vector<double> r0 = normalizeScores(first);
+
+      auto evaluate = [&] (size_t k, const vector<double>& r) {
+	vector<string> ranking = rankDocuments(docids, r);
+	ap[k * nQ + q] = averagePrecision(ranking, answer.relevant);
+	if (at > 0)
+	  precision[k * nQ + q] = precisionAt(ranking, answer.relevant, at);
+      };
+
+      if (method == "graph") {
+	SimilarityGraph graph(S.data(), N, knn);
+	range (k, nP)
+	  evaluate(k, randomWalk(graph, r0, ps[k]));
+      }
+      else {
+	range (k, nP)
+	  evaluate(k, pseudoRelevanceFeedback(S.data(), N, r0, ps[k], prfTop));
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      ++nFinished;
+      printf("\r[Info] Re-ranked "BLUE"%lu"COLOREND" / %lu queries", nFinished, nQ);
+      fflush(stdout);
+    });
+  }
+  pool.wait();
+  printf("\n");
+
+  FILE* fid = output_fn.empty() ? stdout : fopen(output_fn.c_str(), "w");
+  if (!fid) {
+    fprintf(stderr, "Cannot open %s\n", output_fn.c_str());
+    return -1;
+  }
+
+  size_t best = 0;
+  vector<double> MAP(nP, 0);
+  range (k, nP) {
+    double pAtK = 0;
+    range (q, nQ) {
+      MAP[k] += ap[k * nQ + q];
+      pAtK += precision[k * nQ + q];
+    }
+
+    if (nQ > 0) {
+      MAP[k] /= nQ;
+      pAtK /= nQ;
+    }
+
+    if (MAP[k] > MAP[best])
+      best = k;
+
+    if (at > 0)
+      fprintf(fid, "%g\t%.4f\t%.4f\n", ps[k], MAP[k], pAtK);
+    else
+      fprintf(fid, "%g\t%.4f\n", ps[k], MAP[k]);
+
+    if (!detail.empty()) {
+      char p[32];
+      sprintf(p, "%g", ps[k]);
+      string detail_fn = replace_all(detail, "{p}", p);
+      FILE* d = fopen(detail_fn.c_str(), "w");
+      if (!d) {
+	fprintf(stderr, "Cannot open %s\n", detail_fn.c_str());
+	return -1;
+      }
+
+      range (q, nQ) {
+	if (at > 0)
+	  fprintf(d, "%s\t%.4f\t%.4f\n", evaluated[q].c_str(), ap[k * nQ + q], precision[k * nQ + q]);
+	else
+	  fprintf(d, "%s\t%.4f\n", evaluated[q].c_str(), ap[k * nQ + q]);
+      }
+      fclose(d);
+    }
+  }
+
+  if (fid != stdout)
+    fclose(fid);
+
+  if (nP > 0)
+    printf("Best MAP = "GREEN"%.4f"COLOREND" at p = %g\n", MAP[best], ps[best]);
+
+  timer.elapsed();
+
+  return 0;
+}
+
+vector<double> parseSweep(string sweep) {
+  vector<string> tokens = split(sweep, ':');
+  if (tokens.size() != 3) {
+    fprintf(stderr, "[Error] -p must be start:step:end, not \"%s\"\n", sweep.c_str());
+    exit(-1);
+  }
+
+  double start = str2double(tokens[0]), step = str2double(tokens[1]), end = str2double(tokens[2]);
+  if (step <= 0 || end < start) {
+    fprintf(stderr, "[Error] Empty sweep \"%s\"\n", sweep.c_str());
+    exit(-1);
+  }
+
+  // Counted rather than accumulated, so that end is not lost to rounding
+  size_t n = (end - start) / step + 1e-6;
+  vector<double> ps(n + 1);
+  range (i, n + 1)
+    ps[i] = start + i * step;
+
+  return ps;
+}
+
+void loadFirstPass(string filename, vector<string>& docids, vector<double>& scores) {
+  ifstream file(filename.c_str());
+  if (!file.is_open()) {
+    fprintf(stderr, "[Error] Cannot open first-pass list %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  string line;
+  while (std::getline(file, line)) {
+    stringstream ss(line);
+    string utterance;
+    double score;
+    if (!(ss >> utterance))
+      continue;
+
+    if (!(ss >> score)) {
+      fprintf(stderr, "[Error] %s: no first-pass score for %s\n", filename.c_str(), utterance.c_str());
+      exit(-1);
+    }
+
+    docids.push_back(cutoffWaveFilename(utterance));
+    scores.push_back(score);
+  }
+}
+
+// A doc hit by several segments is ranked by its best one
+vector<string> rankDocuments(const vector<string>& docids, const vector<double>& scores) {
+  map<string, double> best;
+  foreach (i, docids) {
+    auto itr = best.find(docids[i]);
+    if (itr == best.end() || scores[i] > itr->second)
+      best[docids[i]] = scores[i];
+  }
+
+  vector<pair<double, string> > docs;
+  for (auto itr = best.begin(); itr != best.end(); ++itr)
+    docs.push_back(std::make_pair(-itr->second, itr->first));
+  std::sort(docs.begin(), docs.end());
+
+  vector<string> ranking(docs.size());
+  foreach (i, docs)
+    ranking[i] = docs[i].second;
+  return ranking;
+}
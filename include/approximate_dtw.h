@@ -0,0 +1,47 @@
+#ifndef __APPROXIMATE_DTW_H_
+#define __APPROXIMATE_DTW_H_
+
+#include <fast_dtw.h>
+#include <frame_reduction.h>
+
+// ===========================
+// ===== Top-k Retrieval =====
+// ===========================
+// The k nearest utterances of every query (every utterance if queries_fn is
+// empty), as "query doc distance" lines. With nCandidates > 0 only the
+// candidates of the PrefilterIndex are aligned.
+void computeTopk(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, const vector<string>& ids, string queries_fn, size_t k, string output_fn, size_t nThreads, size_t nCandidates, bool recall);
+
+// =====================
+// ===== Prefilter =====
+// =====================
+// N x N distances where only the pairs among the nCandidates of each other
+// (see prefilter.h) are aligned
+float* computePrefilteredPairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, size_t nCandidates, size_t nThreads, bool recall, size_t k);
+
+// =====================
+// ===== Landmarks =====
+// =====================
+// N x N similarities reconstructed from the alignments with L landmarks (see
+// landmark.h), or NULL if dense is false and only factors_fn is written
+float* computeLandmarkSimilarity(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, size_t L, string selection, const vector<string>& ids, string factors_fn, size_t nThreads, bool recall, bool dense = true);
+
+// ===============================
+// ===== Vector Quantization =====
+// ===============================
+// N x N distances aligned on codes of a K-centroid codebook (see
+// vector_quantizer.h), the nRescore nearest of each utterance re-aligned on
+// the frames, the other pairs left quantized. Reads archive_fn itself, the
+// utterances in ids (all of them, returned in ids, if it is empty), so that
+// only the codes are held in memory. With recall, everything is read again,
+// for the exact distances and the frame-reduction report.
+float* computeQuantizedPairwiseDTW(string archive_fn, vector<string>& ids, FrameReducer& reducer, string dist_type, string theta_fn, string model_fn, float eta, size_t K, string codebook_fn, size_t nRescore, size_t nThreads, bool recall, size_t k);
+
+// =======================================
+// ===== Frame-rate Reduction Report =====
+// =======================================
+// MAP and recall@k of the distances of reduced frames (scores) against
+// full-rate DTW of data
+void reportFrameReduction(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, const float* scores, const vector<string>& ids, size_t nThreads, size_t k);
+
+#endif // __APPROXIMATE_DTW_H_
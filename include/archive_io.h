@@ -4,6 +4,8 @@
 #include <pbar.h>
 #include <utility.h>
 #include <array.h>
+#include <phone_store.h>
+#include <kaldi_archive.h>
 
 #include <vulcan-hmm.h>
 #include <vulcan-archive.h>
@@ -23,11 +25,19 @@ typedef std::pair<size_t, size_t> Phone;
   << #b << "(" << b << ")" << endl; };
 
 size_t load(string alignmentFile, string modelFile, map<string, vector<Phone> >& phoneLabels, bool dump = false);
-size_t loadFeatureArchive(const string& featArk, const map<string, vector<Phone> >& phoneLabels, map<size_t, vector<FeatureSeq> >& phoneInstances);
 void loadFeatureArchive(string filename, float* &data, unsigned int* &offset, int& N, int& dim, vector<string>* docid = NULL);
+void loadFeatureArchive(string filename, const vector<string>& ids, float* &data, unsigned int* &offset, int& N, int& dim);
+
+// Same as loadFeatureArchive(), but returns false (with the reason in error)
+// instead of exiting, for long-running callers such as the score server
+bool tryLoadFeatureArchive(string filename, float* &data, unsigned int* &offset, int& N, int& dim, string& error);
 
 void save(const FeatureSeq& featureSeq, const string& filename);
-size_t saveFeatureAsMFCC(const map<size_t, vector<FeatureSeq> >& phoneInstances, const vector<string>& phones, string dir);
+
+// Cut the utterances of featArk into phone instances and save them as MFCC
+// files under mfccDir and/or into phoneStore (either may be empty), streaming
+// instead of holding the whole corpus. Returns the number of instances saved.
+size_t extractPhoneInstances(const string& featArk, const map<string, vector<Phone> >& phoneLabels, const vector<string>& phones, string mfccDir, string phoneStore, size_t nThreads = 0);
 
 vector<string> getPhoneMapping(string filename);
 void print(FILE* p, const FeatureSeq& fs);
@@ -0,0 +1,66 @@
+#ifndef __BOUNDED_QUEUE_H_
+#define __BOUNDED_QUEUE_H_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// =========================
+// ===== Bounded Queue =====
+// =========================
+// A FIFO between pipeline stages. push() blocks while the queue is full, so a
+// fast producer cannot run ahead of its consumers by more than capacity items.
+// After close(), pop() drains what is left and then returns false. Items are
+// copied, so pass large payloads as pointers (e.g. std::shared_ptr).
+template <typename T>
+class BoundedQueue {
+public:
+  BoundedQueue(size_t capacity): _capacity(capacity), _closed(false) {}
+
+  void push(const T& item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_items.size() >= _capacity)
+      _notFull.wait(lock);
+
+    _items.push_back(item);
+    lock.unlock();
+    _notEmpty.notify_one();
+  }
+
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_items.empty() && !_closed)
+      _notEmpty.wait(lock);
+
+    if (_items.empty())
+      return false;
+
+    item = _items.front();
+    _items.pop_front();
+    lock.unlock();
+    _notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+    _notEmpty.notify_all();
+  }
+
+private:
+  BoundedQueue(const BoundedQueue&);
+  void operator = (const BoundedQueue&);
+
+  std::mutex _mutex;
+  std::condition_variable _notFull;
+  std::condition_variable _notEmpty;
+
+  std::deque<T> _items;
+  size_t _capacity;
+  bool _closed;
+};
+
+#endif // __BOUNDED_QUEUE_H_
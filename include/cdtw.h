@@ -40,6 +40,11 @@ public:
   static void setDiag(const vector<double>& diag);
 
   static void updateNormalizer();
+  static double calcNormalizer(const vector<double>& diag);
+
+  // Make fn() on the calling thread use diag (a snapshot owned by the caller)
+  // instead of the shared _diag. bind(NULL) switches back to _diag.
+  static void bind(const vector<double>* diag);
 
   static double _normalizer;
 private:
@@ -93,4 +98,67 @@ namespace DtwUtil {
 
 };
 
+// ============================
+// ===== Arena Dtw Runner =====
+// ============================
+// The same forward-backward soft-min DTW as CumulativeDtwRunner, but on frames
+// given as raw pointers (e.g. into a FeatureArena) instead of DtwParm, so that
+// no feature file is opened while scoring.
+class DtwTable {
+public:
+  DtwTable(): _cols(0) {}
+
+  void resize(int rows, int cols) { _cols = cols; _data.resize((size_t) rows * cols); }
+  void fill(float val) { std::fill(_data.begin(), _data.end(), val); }
+
+  float& operator() (int i, int j) { return _data[(size_t) i * _cols + j]; }
+  float operator() (int i, int j) const { return _data[(size_t) i * _cols + j]; }
+
+private:
+  vector<float> _data;
+  int _cols;
+};
+
+// Frames of one sequence. f[t] is the t-th frame, just like DenseFeature.
+class FrameSeq {
+public:
+  FrameSeq(const float* data = NULL, int dim = 0): _data(data), _dim(dim) {}
+  const float* operator[] (int t) const { return _data + (size_t) t * _dim; }
+
+private:
+  const float* _data;
+  int _dim;
+};
+
+class ArenaDtwRunner {
+public:
+  ArenaDtwRunner(VectorDistFn norm): _norm(norm), _qL(0), _dL(0), _dim(0), _cScore(0) {}
+
+  void init(const float* q, int qL, const float* d, int dL, int dim);
+  void DTW(bool scoreOnly = false);
+
+  int qLength() const { return _qL; }
+  int dLength() const { return _dL; }
+
+  const FrameSeq& getQ() const { return _q; }
+  const FrameSeq& getD() const { return _d; }
+  const DtwTable& getAlpha() const { return _alpha; }
+  const DtwTable& getBeta() const { return _beta; }
+  double getCumulativeScore() const { return _cScore; }
+
+private:
+  void calcPdist();
+  void calcAlpha();
+  void calcBeta();
+
+  VectorDistFn _norm;
+  FrameSeq _q, _d;
+  int _qL, _dL, _dim;
+
+  DtwTable _pdist;
+  DtwTable _alpha;
+  DtwTable _beta;
+  double _cScore;
+};
+
 #endif // __CDTW_H
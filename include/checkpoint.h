@@ -0,0 +1,77 @@
+#ifndef __CHECKPOINT_H_
+#define __CHECKPOINT_H_
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <utility.h>
+
+// ==========================
+// ===== Training State =====
+// ==========================
+// Everything besides the parameters themselves that is needed to resume
+// dtw_model::train() exactly where it stopped.
+class TrainingState {
+public:
+  TrainingState();
+
+  bool save(string filename) const;
+  bool load(string filename);
+
+  size_t epoch;		// the next batch to run is batch-th batch in epoch-th epoch
+  size_t batch;
+  float learning_rate;
+  unsigned int seed;	// seed of the sampler (corpus sampling + shuffling)
+
+  // Early-stopping status of dtw_model::validate()
+  double objective;
+  bool aboutToStop;
+  size_t nValidation;
+};
+
+// ========================
+// ===== Checkpointer =====
+// ========================
+// Writes snapshots on a background thread. A snapshot is a job that owns its
+// own copy of the parameters, so the training loop may keep updating its
+// parameters right after submit(). Only the latest snapshot matters: when the
+// writer is still busy, a newer submit() replaces the one waiting in line
+// instead of stalling the caller.
+class Checkpointer {
+public:
+  Checkpointer();
+  ~Checkpointer();
+
+  void submit(std::function<void ()> job);
+
+  // Block until every submitted snapshot has been written.
+  void flush();
+
+  size_t nWritten() const { return _nWritten; }
+  size_t nDropped() const { return _nDropped; }
+
+private:
+  Checkpointer(const Checkpointer&);
+  void operator = (const Checkpointer&);
+
+  void __run__();
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::condition_variable _idle;
+
+  std::function<void ()> _pending;
+  bool _hasPending;
+  bool _busy;
+  bool _stop;
+
+  size_t _nWritten;
+  size_t _nDropped;
+
+  std::thread _thread;
+};
+
+#endif // __CHECKPOINT_H_
@@ -1,10 +1,13 @@
 #ifndef __CORPUS_H_
 #define __CORPUS_H_
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <array.h>
 #include <utility.h>
+#include <feature_arena.h>
+#include <frame_reduction.h>
 
 #define CHT_PHONE 0
 #define EN_PHONE 1
@@ -28,7 +31,11 @@ public:
 
   vector<ppair> getSamples(size_t n);
 
+  // Same as getSamples(), but as indices into the two phone lists
+  vector<std::pair<size_t, size_t> > getIndices(size_t n);
+
   bool isIntraPhone() const;
+  const Array<string>& getList1() const { return _list1; }
 
   static void setListDirectory(string list_directory);
   static void setFeatureDirectory(string mfcc_directory);
@@ -52,6 +59,17 @@ private:
 
 typedef std::pair<ppair, bool> tsample;
 
+// A training pair referring to both phone instances by their index in the
+// FeatureArena of the corpus (see Corpus::loadFeatures)
+struct isample {
+  isample(uint32_t first = 0, uint32_t second = 0, bool positive = false):
+    first(first), second(second), positive(positive) {}
+
+  uint32_t first;
+  uint32_t second;
+  bool positive;
+};
+
 class Corpus: public ICorpus<tsample> {
 public:
   Corpus(int phone_set,
@@ -63,12 +81,34 @@ public:
 
   vector<tsample> getSamples(size_t n);
 
+  // Load every phone instance into one FeatureArena, once. Samples from
+  // getSampleIDs() can then be scored without touching the disk. feat_dir
+  // is either a folder of .mfc files or a phone store (see phone_store.h).
+  void loadFeatures();
+  bool isLoaded() const { return _arena.size() > 0; }
+  const FeatureArena& getArena() const { return _arena; }
+
+  // Shorten every instance as it is loaded (see frame_reduction.h). Must be
+  // called before loadFeatures().
+  void setFrameReduction(string spec) { _reducer = FrameReducer(spec); }
+
+  vector<isample> getSampleIDs(size_t n);
+
   bool isBatchSizeApprop(size_t batchSize);
 
 private:
+  vector<size_t> sampleSubCorpora(size_t n);
+  void loadFeaturesFromFiles();
+  void loadFeaturesFromStore();
+
+  string _feat_dir;
   Array<string> _phones;
   vector<SubCorpus> _sub_corpus;
   vector<float> _prior;
+
+  FeatureArena _arena;
+  FrameReducer _reducer;
+  vector<uint32_t> _base;	// index of the first instance of each phone in _arena
 };
 
 #endif // __CORPUS_H_
@@ -28,6 +28,71 @@ typedef device_matrix<float> mat; typedef thrust::device_vector<float> vec;
 
 vec loadvector(string filename);
 
+#ifndef __CUDACC__
+// Row-major weights which are not owned by a Matrix2D, e.g. the ones living
+// in a memory-mapped model file. Provides just enough of Matrix2D's interface
+// for feedForward() below.
+class weight_view {
+public:
+  weight_view(): _data(NULL), _rows(0), _cols(0) {}
+  weight_view(const float* data, size_t rows, size_t cols): _data(data), _rows(rows), _cols(cols) {}
+
+  size_t getRows() const { return _rows; }
+  size_t getCols() const { return _cols; }
+  const float* operator[] (size_t i) const { return _data + i * _cols; }
+
+private:
+  const float* _data;
+  size_t _rows;
+  size_t _cols;
+};
+
+// y = sigmoid(x * W), where x already carries the bias term in its last slot.
+// W is stored row by row, so accumulate one row of W at a time.
+template <typename M>
+void sigmoid_layer(const float* x, const M& W, float* y) {
+  size_t rows = W.getRows();
+  size_t cols = W.getCols();
+
+  std::fill(y, y + cols, 0);
+  range (j, rows) {
+    const float* w = W[j];
+    float xj = x[j];
+    range (k, cols)
+      y[k] += xj * w[k];
+  }
+
+  func::sigmoid<float> sigmoid;
+  range (k, cols)
+    y[k] = sigmoid(y[k]);
+}
+
+// Feed x (of length weights[0].getRows() - 1) forward through the layers.
+// Every hidden output (including the input layer) keeps an extra slot for the
+// bias term. O is only resized on the first call, so that evaluating frame
+// after frame with the same O does no allocation at all.
+template <typename M>
+void feedForward(const std::vector<M>& weights, const float* x, std::vector<vec>& O) {
+  size_t nLayer = weights.size();
+
+  O.resize(nLayer + 1);
+  O[0].resize(weights[0].getRows());
+  for (size_t i=1; i<nLayer; ++i)
+    O[i].resize(weights[i-1].getCols() + 1);
+  O.back().resize(weights.back().getCols());
+
+  std::copy(x, x + O[0].size() - 1, O[0].begin());
+  O[0].back() = 1.0;
+
+  for (size_t i=1; i<nLayer; ++i) {
+    sigmoid_layer(&O[i-1][0], weights[i-1], &O[i][0]);
+    O[i].back() = 1.0;
+  }
+
+  sigmoid_layer(&O[nLayer - 1][0], weights[nLayer - 1], &O.back()[0]);
+}
+#endif
+
 class DNN {
 public:
   DNN();
@@ -36,6 +101,7 @@ public:
   DNN& operator = (DNN rhs);
 
   void load(string folder);
+  void setWeights(const std::vector<mat>& weights);
 
   void randInit();
   /*void feedForward(const vec& x, std::vector<vec>* hidden_output);
@@ -57,6 +123,13 @@ public:
     O.back() = ext::sigmoid(O[end - 1] * _weights[end - 1]);
   }
 
+#ifndef __CUDACC__
+  // Zero-copy version of feedForward. x points to a frame of length _dims[0].
+  // See ::feedForward() below.
+  void feedForward(const float* x, size_t length, std::vector<vec>* hidden_output) const;
+  void initHiddenOutput(std::vector<vec>& hidden_output) const;
+#endif
+
   void backPropagate(vec& p, std::vector<vec>& hidden_output, std::vector<mat>& gradient);
   void backPropagate(mat& p, std::vector<mat>& hidden_output, std::vector<mat>& gradient, const vec& coeff);
 
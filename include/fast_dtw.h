@@ -3,17 +3,26 @@
 
 #include <string>
 #include <queue>
+#include <cfloat>
 
 #include <archive_io.h>
 #include <utility.h>
 #include <math_ext.h>
+#include <model_io.h>
+#include <sim_matrix.h>
+#include <score_cache.h>
 
 using namespace std;
 typedef vector<vulcan::DoubleVector> FeatureSeq;
 
 class distance_fn {
 public:
+  virtual ~distance_fn() {}
+
   virtual float operator() (const float* x, const float* y, size_t dim) = 0;
+
+  // The smallest value the distance can ever take, -FLT_MAX if unknown
+  virtual float lowerBound() const { return -FLT_MAX; }
 };
 
 class euclidean_fn : public distance_fn {
@@ -24,6 +33,8 @@ class euclidean_fn : public distance_fn {
 	d += pow(x[i] - y[i], 2.0);
       return sqrt(d);
     }
+
+    virtual float lowerBound() const { return 0; }
 };
 
 class mahalanobis_fn : public distance_fn {
@@ -43,12 +54,14 @@ public:
     return sqrt(d); // - _normalizer;
   }
 
+  virtual float lowerBound() const { return 0; }
+
   virtual void setDiag(string filename) {
     if (filename.empty())
       return;
 
     vector<float> diag;
-    ext::load(diag, filename);
+    loadTheta(diag, filename);
     this->setDiag(diag);
 
     double product = 1;
@@ -86,8 +99,71 @@ public:
       d += x[i] * y[i] * _diag[i];
     return -log(d);
   }
+
+  // Negative whenever the weighted inner product exceeds 1
+  virtual float lowerBound() const { return -FLT_MAX; }
+};
+
+#ifndef __CUDACC__
+#include <pthread.h>
+#include <model.h>
+
+// DTW-DNN distance using the weights in place from a binary model file
+class mapped_dnn_fn : public distance_fn {
+public:
+
+  mapped_dnn_fn(string filename, size_t dim) {
+    if (!_model.open(filename)) {
+      fprintf(stderr, "Cannot load DTW-DNN model from %s\n", filename.c_str());
+      exit(-1);
+    }
+
+    if (_model.getDim() != dim) {
+      fprintf(stderr, "[Error] DTW-DNN model %s takes %lu-dimensional features, not %lu\n", filename.c_str(), _model.getDim(), dim);
+      exit(-1);
+    }
+
+    pthread_key_create(&_key, freeHiddenOutput);
+  }
+
+  virtual ~mapped_dnn_fn() {
+    pthread_key_delete(_key);
+  }
+
+  // One hidden-output buffer per thread, owned through a pthread key (and
+  // freed when the thread exits), so that several threads can share this
+  // distance.
+  virtual float operator() (const float* x, const float* y, size_t dim) {
+    if (dim != _model.getDim()) {
+      fprintf(stderr, "[Error] DTW-DNN model takes %lu-dimensional features, not %lu\n", _model.getDim(), dim);
+      exit(-1);
+    }
+
+    HIDDEN_OUTPUT* hidden_output = (HIDDEN_OUTPUT*) pthread_getspecific(_key);
+    if (hidden_output == NULL) {
+      hidden_output = new HIDDEN_OUTPUT;
+      pthread_setspecific(_key, hidden_output);
+    }
+    return _model.evaluate(x, y, *hidden_output);
+  }
+
+private:
+  mapped_dnn_fn(const mapped_dnn_fn&);
+  mapped_dnn_fn& operator = (const mapped_dnn_fn&);
+
+  static void freeHiddenOutput(void* p) {
+    delete (HIDDEN_OUTPUT*) p;
+  }
+
+  MappedModel _model;
+  pthread_key_t _key;
 };
 
+// "ma" or "lip" (with theta_fn), "eu", or "dnn" (with model_fn). Exits on an
+// unknown type.
+distance_fn* initDistanceMeasure(string dist_type, size_t dim, string theta_fn, string model_fn = "");
+#endif
+
 // =======================================
 // ===== Dynamic Time Warping in CPU =====
 // =======================================
@@ -102,10 +178,90 @@ float fast_dtw(
     float* alpha = NULL,
     float* beta = NULL);
 
+// DTW distance between utterances i and j. pdist and alpha are scratch
+// buffers, grown as needed and reused from call to call.
+float pairDTW(const float* data, const unsigned int* offset, int dim, distance_fn& fn, float eta, int i, int j, vector<float>& pdist, vector<float>& alpha);
+
 float* computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta);
 
+// Fill in only the pairs involving at least one utterance with needed[i]
+// set, on nThreads threads (0 for all cores). The other entries of the N x N
+// scores are left as they are. With a cache, pairs are looked up there first
+// under ScoreCache::makeKey(hash of i, hash of j, context).
+void computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta, float* scores, const vector<bool>& needed, size_t nThreads = 0, ScoreCache* cache = NULL, uint64_t context = 0);
+
+// Row i of the above (pairs (i, j), j < i, and the diagonal), for callers that
+// schedule rows on their own threads. needed and cache are optional; hash[k]
+// is ScoreCache::hashFeature() of utterance k when a cache is given.
+void computePairwiseDTWRow(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta, float* scores, int i, const vector<bool>* needed = NULL, ScoreCache* cache = NULL, const uint64_t* hash = NULL, uint64_t context = 0);
+
+// Out-of-core version: the lower triangle is computed tile by tile on nThreads
+// threads (0 for all cores) and written straight into scores, a
+// SIM_MATRIX_LOWER float32 matrix that is normally mmap'ed from disk. A tile
+// is marked done in the bitmap only after its scores are synced, so a killed
+// job resumes from the tiles still missing. Returns the number of tiles
+// computed by this call.
+size_t computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta, SimMatrix& scores, TileBitmap& tiles, size_t nThreads = 0);
+
 void pair_distance(const float* f1, const float* f2, size_t rows, size_t cols, size_t dim, float eta, float* pdist, distance_fn& fn);
 
+// ===== Several etas at once =====
+// Only the soft minimum depends on eta, so pdist is computed once and the
+// recursion run for all K etas together: the DP keeps two rows of K
+// interleaved lanes, cell (x, y) of the k-th eta at [y * K + k].
+// distances[k] is exactly fast_dtw(pdist, rows, cols, dim, etas[k]).
+void fast_dtw(const float* pdist, size_t rows, size_t cols, const vector<float>& etas, float* distances, vector<float>& buffer);
+
+// pairDTW() for every eta in etas, into distances[0 .. K-1]
+void pairDTW(const float* data, const unsigned int* offset, int dim, distance_fn& fn, const vector<float>& etas, int i, int j, vector<float>& pdist, vector<float>& buffer, float* distances);
+
+// One N x N distance matrix per eta, scores[k] for etas[k], rows spread over
+// nThreads threads (0 for all cores). Only j <= i is set, so the matrices can
+// be SIM_MATRIX_LOWER files.
+void computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, const vector<float>& etas, const vector<SimMatrix*>& scores, size_t nThreads = 0);
+
+// ===== Several diagonal models at once =====
+// For --type=ma every theta weighs the same squared differences (x - y)^2, and
+// for --type=lip the same products x * y. Per frame x of f1 the squares are
+// formed once for all cols frames of f2 (a cols x dim tile), and the K models
+// are applied side by side, one lane each, so the frame pairs are visited
+// once instead of K times. pdist[k] (rows x cols) is exactly what
+// mahalanobis_fn / log_inner_product_fn with diagonal thetas[k] would give.
+void pair_distance(const float* f1, const float* f2, size_t rows, size_t cols, size_t dim, const vector<vector<float> >& thetas, bool innerProduct, const vector<float*>& pdist, vector<double>& tile);
+
+// One N x N distance matrix per theta, scores[k] for thetas[k], rows spread
+// over nThreads threads (0 for all cores). Only j <= i is set, as above.
+void computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, const vector<vector<float> >& thetas, bool innerProduct, float eta, const vector<SimMatrix*>& scores, size_t nThreads = 0);
+
+// ===== Top-k retrieval =====
+// fast_dtw() of f1 (rows frames) and f2 (cols frames), or FLT_MAX as soon as
+// the result is sure to exceed threshold. The DP runs one row at a time, and
+// after row x no path can end below
+//
+//   min_y alpha[x][y] - discount * (rows-1-x + cols-1-y)
+//
+// since each later cell adds at least fn.lowerBound() and the soft minimum is
+// at most ln(3) / |eta| below the hard one, so discount = max(0, ln(3) / |eta|
+// - fn.lowerBound()). When the distance has a lower bound, pdist is also only
+// computed for the rows actually reached; otherwise it is computed up front
+// and its minimum used instead. nRows returns the number of rows computed.
+float bounded_dtw(const float* f1, const float* f2, size_t rows, size_t cols, size_t dim, float eta, distance_fn& fn, float threshold, vector<float>& buffer, size_t& nRows);
+
+struct TopkStats {
+  TopkStats(): nAligned(0), nAbandoned(0), nRows(0), nRowsComputed(0) {}
+  size_t nAligned, nAbandoned;
+  size_t nRows, nRowsComputed;
+};
+
+// Mean frame of every utterance, N x dim
+vector<float> utteranceMeans(const float* data, const unsigned int* offset, int N, int dim);
+
+// The k candidates nearest to utterance q, as (distance, index), nearest first.
+// With means, candidates are tried in increasing order of the cheap estimate
+// fn(mean of q, mean of c) * max(length of q, length of c), so that the heap
+// fills with close ones early and the rest are abandoned sooner.
+vector<pair<float, int> > topkDTW(const float* data, const unsigned int* offset, int dim, distance_fn& fn, float eta, int q, const vector<int>& candidates, size_t k, const float* means = NULL, TopkStats* stats = NULL);
+
 void free2D(float** p, size_t m);
 float** malloc2D(size_t m, size_t n);
 
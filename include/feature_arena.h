@@ -0,0 +1,45 @@
+#ifndef __FEATURE_ARENA_H_
+#define __FEATURE_ARENA_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <utility.h>
+
+// =========================
+// ===== Feature Arena =====
+// =========================
+// Variable-length feature sequences stored back to back in one contiguous
+// float buffer. Sequence i occupies frames [offset(i), offset(i+1)) and is
+// referred to by its index i only. Offsets are in frames and 64-bit, so the
+// arena is not limited to 4G floats.
+class FeatureArena {
+public:
+  FeatureArena(size_t dim = 0);
+
+  // Append a sequence of nFrames frames and return its index
+  size_t push_back(const float* data, size_t nFrames);
+
+  // Append room for a sequence of nFrames frames, to be filled in place
+  float* append(size_t nFrames);
+
+  void reserve(size_t nSequences, size_t nFrames);
+  void clear();
+
+  size_t size() const { return _offset.size() - 1; }
+  size_t getDim() const { return _dim; }
+  void setDim(size_t dim) { _dim = dim; }
+
+  size_t length(size_t i) const { return _offset[i+1] - _offset[i]; }
+  const float* data(size_t i) const { return _data.data() + _offset[i] * _dim; }
+
+  size_t nFrames() const { return _offset.back(); }
+  size_t bytes() const;
+
+private:
+  size_t _dim;
+  std::vector<float> _data;
+  std::vector<uint64_t> _offset;
+};
+
+#endif // __FEATURE_ARENA_H_
@@ -0,0 +1,53 @@
+#ifndef __FRAME_REDUCTION_H_
+#define __FRAME_REDUCTION_H_
+
+#include <vector>
+
+#include <utility.h>
+
+// ================================
+// ===== Frame-rate Reduction =====
+// ================================
+// DTW costs rows x cols, and consecutive frames within a phone are often
+// near-duplicates. Every utterance can be shortened once, when it is loaded:
+//
+//   skip:N	keep every N-th frame (the first, the (N+1)-th, ...)
+//   average:N	replace every N consecutive frames by their mean
+//   merge:T	grow a run of consecutive frames as long as the next frame is
+//		within Euclidean distance T of the mean of the run, and replace
+//		the run by that mean (variable length)
+//
+// An empty spec (or "none") leaves the frames as they are. An utterance never
+// shrinks below one frame.
+class FrameReducer {
+public:
+  FrameReducer(string spec = "");
+
+  bool isEnabled() const { return _method != NONE; }
+  string getSpec() const { return _spec; }
+
+  // Returns the new number of frames. out may be the same buffer as in.
+  size_t reduce(const float* in, size_t length, size_t dim, float* out) const;
+
+  // A whole archive as loadFeatureArchive() gives it (offsets in floats),
+  // compacted in place
+  void reduce(float* data, unsigned int* offset, int N, int dim);
+
+  // Frames seen / kept by reduce(), and their ratio
+  void count(size_t in, size_t out) { _nIn += in; _nOut += out; }
+  double ratio() const { return _nOut ? (double) _nIn / _nOut : 1; }
+  void printStats() const;
+
+private:
+  enum { NONE, SKIP, AVERAGE, MERGE };
+
+  string _spec;
+  int _method;
+  size_t _factor;
+  float _threshold;
+
+  size_t _nIn;
+  size_t _nOut;
+};
+
+#endif // __FRAME_REDUCTION_H_
@@ -1,10 +1,73 @@
 #ifndef __IPC_H
 #define __IPC_H
 #include <utility.h>
+#include <stdint.h>
+#include <atomic>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+// ==============================
+// ===== Shared-Memory Ring =====
+// ==============================
+// A single-producer / single-consumer byte ring in POSIX shared memory
+// (shm_open). One process writes, another reads. Data is copied straight
+// between the caller's buffer and the ring; a message larger than the ring
+// is simply streamed through it in pieces. A side that has to wait (ring
+// full / empty) sleeps on a futex in the shared header instead of spinning.
+struct ShmRingHeader {
+  char magic[8];
+  uint64_t capacity;			// bytes, a power of two
+
+  std::atomic<uint64_t> head;		// bytes ever written
+  char __pad1[64 - sizeof(uint64_t)];
+  std::atomic<uint64_t> tail;		// bytes ever read
+  char __pad2[64 - sizeof(uint64_t)];
+
+  // futex words, bumped whenever head / tail moves
+  std::atomic<uint32_t> dataSeq;
+  std::atomic<uint32_t> spaceSeq;
+  std::atomic<uint32_t> readerWaiting;
+  std::atomic<uint32_t> writerWaiting;
+};
+
+class ShmRing {
+public:
+  ShmRing();
+  ~ShmRing();
+
+  // Create the ring if no one has yet, otherwise attach to it. Attaching
+  // gives up (false) if the creator does not finish setting it up in time.
+  bool open(string name, size_t capacity = 1 << 22);
+  void close();
+
+  // Whether open() created the ring rather than attached to it
+  bool isCreator() const { return _creator; }
+
+  // Block until all n bytes are written / read
+  void write(const void* data, size_t n);
+  void read(void* data, size_t n);
+
+  // Remove the shared memory object (the mapping stays valid)
+  static void unlink(string name);
+
+private:
+  ShmRing(const ShmRing&);
+  void operator = (const ShmRing&);
+
+  ShmRingHeader* _header;
+  char* _data;
+  size_t _mask;
+  size_t _size;
+  bool _creator;
+};
+
+// =============================
+// ===== Inter-Process I/O =====
+// =============================
+// Sends on the first channel and receives on the second, so the peer process
+// opens the same two names the other way round. Each message carries its own
+// length, and a vector goes through in one bulk copy.
 class IPC {
   public:
     IPC(string fifo1 = "", string fifo2 = "");
@@ -22,15 +85,47 @@ class IPC {
     string getFifo1() const { return _fifo1; }
     string getFifo2() const { return _fifo2; }
 
+    // Start over with empty channels
     void clear_fifo();
-    
+
+  private:
+    void __open();
+
+    string _fifo1;
+    string _fifo2;
+    ShmRing _out;
+    ShmRing _in;
+};
+
+// =================
+// ===== FIFOs =====
+// =================
+// The previous transport over two named pipes, reopened for every message.
+// Kept for peers that still speak it, and as the baseline of ipc_example.
+class FifoIPC {
+  public:
+    FifoIPC(string fifo1 = "", string fifo2 = "");
+    ~FifoIPC ();
+
+    FifoIPC& operator << (string msg);
+    FifoIPC& operator >> (string& ack);
+
+    template <typename T>
+    FifoIPC& operator << (const vector<T>& vec);
+
+    template <typename T>
+    FifoIPC& operator >> (vector<T>& vec);
+
+    string getFifo1() const { return _fifo1; }
+    string getFifo2() const { return _fifo2; }
+
+    void clear_fifo();
+
   private:
     void __createFifoIfNotExists(string fifo);
 
     string _fifo1;
     string _fifo2;
-    int _out;
-    int _in;
 };
 
 #endif // __IPC_H
@@ -0,0 +1,116 @@
+#ifndef __KALDI_ARCHIVE_H_
+#define __KALDI_ARCHIVE_H_
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <utility.h>
+#include <feature_arena.h>
+
+// ================================
+// ===== Kaldi Archive Reader =====
+// ================================
+// Reads feature matrices from a Kaldi archive (ark) straight into a
+// FeatureArena, without going through Vulcan and double precision. Both the
+// binary format ("<key> \0B" followed by a FM or DM matrix) and the text
+// format ("<key> [ ... ]") are supported, even mixed in one archive.
+// Compressed matrices (CM) are not.
+class KaldiArchiveReader {
+public:
+  KaldiArchiveReader();
+  ~KaldiArchiveReader();
+
+  // A large buffer suits reading the whole archive, a small one suits
+  // jumping around with seek().
+  bool open(string filename, size_t bufferSize = 1 << 22);
+  void close();
+
+  // A malformed archive prints the error and exits, unless told otherwise.
+  // Then read() / skip() just return false, and getError() says why.
+  void setExitOnError(bool exitOnError) { _exitOnError = exitOnError; }
+  string getError() const { return _error; }
+
+  // Append the next utterance to the arena. Returns false at the end of the
+  // archive. The dimension of the arena is set by the first utterance if it
+  // is still 0.
+  bool read(FeatureArena& arena, string& key);
+
+  // Same as read(), but step over the matrix instead of loading it
+  bool skip(string& key);
+
+  // Whether the last matrix read() was binary single precision (FM)
+  bool lastWasFloatMatrix() const { return _lastWasFloatMatrix; }
+
+  // Byte offset of the next utterance, and jump to one
+  uint64_t tell() const;
+  bool seek(uint64_t offset);
+
+private:
+  KaldiArchiveReader(const KaldiArchiveReader&);
+  void operator = (const KaldiArchiveReader&);
+
+  bool readKey(string& key);
+  bool isBinary(const string& key, bool& binary);
+  bool readBinary(FeatureArena& arena, const string& key);
+  bool readText(FeatureArena& arena, const string& key);
+  bool readInt32(const string& key, int32_t& value);
+
+  bool error(const string& key, const string& msg);
+
+  string _filename;
+  FILE* _fid;
+  bool _lastWasFloatMatrix;
+  bool _exitOnError;
+  string _error;
+  std::vector<char> _buffer;
+  std::vector<double> _doubles;
+  std::vector<float> _row;
+};
+
+// ===============================
+// ===== Kaldi Archive Index =====
+// ===============================
+// Byte offset of every utterance in an archive, like a Kaldi scp file. The
+// index is cached in <archive>.idx and rebuilt whenever the size or the
+// modification time of the archive changes.
+class KaldiArchiveIndex {
+public:
+  bool open(string archive);
+
+  size_t size() const { return _keys.size(); }
+  const vector<string>& getKeys() const { return _keys; }
+  uint64_t getOffset(size_t i) const { return _offsets[i]; }
+
+  // Position of the utterance in the archive, or -1 if it is not there
+  int find(const string& key) const;
+
+  static string getCacheFilename(const string& archive);
+
+private:
+  bool loadCache(const string& filename, uint64_t size, uint64_t mtime);
+  void saveCache(const string& filename, uint64_t size, uint64_t mtime) const;
+  void build(const string& archive);
+
+  vector<string> _keys;
+  vector<uint64_t> _offsets;
+  map<string, size_t> _position;
+};
+
+// Load a whole archive. Returns the number of utterances read.
+size_t loadKaldiArchive(string filename, FeatureArena& arena, vector<string>* keys = NULL);
+
+// Same, but returns false (with the reason in error) instead of exiting when
+// the archive is missing or malformed
+bool tryLoadKaldiArchive(string filename, FeatureArena& arena, string& error, vector<string>* keys = NULL);
+
+// Load only the utterances in ids, in that order, through the index.
+// Exits if one of them is not in the archive.
+void loadKaldiArchive(string filename, const vector<string>& ids, FeatureArena& arena);
+
+// One utterance ID per line (anything after the first whitespace is ignored)
+vector<string> loadIdList(string filename);
+
+#endif // __KALDI_ARCHIVE_H_
@@ -0,0 +1,53 @@
+#ifndef __LANDMARK_H_
+#define __LANDMARK_H_
+
+#include <vector>
+
+#include <utility.h>
+
+// ============================================
+// ===== Landmark (Nystrom) Approximation =====
+// ============================================
+// Only the similarities of every utterance to L landmark utterances are
+// computed (C, N x L). With W the L x L block of the landmarks among
+// themselves, the whole matrix is approximated by
+//
+//   S ~ C W+ C^T
+//
+// where W+ is the pseudo-inverse of W, which leaves out eigenvalues under 1%
+// of the largest. W comes from DTW and need not be positive definite, so W+
+// keeps the eigenvalues of both signs and the factorization is stored as
+//
+//   S ~ G diag(sign) G^T,	G = C U |Lambda|^(-1/2)	  (N x rank)
+
+// "random" or "kmeans++" (D^2 seeding on points, N x dim, e.g. the mean frame
+// of each utterance). The same seed gives the same landmarks.
+vector<int> selectLandmarks(const float* points, int N, int dim, size_t L, string method, unsigned int seed = 0);
+
+class NystromFactors {
+public:
+  // C: N x L, row-major; C[landmarks[k] * L + l] is W[k][l]
+  NystromFactors(const vector<int>& landmarks, const vector<float>& C, int N);
+
+  size_t rank() const { return _sign.size(); }
+
+  float operator () (int i, int j) const;
+
+  // The full N x N approximation, clamped to [0, 1] with a unit diagonal
+  void reconstruct(float* S, size_t nThreads = 0) const;
+
+  // Text: "N rank", the signs, then one "<id> <G row>" line per utterance
+  void save(string filename, const vector<string>& ids) const;
+
+private:
+  int _N;
+  vector<int> _landmarks;
+  vector<float> _G;
+  vector<float> _sign;
+};
+
+// Eigen-decomposition of the symmetric n x n matrix A (row-major) by cyclic
+// Jacobi rotations. Column k of U goes with lambda[k].
+void symmetricEigen(vector<double> A, size_t n, vector<double>& lambda, vector<double>& U);
+
+#endif // __LANDMARK_H_
@@ -243,6 +243,17 @@ namespace ext {
     return s;
   }
 
+  template <typename T>
+  void inplace_softmax(vector<T>& x) {
+    T s = 0;
+    foreach (i, x)
+      s += (x[i] = exp(x[i]));
+
+    T denominator = 1.0 / s;
+    foreach (i, x)
+      x[i] *= denominator;
+  }
+
   // ============================
   // ===== Sigmoid Function =====
   // ============================
@@ -2,6 +2,35 @@
 #define __MODEL_H_
 
 #include <dnn.h>
+#include <model_io.h>
+
+// ============================================================
+// ===== d(x, y) = DTW-DNN( PP-DNN(x) .* PP-DNN(y) .* w ) =====
+// ============================================================
+// Shared by Model (weights in Matrix2D) and MappedModel (weights used in place
+// from a memory-mapped model file).
+template <typename M>
+float evaluateModel(const std::vector<M>& pp, const float* w, const std::vector<M>& dtw, const float* x, const float* y, HIDDEN_OUTPUT& O) {
+
+  HIDDEN_OUTPUT_ALIASING(O, Ox, Oy, Om, Od);
+
+  feedForward(pp, x, Ox);
+  feedForward(pp, y, Oy);
+
+  ext::inplace_softmax(Ox.back());
+  ext::inplace_softmax(Oy.back());
+
+  // Om = Ox.back() & Oy.back() & w;
+  const vec& ox = Ox.back();
+  const vec& oy = Oy.back();
+  Om.resize(ox.size());
+  foreach (i, Om)
+    Om[i] = ox[i] * oy[i] * w[i];
+
+  feedForward(dtw, &Om[0], Od);
+
+  return Od.back()[0];
+}
 
 class Model {
 public:
@@ -13,10 +42,14 @@ public:
 
   void load(string folder);
   void initHiddenOutputAndGradient();
+  void initHiddenOutput(HIDDEN_OUTPUT& O) const;
 
   void train(const vec& x, const vec& y);
   float evaluate(const vec& x, const vec& y);
   float evaluate(const float* x, const float* y);
+  // Thread-safe evaluation: all intermediate results go into the caller's
+  // (per-thread) buffer O, which never reallocates after initHiddenOutput(O).
+  float evaluate(const float* x, const float* y, HIDDEN_OUTPUT& O) const;
   void calcGradient(const vec& x, const vec& y);
   void calcGradient(const float* x, const float* y);
   void updateParameters(GRADIENT& g);
@@ -25,7 +58,11 @@ public:
   HIDDEN_OUTPUT& getHiddenOutput();
   GRADIENT& getGradient();
   void getEmptyGradient(GRADIENT& g);
-  void save(string folder) const;
+  // Either a folder of text matrices (pp.w.N, m.w, dtw.w.N), or a single
+  // binary model file when the path ends with ".bin" (see model_io.h).
+  void save(string path) const;
+  void saveBinary(string filename) const;
+  void loadBinary(string filename);
   void print() const;
 
   friend void swap(Model& lhs, Model& rhs);
@@ -43,6 +80,25 @@ private:
 
 void swap(Model& lhs, Model& rhs);
 
+// ===================================================
+// ===== DTW-DNN Model used in place from a file =====
+// ===================================================
+// Read-only counterpart of Model for inference. Nothing is copied on load:
+// the weights are used directly from the memory-mapped binary model file.
+class MappedModel {
+public:
+  bool open(string filename);
+
+  float evaluate(const float* x, const float* y, HIDDEN_OUTPUT& O) const;
+  size_t getDim() const { return _pp[0].getRows() - 1; }
+
+private:
+  ModelFile _file;
+  std::vector<weight_view> _pp;
+  const float* _w;
+  std::vector<weight_view> _dtw;
+};
+
 GRADIENT& operator += (GRADIENT& g1, const GRADIENT& g2);
 GRADIENT& operator -= (GRADIENT& g1, const GRADIENT& g2);
 GRADIENT& operator *= (GRADIENT& g, float c);
@@ -0,0 +1,144 @@
+#ifndef __MODEL_IO_H_
+#define __MODEL_IO_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <matrix.h>
+#include <utility.h>
+#include <math_ext.h>
+
+// =============================
+// ===== Binary Model File =====
+// =============================
+// A single versioned file holding every weight of a model:
+//
+//   +-----------------+
+//   | ModelFileHeader |
+//   +-----------------+
+//   | ModelBlob[0..n) |  table of contents
+//   +-----------------+
+//   | float32 blob 0  |  row-major, aligned to MODEL_FILE_ALIGNMENT bytes
+//   | float32 blob 1  |
+//   | ...             |
+//   +-----------------+
+//
+// Since every blob is aligned and stored in native float32, the file can be
+// mmap'ed and the weights used in place (see MappedModel in model.h).
+//
+// DNN_MODEL_FILE:  pp.w.0 ... pp.w.{nPPLayers-1}, m.w, dtw.w.0 ...
+// DIAG_MODEL_FILE: theta (1 x dim)
+
+#define MODEL_FILE_MAGIC "TDTWMDL"
+#define MODEL_FILE_VERSION 1
+#define MODEL_FILE_ALIGNMENT 64
+
+enum MODEL_FILE_TYPE {
+  DNN_MODEL_FILE = 1,
+  DIAG_MODEL_FILE = 2
+};
+
+struct ModelFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t type;
+  uint32_t nBlobs;
+  uint32_t nPPLayers;
+  uint64_t fileSize;
+  uint64_t checksum;	// FNV-1a over all blobs, in order
+};
+
+struct ModelBlob {
+  uint64_t offset;	// in bytes, from the beginning of the file
+  uint32_t rows;
+  uint32_t cols;
+};
+
+uint64_t fnv1a(const void* data, size_t nBytes, uint64_t hash = 14695981039346656037ULL);
+
+class ModelFileWriter {
+public:
+  ModelFileWriter(uint32_t type, uint32_t nPPLayers = 0);
+
+  void add(const Matrix2D<float>& m);
+  void add(const float* data, size_t rows, size_t cols);
+
+  template <typename T>
+  void add(const vector<T>& v) {
+    vector<float> row(v.begin(), v.end());
+    this->add(&row[0], 1, row.size());
+  }
+
+  // Written to a temporary file first and then renamed, so that a reader
+  // never sees a half-written model.
+  bool save(string filename) const;
+
+private:
+  uint32_t _type;
+  uint32_t _nPPLayers;
+  vector<size_t> _rows;
+  vector<size_t> _cols;
+  vector<vector<float> > _data;
+};
+
+class ModelFile {
+public:
+  ModelFile();
+  ~ModelFile();
+
+  // mmap the file and verify its header, table of contents and checksum.
+  bool open(string filename);
+  void close();
+  bool isOpen() const { return _header != NULL; }
+
+  uint32_t type() const { return _header->type; }
+  uint32_t nPPLayers() const { return _header->nPPLayers; }
+  size_t nBlobs() const { return _header->nBlobs; }
+
+  size_t rows(size_t i) const { return _blobs[i].rows; }
+  size_t cols(size_t i) const { return _blobs[i].cols; }
+  const float* data(size_t i) const { return (const float*) ((const char*) _addr + _blobs[i].offset); }
+
+  void copyTo(size_t i, Matrix2D<float>& m) const;
+
+  template <typename T>
+  void copyTo(size_t i, vector<T>& v) const {
+    const float* d = this->data(i);
+    v.assign(d, d + rows(i) * cols(i));
+  }
+
+  static bool isModelFile(string filename);
+
+private:
+  ModelFile(const ModelFile&);
+  void operator = (const ModelFile&);
+
+  void* _addr;
+  size_t _size;
+  const ModelFileHeader* _header;
+  const ModelBlob* _blobs;
+};
+
+// ===================================================
+// ===== Load theta (diagonal terms) from a file =====
+// ===================================================
+// Accept both the binary model file and the old text format.
+template <typename T>
+void loadTheta(vector<T>& theta, string filename) {
+
+  if (!ModelFile::isModelFile(filename)) {
+    ext::load(theta, filename);
+    return;
+  }
+
+  ModelFile file;
+  if (!file.open(filename) || file.type() != DIAG_MODEL_FILE) {
+    fprintf(stderr, "Cannot load theta from %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  file.copyTo(0, theta);
+}
+
+#endif // __MODEL_IO_H_
@@ -0,0 +1,62 @@
+#ifndef __PAIRWISE_DTW_H_
+#define __PAIRWISE_DTW_H_
+
+#include <fast_dtw.h>
+#include <frame_reduction.h>
+
+// ========================
+// ===== Score Output =====
+// ========================
+// Distances are written as similarities: min-max normalized so that the
+// closest pair gets 1 and the farthest 0, the diagonal 1.
+void cvtDistanceToSimilarity(float* m, int N);
+
+// Same, streaming from raw distances on disk (a float32 lower triangle) to a
+// new matrix file, format "bin" (layout and precision apply) or "text"
+void cvtDistanceToSimilarity(const SimMatrix& distances, string output_fn, int layout, int precision, string format = "bin");
+
+void print(FILE* fid, float* m, int N);
+
+// format is "text" (to stdout if output_fn is empty) or "bin" (sim_matrix.h)
+void saveScores(string output_fn, float* scores, int N, string format, int layout, int precision, size_t nThreads = 0);
+
+// ==============================
+// ===== Incremental Update =====
+// ==============================
+// Raw distances saved with their utterance IDs in <file>.ids and, in
+// <file>.hashes, the context (distance, theta/model, eta, frame reduction)
+// and the hash of every utterance they were computed from.
+void saveDistances(string filename, const float* scores, const vector<string>& ids, const float* data, const unsigned int* offset, uint64_t context);
+vector<uint64_t> hashUtterances(const float* data, const unsigned int* offset, int N);
+bool loadDistanceHashes(string filename, uint64_t& context, vector<uint64_t>& hash);
+
+// Distances between unchanged utterances already in prev_fn are copied from
+// there, the rest are computed. Exits if prev_fn was made in another context.
+float* updatePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, const vector<string>& ids, string prev_fn, size_t nThreads, ScoreCache* cache = NULL, uint64_t context = 0);
+
+// =============================
+// ===== Out-of-core Tiles =====
+// =============================
+// The raw distances go to <output>.work and the finished tiles to
+// <output>.tiles, so that a killed job resumes where it stopped. The
+// fingerprint identifies the input.
+void computeTiledPairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, string output_fn, int layout, int precision, size_t tileSize, size_t nThreads, uint64_t fingerprint);
+
+// =========================================
+// ===== Several etas / thetas at once =====
+// =========================================
+// One matrix per eta (or theta), written to output_pattern with {eta} (or
+// {theta}, the file name without its directory) replaced. The raw distances
+// of each go to its own <output>.work file as the rows finish, and are then
+// converted to the output and removed.
+void computeEtaList(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, const vector<string>& etas, string output_pattern, string format, int layout, int precision, size_t nThreads);
+void computeThetaList(const float* data, const unsigned int* offset, int N, int dim, string dist_type, const vector<string>& thetas, float eta, string output_pattern, string format, int layout, int precision, size_t nThreads);
+
+// =============================
+// ===== Multi-query Batch =====
+// =============================
+// One matrix per query of list_fn, from archive_pattern to output_pattern
+// with {query} replaced. All queries share one pool of nThreads threads.
+void computeQueryList(string list_fn, string archive_pattern, string output_pattern, string dist_type, string theta_fn, string model_fn, float eta, string format, int layout, int precision, size_t nThreads, ScoreCache* cache, uint64_t context, FrameReducer& reducer);
+
+#endif // __PAIRWISE_DTW_H_
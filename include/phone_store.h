@@ -0,0 +1,84 @@
+#ifndef __PHONE_STORE_H_
+#define __PHONE_STORE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <utility.h>
+
+// =============================
+// ===== Phone Store File ======
+// =============================
+// Every phone instance of a corpus in a single file, written by extract:
+//
+//   +----------------------------+
+//   | PhoneStoreHeader           |
+//   +----------------------------+
+//   | PhoneStoreEntry[nPhones]   |  instances of phone p are [first, first + n)
+//   +----------------------------+
+//   | uint64 offset[nInst + 1]   |  in frames, instance i = [offset[i], offset[i+1])
+//   +----------------------------+
+//   | float32 frames (nFrames    |  aligned to PHONE_STORE_ALIGNMENT bytes
+//   |   x dim), row-major        |
+//   +----------------------------+
+//
+// Phones are indexed as in the phone table (the same index as the list file
+// <index>.list). The k-th instance of a phone is the one extract would have
+// saved as <phone>/<k>.mfc, so the existing list files still apply.
+
+#define PHONE_STORE_MAGIC "TDTWPHS"
+#define PHONE_STORE_VERSION 1
+#define PHONE_STORE_ALIGNMENT 64
+
+struct PhoneStoreHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dim;
+  uint32_t nPhones;
+  uint32_t reserved;
+  uint64_t nInstances;
+  uint64_t nFrames;
+  uint64_t dataOffset;	// in bytes, where the frames begin
+  uint64_t fileSize;
+};
+
+struct PhoneStoreEntry {
+  uint64_t first;
+  uint64_t nInstances;
+};
+
+class PhoneStore {
+public:
+  PhoneStore();
+  ~PhoneStore();
+
+  // mmap the store and verify its header and index
+  bool open(string filename);
+  void close();
+  bool isOpen() const { return _header != NULL; }
+
+  size_t getDim() const { return _header->dim; }
+  size_t nPhones() const { return _header->nPhones; }
+  size_t nInstances() const { return _header->nInstances; }
+  size_t nInstances(size_t phone) const { return _entries[phone].nInstances; }
+
+  // k-th instance of a phone
+  size_t length(size_t phone, size_t k) const;
+  const float* data(size_t phone, size_t k) const;
+
+  static bool isPhoneStore(string filename);
+
+private:
+  PhoneStore(const PhoneStore&);
+  void operator = (const PhoneStore&);
+
+  void* _addr;
+  size_t _size;
+  const PhoneStoreHeader* _header;
+  const PhoneStoreEntry* _entries;
+  const uint64_t* _offset;
+  const float* _frames;
+};
+
+#endif // __PHONE_STORE_H_
@@ -0,0 +1,47 @@
+#ifndef __PREFILTER_H_
+#define __PREFILTER_H_
+
+#include <vector>
+
+#include <utility.h>
+
+// ===========================
+// ===== Prefilter Index =====
+// ===========================
+// A cheap stand-in for DTW to rule out clearly dissimilar pairs. Each
+// utterance is summarized by the mean and standard deviation of its frames
+// (MFCC or posteriorgram alike) plus a duration bucket (half-octaves of its
+// length). Every coordinate is standardized over the archive, and the
+// summaries are compared by squared Euclidean distance, brute force over one
+// contiguous N x size() array. A summary is only 2 x dim + 1 floats, small
+// next to one DTW, so the scan is left scalar.
+class PrefilterIndex {
+public:
+  PrefilterIndex(const float* data, const unsigned int* offset, int N, int dim);
+
+  // Length of one summary: 2 x dim + 1
+  size_t size() const { return _size; }
+
+  float distance(int i, int j) const;
+
+  // The C utterances other than q with the closest summaries, closest first
+  vector<int> candidates(int q, size_t C) const;
+
+private:
+  int _N;
+  size_t _size;
+  vector<float> _summary;
+};
+
+// ==============================
+// ===== Nearest Neighbours =====
+// ==============================
+// The k nearest of every utterance in an N x N matrix, nearest first: the
+// smallest scores of a distance matrix, the largest of a similarity one
+vector<vector<int> > nearestNeighbours(const float* scores, int N, size_t k, bool similarity = false);
+
+// Fraction of the exact k nearest (truth[q], nearest first) found in
+// retrieved[q], averaged over all queries
+double recallAtK(const vector<vector<int> >& truth, const vector<vector<int> >& retrieved, size_t k);
+
+#endif // __PREFILTER_H_
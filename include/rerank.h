@@ -0,0 +1,76 @@
+#ifndef __RERANK_H_
+#define __RERANK_H_
+
+#include <vector>
+#include <set>
+#include <map>
+
+#include <utility.h>
+
+// ==================================
+// ===== Graph-based Re-ranking =====
+// ==================================
+// The first-pass scores r0 of the N segments hypothesized for one query are
+// re-ranked with the acoustic similarity S (N x N) among those segments:
+//
+//   graph: random walk on the similarity graph. P is S with the diagonal
+//	    removed and every row normalized to sum to 1, and
+//
+//	      r = (1 - p) r0 + p P^T r
+//
+//	    is iterated until r stops moving.
+//   prf:   pseudo-relevance feedback. The M best segments of r0 are taken as
+//	    relevant, and r = (1 - p) r0 + p (mean similarity to those M).
+//
+// r0 is expected to be normalized to sum to 1 (see normalizeScores).
+class SimilarityGraph {
+public:
+  // knn = 0 keeps every edge (dense P). Otherwise only the knn most similar
+  // neighbours of each segment, and P is stored sparse (CSR).
+  SimilarityGraph(const float* S, size_t N, size_t knn = 0);
+
+  size_t size() const { return _N; }
+  bool isSparse() const { return _sparse; }
+
+  // y = P^T x
+  void multiplyTransposed(const vector<double>& x, vector<double>& y) const;
+
+private:
+  size_t _N;
+  bool _sparse;
+
+  vector<float> _dense;
+
+  vector<size_t> _rowPtr;
+  vector<int> _col;
+  vector<float> _value;
+};
+
+vector<double> randomWalk(const SimilarityGraph& graph, const vector<double>& r0, double p, size_t maxIteration = 100, double tolerance = 1e-9);
+
+vector<double> pseudoRelevanceFeedback(const float* S, size_t N, const vector<double>& r0, double p, size_t M);
+
+// Shift to [0, 1] by min / max, then scale to sum to 1
+vector<double> normalizeScores(const vector<double>& scores);
+
+// ======================
+// ===== Evaluation =====
+// ======================
+// As trec_eval does: AP divides by the number of relevant documents in the
+// answers, retrieved or not.
+double averagePrecision(const vector<string>& ranking, const std::set<string>& relevant);
+double precisionAt(const vector<string>& ranking, const std::set<string>& relevant, size_t k);
+
+// Answer file, one "<qid> <query> <doc ID> <relevance>" line per relevant doc
+struct QueryAnswer {
+  string qid;
+  std::set<string> relevant;
+};
+
+std::map<string, QueryAnswer> loadAnswers(string filename);
+
+// Text (one row per line, as pair-wise-dtw --format=text writes) or binary
+// (sim_matrix.h), told apart by the header
+bool loadScoreMatrix(string filename, vector<float>& m, size_t& N);
+
+#endif // __RERANK_H_
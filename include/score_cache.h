@@ -0,0 +1,87 @@
+#ifndef __SCORE_CACHE_H_
+#define __SCORE_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include <utility.h>
+
+// ===========================
+// ===== DTW Score Cache =====
+// ===========================
+// Scores of utterance pairs, addressed by content instead of by position: the
+// key is a hash of (both feature sequences, distance, its parameters, eta,
+// DTW variant), so the same pair is found again in another tool, another
+// order, or another run with the same theta.
+//
+// In memory: an open-addressing table of 64-bit keys, read and written with
+// atomics only. open() sizes the table for the scores on disk; past 75% load
+// it stops taking new scores, with a warning.
+//
+// On disk: a header followed by 12-byte (key, float32 score) records, only
+// ever appended to. A record cut short by a crash is dropped on open().
+
+#define SCORE_CACHE_MAGIC "TDTWSCC"
+#define SCORE_CACHE_VERSION 1
+
+class ScoreCache {
+public:
+  // capacity: number of slots, rounded up to a power of two
+  ScoreCache(size_t capacity = 1 << 22);
+  ~ScoreCache();
+
+  // Load every score in filename, and append new ones to it from now on
+  bool open(string filename);
+  void flush();
+  void close();
+
+  bool get(uint64_t key, float& score);
+  void put(uint64_t key, float score);
+
+  void printStats() const;
+
+  // ===== Key =====
+  static uint64_t hashFeature(const float* data, size_t nFloats);
+  static uint64_t hashFile(string filename);
+
+  // Everything but the two utterances, e.g. ("ma", hashFile(theta), -4, "fast_dtw")
+  static uint64_t makeContext(string distance, uint64_t params, float eta, string variant);
+
+  // Ordered: (a, b) and (b, a) are different pairs
+  static uint64_t makeKey(uint64_t a, uint64_t b, uint64_t context);
+
+private:
+  ScoreCache(const ScoreCache&);
+  void operator = (const ScoreCache&);
+
+  struct Slot {
+    std::atomic<uint64_t> key;
+    std::atomic<uint32_t> score;
+  };
+
+  void allocate(size_t capacity);
+  bool insert(uint64_t key, float score);
+  void drop();
+  void append(uint64_t key, float score);
+
+  Slot* _slots;
+  size_t _mask;
+  size_t _maxSize;
+
+  std::atomic<size_t> _size;
+  std::atomic<size_t> _hits;
+  std::atomic<size_t> _misses;
+  std::atomic<size_t> _dropped;
+  size_t _loaded;
+
+  // Disk
+  std::mutex _mutex;
+  int _fd;
+  string _filename;
+  std::vector<char> _pending;
+};
+
+#endif // __SCORE_CACHE_H_
@@ -0,0 +1,262 @@
+#ifndef __SCORE_SERVER_H_
+#define __SCORE_SERVER_H_
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+#include <utility.h>
+#include <fast_dtw.h>
+#include <thread_pool.h>
+
+// ========================
+// ===== Score Server =====
+// ========================
+// A long-lived DTW scoring daemon on a Unix domain socket. It keeps the
+// distance (theta / model) and the most recently used archives in memory, so
+// a caller scoring a few pairs at a time pays neither process startup nor
+// loading. Requests from every connection are cut into chunks of pairs and
+// share one worker pool.
+//
+// Every message, both ways, is a ScoreMessageHeader followed by size bytes of
+// payload. Integers and floats are in host byte order (the socket is local).
+//
+//   SCORE   archive, n, n x (i, j)		-> n x distance
+//   MATRIX  archive, n, n x index		-> n x n distances, row-major
+//   TOPK    archive, query, k, n, n x candidate	-> m, m x (index, distance),
+//	     (n = 0 for all utterances)		   nearest first
+//   STATS					-> text
+//
+// archive is a uint32 length followed by the filename, and utterances are
+// indices into it. All counts and indices are uint32. Distances are the raw
+// DTW distances (as saved by pair-wise-dtw --save-distances), not
+// similarities. A response with status != 0 carries an error message instead.
+// No payload may exceed MAX_MESSAGE_SIZE bytes.
+
+#define SCORE_SERVER_MAGIC 0x53544454u	// "TDTS"
+#define MAX_MESSAGE_SIZE (1u << 30)
+
+enum SCORE_MESSAGE_TYPE {
+  SCORE_MSG_SCORE = 1,
+  SCORE_MSG_MATRIX = 2,
+  SCORE_MSG_TOPK = 3,
+  SCORE_MSG_STATS = 4
+};
+
+struct ScoreMessageHeader {
+  uint32_t magic;
+  uint16_t type;
+  uint16_t status;	// 0 for OK
+  uint32_t id;		// echoed back in the response
+  uint32_t size;	// payload in bytes
+};
+
+// Payload, built with put() and read back with get() in the same order
+class ScoreMessage {
+public:
+  ScoreMessage(): _pos(0) {}
+
+  void clear() { _data.clear(); _pos = 0; }
+
+  template <typename T>
+  void put(const T& x) {
+    const char* p = (const char*) &x;
+    _data.insert(_data.end(), p, p + sizeof(T));
+  }
+
+  template <typename T>
+  void put(const vector<T>& v) {
+    const char* p = (const char*) v.data();
+    _data.insert(_data.end(), p, p + v.size() * sizeof(T));
+  }
+
+  void putString(const string& s);
+
+  template <typename T>
+  bool get(T& x) {
+    if (_pos + sizeof(T) > _data.size())
+      return false;
+    memcpy(&x, &_data[_pos], sizeof(T));
+    _pos += sizeof(T);
+    return true;
+  }
+
+  // n elements
+  template <typename T>
+  bool get(vector<T>& v, size_t n) {
+    if (n > (_data.size() - _pos) / sizeof(T))
+      return false;
+    v.resize(n);
+    memcpy(v.data(), &_data[_pos], n * sizeof(T));
+    _pos += n * sizeof(T);
+    return true;
+  }
+
+  bool getString(string& s);
+
+  vector<char>& buffer() { return _data; }
+  const vector<char>& buffer() const { return _data; }
+
+private:
+  vector<char> _data;
+  size_t _pos;
+};
+
+// Whole messages, retrying on short reads / writes. A payload larger than
+// MAX_MESSAGE_SIZE is not sent, and sendMessage() returns false.
+bool sendMessage(int fd, uint16_t type, uint16_t status, uint32_t id, const ScoreMessage& payload);
+bool recvMessage(int fd, ScoreMessageHeader& header, ScoreMessage& payload);
+
+// ===== Archive cache =====
+struct LoadedArchive {
+  LoadedArchive(): mtime(0), data(NULL), offset(NULL), N(0), dim(0) {}
+  ~LoadedArchive() { delete [] data; delete [] offset; }
+
+  string filename;
+  time_t mtime;
+  float* data;
+  unsigned int* offset;
+  int N, dim;
+
+  string error;		// why there are no frames, if loading failed
+};
+
+// The last capacity archives used, reloaded when the file changes on disk.
+// An archive is loaded outside the lock, so other archives are served in the
+// meantime; requests for the same archive wait for that one load.
+class ArchiveCache {
+public:
+  ArchiveCache(size_t capacity): _capacity(capacity) {}
+
+  // NULL (with the reason in error) if the archive cannot be loaded
+  std::shared_ptr<LoadedArchive> get(const string& filename, string& error);
+
+private:
+  typedef std::shared_future<std::shared_ptr<LoadedArchive> > Pending;
+
+  struct Entry {
+    string filename;
+    time_t mtime;
+    Pending archive;
+  };
+
+  std::mutex _mutex;
+  size_t _capacity;
+  std::list<Entry> _archives;	// most recent first
+};
+
+// ===== Latency =====
+// Per message type, over the last window requests
+class LatencyStats {
+public:
+  LatencyStats(size_t window = 1 << 16): _window(window) {}
+
+  void add(int type, double ms);
+  string report() const;
+
+private:
+  struct Samples {
+    Samples(): count(0), next(0) {}
+    size_t count;
+    size_t next;
+    vector<float> ms;
+  };
+
+  mutable std::mutex _mutex;
+  size_t _window;
+  std::map<int, Samples> _samples;
+};
+
+// ===== Server =====
+class ScoreServer {
+public:
+  // Makes the distance for the dimension of the first archive
+  typedef std::function<distance_fn* (int dim)> DistanceFactory;
+
+  ScoreServer(DistanceFactory factory, float eta, size_t nThreads = 0, size_t maxArchives = 16);
+  ~ScoreServer();
+
+  bool listen(string socketPath);
+
+  // Serve until stop()
+  void run();
+  void stop() { _stop = true; }
+
+  string getStats() const { return _latency.report(); }
+
+private:
+  ScoreServer(const ScoreServer&);
+  void operator = (const ScoreServer&);
+
+  void serve(int fd);
+  bool handle(const ScoreMessageHeader& header, ScoreMessage& request, ScoreMessage& response, string& error);
+
+  bool score(ScoreMessage& request, ScoreMessage& response, string& error);
+  bool matrix(ScoreMessage& request, ScoreMessage& response, string& error);
+  bool topk(ScoreMessage& request, ScoreMessage& response, string& error);
+
+  std::shared_ptr<LoadedArchive> getArchive(ScoreMessage& request, string& error);
+  bool checkIndex(const LoadedArchive& archive, const vector<uint32_t>& indices, string& error);
+
+  // Distances of pairs (i[k], j[k]) into d[k], in chunks on the shared pool
+  void computeDistances(const LoadedArchive& archive, const vector<uint32_t>& i, const vector<uint32_t>& j, float* d);
+
+  DistanceFactory _factory;
+  distance_fn* _distance;
+  int _dim;
+  std::mutex _distanceMutex;
+
+  float _eta;
+  ThreadPool _pool;
+  ArchiveCache _archives;
+  LatencyStats _latency;
+
+  int _fd;
+  string _socketPath;
+  std::atomic<bool> _stop;
+
+  struct Connection {
+    int fd;
+    std::thread thread;
+    std::shared_ptr<std::atomic<bool> > done;
+  };
+  std::list<Connection> _connections;
+};
+
+// ===== Client =====
+class ScoreClient {
+public:
+  ScoreClient(): _fd(-1), _id(0) {}
+  ~ScoreClient() { this->close(); }
+
+  bool connect(string socketPath);
+  void close();
+
+  bool score(string archive, const vector<std::pair<uint32_t, uint32_t> >& pairs, vector<float>& distances);
+  bool matrix(string archive, const vector<uint32_t>& indices, vector<float>& distances);
+  bool topk(string archive, uint32_t query, uint32_t k, const vector<uint32_t>& candidates, vector<std::pair<uint32_t, float> >& neighbors);
+  bool stats(string& text);
+
+  string getError() const { return _error; }
+
+private:
+  ScoreClient(const ScoreClient&);
+  void operator = (const ScoreClient&);
+
+  bool request(uint16_t type, const ScoreMessage& payload, ScoreMessage& response);
+
+  int _fd;
+  uint32_t _id;
+  string _error;
+};
+
+#endif // __SCORE_SERVER_H_
@@ -0,0 +1,162 @@
+#ifndef __SIM_MATRIX_H_
+#define __SIM_MATRIX_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <utility.h>
+
+// ==================================
+// ===== Similarity Matrix File =====
+// ==================================
+// An N x N (symmetric) score matrix, as written by pair-wise-dtw and
+// calc-acoustic-similarity:
+//
+//   +-----------------+
+//   | SimMatrixHeader |
+//   +-----------------+
+//   | elements        |  aligned to SIM_MATRIX_ALIGNMENT bytes
+//   +-----------------+
+//
+// SIM_MATRIX_FULL:  N x N, row-major.
+// SIM_MATRIX_LOWER: only j <= i is kept, row i starts at element i(i+1)/2.
+//
+// Elements are float32 or IEEE float16. The file is mmap'ed, so any row can be
+// read without touching the rest. sim-matrix-to-text dumps it as text.
+
+#define SIM_MATRIX_MAGIC "TDTWSIM"
+#define SIM_MATRIX_VERSION 1
+#define SIM_MATRIX_ALIGNMENT 64
+
+enum SIM_MATRIX_LAYOUT {
+  SIM_MATRIX_FULL = 0,
+  SIM_MATRIX_LOWER = 1
+};
+
+enum SIM_MATRIX_TYPE {
+  SIM_MATRIX_FLOAT32 = 0,
+  SIM_MATRIX_FLOAT16 = 1
+};
+
+struct SimMatrixHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t N;
+  uint64_t dataOffset;	// in bytes, where the elements begin
+  uint64_t fileSize;
+};
+
+class SimMatrix {
+public:
+  SimMatrix();
+  ~SimMatrix();
+
+  // Create a zero-filled matrix file and mmap it for writing
+  bool create(string filename, size_t N, int layout = SIM_MATRIX_LOWER, int type = SIM_MATRIX_FLOAT32);
+
+  // mmap an existing file and verify its header
+  bool open(string filename, bool writable = false);
+  bool sync();
+
+  // Flush rows [rowBegin, rowEnd) only
+  bool sync(size_t rowBegin, size_t rowEnd);
+
+  void close();
+  bool isOpen() const { return _header != NULL; }
+
+  size_t size() const { return _header->N; }
+  int getLayout() const { return _header->layout; }
+  int getType() const { return _header->type; }
+
+  // (i, j) and (j, i) are the same element in SIM_MATRIX_LOWER
+  float get(size_t i, size_t j) const;
+  void set(size_t i, size_t j, float value);
+
+  // All N elements of row i
+  void getRow(size_t i, float* row) const;
+  void setRow(size_t i, const float* row);
+
+  static bool isSimMatrix(string filename);
+  static uint64_t nElements(size_t N, int layout);
+
+private:
+  SimMatrix(const SimMatrix&);
+  void operator = (const SimMatrix&);
+
+  bool map(int fd, size_t size, bool writable);
+  uint64_t index(size_t i, size_t j) const;
+
+  void* _addr;
+  size_t _size;
+  const SimMatrixHeader* _header;
+  char* _data;
+};
+
+// =======================
+// ===== Tile Bitmap =====
+// =======================
+// Which tileSize x tileSize tiles of the lower triangle of an N x N matrix are
+// done, one byte per tile in a small mmap'ed file. Tile (r, c), c <= r, is the
+// r(r+1)/2 + c -th one. The fingerprint identifies the input, so a bitmap left
+// by a job over a different archive or distance is never resumed.
+
+#define TILE_BITMAP_MAGIC "TDTWTIL"
+#define TILE_BITMAP_VERSION 1
+
+struct TileBitmapHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t tileSize;
+  uint64_t N;
+  uint64_t fingerprint;
+  uint64_t nTiles;
+};
+
+class TileBitmap {
+public:
+  TileBitmap();
+  ~TileBitmap();
+
+  // Open the bitmap if it was made for the same N, tileSize and fingerprint,
+  // otherwise start a new one. resumed tells which of the two happened.
+  bool open(string filename, size_t N, size_t tileSize, uint64_t fingerprint, bool& resumed);
+  void close();
+
+  size_t getTileSize() const { return _header->tileSize; }
+  size_t nTiles() const { return _header->nTiles; }
+  size_t nDone() const;
+
+  bool isDone(size_t t) const { return _done[t] != 0; }
+
+  // Persisted before it returns
+  void markDone(size_t t);
+
+  // Rows [rowBegin, rowEnd) and columns [colBegin, colEnd) of the t-th tile
+  void getTile(size_t t, size_t& rowBegin, size_t& rowEnd, size_t& colBegin, size_t& colEnd) const;
+
+private:
+  TileBitmap(const TileBitmap&);
+  void operator = (const TileBitmap&);
+
+  void* _addr;
+  size_t _size;
+  const TileBitmapHeader* _header;
+  unsigned char* _done;
+};
+
+// Write a dense N x N matrix, rows converted in parallel (nThreads = 0 means
+// all cores). Written to a temporary file first and then renamed.
+void saveSimMatrix(string filename, const float* m, size_t N, int layout = SIM_MATRIX_LOWER, int type = SIM_MATRIX_FLOAT32, size_t nThreads = 0);
+
+// "lower" / "full" and "float32" / "float16", as given on the command line
+int parseSimMatrixLayout(string layout);
+int parseSimMatrixType(string type);
+
+uint16_t float2half(float f);
+float half2float(uint16_t h);
+
+#endif // __SIM_MATRIX_H_
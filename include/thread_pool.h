@@ -0,0 +1,47 @@
+#ifndef __THREAD_POOL_H_
+#define __THREAD_POOL_H_
+
+#include <vector>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// =======================
+// ===== Thread Pool =====
+// =======================
+// A fixed set of worker threads running jobs in FIFO order.
+class ThreadPool {
+public:
+  // nThreads = 0 means one thread per hardware thread
+  ThreadPool(size_t nThreads = 0);
+  ~ThreadPool();
+
+  void submit(std::function<void ()> job);
+
+  // Block until every submitted job has finished.
+  void wait();
+
+  size_t size() const { return _threads.size(); }
+
+  static size_t hardwareConcurrency();
+
+private:
+  ThreadPool(const ThreadPool&);
+  void operator = (const ThreadPool&);
+
+  void __run__();
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::condition_variable _idle;
+
+  std::queue<std::function<void ()> > _jobs;
+  size_t _nBusy;
+  bool _stop;
+
+  std::vector<std::thread> _threads;
+};
+
+#endif // __THREAD_POOL_H_
@@ -5,14 +5,19 @@
 #include <util.h>
 #include <utility.h>
 #include <vector>
+#include <memory>
 
 #include <cdtw.h>
 #include <model.h>
 #include <corpus.h>
 #include <perf.h>
+#include <checkpoint.h>
+#include <thread_pool.h>
 
 float dnn_fn(const float* x, const float* y, const int size);
 
+struct PendingValidation;
+
 class dtw_model {
 public:
   dtw_model(size_t dim, 
@@ -22,11 +27,20 @@ public:
     _dim(dim),
     _intra_inter_weight(weight),
     _learning_rate(learning_rate),
-    _model_output_path(model_output_path) {}
+    _model_output_path(model_output_path),
+    _soft_threshold(2e-6 * learning_rate),
+    _objective(0),
+    _aboutToStop(false),
+    _nValidation(0),
+    _seed(0),
+    _checkpointBatches(1),
+    _checkpointSecs(0),
+    _arena(NULL),
+    _nValidationThreads(0) {}
 
   virtual void initModel() = 0;
-  virtual void __train__(const vector<tsample>& samples, size_t begin, size_t end) = 0;
-  virtual void train(Corpus& corpus, size_t batchSzie);
+  virtual void __train__(const vector<isample>& samples, size_t begin, size_t end) = 0;
+  virtual void train(Corpus& corpus, size_t batchSzie, bool resume = false);
   virtual void validate(Corpus& corpus);
   virtual void selftest(Corpus& corpus);
   virtual VectorDistFn getDistFn() = 0;
@@ -34,22 +48,70 @@ public:
   virtual void getDeltaTheta(void* &dThetaPtr, void* &ddThetaPtr) = 0;
 
   virtual void saveModel() = 0;
+  virtual void loadModel() = 0;
+
+  // Also passed on to the parameters, for models that keep their own copy
+  virtual void setLearningRate(float learning_rate) { _learning_rate = learning_rate; }
+
+  // Returns a job which saves a private copy of the current parameters. The
+  // job is run later by the Checkpointer on its own thread.
+  virtual std::function<void ()> snapshotModel() = 0;
+
+  // Returns an opaque private copy of the current parameters. bindParams()
+  // makes getDistFn() on the calling thread evaluate that copy instead of the
+  // live parameters (NULL switches back), so that a snapshot can be scored on
+  // other threads while training keeps updating the parameters.
+  virtual std::shared_ptr<void> snapshotParams() = 0;
+  virtual void bindParams(const void* snapshot) = 0;
+
+  // Checkpoint every nBatches batches and/or every nSecs seconds (0 = never)
+  void setCheckpointInterval(size_t nBatches, size_t nSecs);
+  string getStateFilename() const;
+
+  // Number of threads validating in the background (0 = one per core)
+  void setValidationThreads(size_t nThreads);
 
-  virtual double calcObjective(const vector<tsample>& samples);
-  virtual void calcDeltaTheta(const CumulativeDtwRunner* dtw, void* dThetaPtr) = 0;
+  virtual double calcObjective(const vector<isample>& samples, size_t begin, size_t end);
+  virtual void calcDeltaTheta(const ArenaDtwRunner* dtw, void* dThetaPtr) = 0;
   virtual void updateTheta(void* dThetaPtr) = 0;
 
-  double dtw(string f1, string f2, void* dTheta = NULL);
-  double dtw(DtwParm& q_parm, DtwParm& d_parm, void *dTheta);
+  // Score a pair of phone instances straight from the FeatureArena
+  double dtw(const isample& sample, void* dTheta = NULL);
 
   void showMsg(size_t iteration) {
     printf("iteration "BLUE"%lu"COLOREND"\n", iteration);
   }
 protected:
+  void checkpoint(size_t epoch, size_t batch);
+
+  void loadCorpus(Corpus& corpus);
+  void loadValidationSet(Corpus& corpus);
+  void submitValidation(size_t epoch);
+  bool pollValidation(bool wait);
+  bool applyValidation(double obj);
+
   size_t _dim;
   float _intra_inter_weight;
   float _learning_rate;
   string _model_output_path;
+
+  // Early-stopping status of validate()
+  double _soft_threshold;
+  double _objective;
+  bool _aboutToStop;
+  size_t _nValidation;
+
+  unsigned int _seed;
+  size_t _checkpointBatches;
+  size_t _checkpointSecs;
+  Checkpointer _checkpointer;
+
+  const FeatureArena* _arena;
+
+  size_t _nValidationThreads;
+  vector<isample> _validSet;
+  std::shared_ptr<ThreadPool> _validationPool;
+  std::shared_ptr<PendingValidation> _pendingValidation;
 };
 
 float dnn_fn(const float* x, const float* y, const int size);
@@ -69,13 +131,18 @@ public:
     }
 
   virtual void initModel();
-  virtual void __train__(const vector<tsample>& samples, size_t begin, size_t end);
+  virtual void __train__(const vector<isample>& samples, size_t begin, size_t end);
   virtual VectorDistFn getDistFn();
 
   virtual void saveModel();
+  virtual void loadModel();
+  virtual void setLearningRate(float learning_rate);
+  virtual std::function<void ()> snapshotModel();
+  virtual std::shared_ptr<void> snapshotParams();
+  virtual void bindParams(const void* snapshot);
 
   virtual void getDeltaTheta(void* &dThetaPtr, void* &ddThetaPtr);
-  virtual void calcDeltaTheta(const CumulativeDtwRunner* dtw, void* dThetaPtr);
+  virtual void calcDeltaTheta(const ArenaDtwRunner* dtw, void* dThetaPtr);
   virtual void updateTheta(void* dThetaPtr);
 
   static Model& getInstance() {
@@ -100,22 +167,26 @@ public:
     }
 
   virtual void initModel();
-  virtual void __train__(const vector<tsample>& samples, size_t begin, size_t end);
+  virtual void __train__(const vector<isample>& samples, size_t begin, size_t end);
 
   virtual VectorDistFn getDistFn();
 
   virtual void getDeltaTheta(void* &dThetaPtr, void* &ddThetaPtr);
-  virtual void calcDeltaTheta(const CumulativeDtwRunner* dtw, void* dThetaPtr);
+  virtual void calcDeltaTheta(const ArenaDtwRunner* dtw, void* dThetaPtr);
   virtual void updateTheta(void* dThetaPtr);
 
   virtual void saveModel();
+  virtual void loadModel();
+  virtual std::function<void ()> snapshotModel();
+  virtual std::shared_ptr<void> snapshotParams();
+  virtual void bindParams(const void* snapshot);
 };
 
 #define DTW_PARAM_ALIASING \
 double cScore = dtw->getCumulativeScore();\
 const auto& Q = dtw->getQ();\
 const auto& D = dtw->getD();\
-auto& alpha = const_cast<TwoDimArray<float>&>(dtw->getAlpha());\
-auto& beta  = const_cast<TwoDimArray<float>&>(dtw->getBeta());
+const auto& alpha = dtw->getAlpha();\
+const auto& beta  = dtw->getBeta();
 
 #endif // __TRAINABLE_DTW_H_
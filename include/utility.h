@@ -45,9 +45,16 @@ std::string exec(std::string cmd);
 
 bool isInt(string str);
 
+// Resident set size of this process in bytes (0 if unknown)
+size_t getResidentMemory();
+
 vector<string> split(const string &s, char delim);
 vector<string>& split(const string &s, char delim, vector<string>& elems);
 
+inline bool ends_with(const string& str, const string& suffix) {
+  return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
 inline bool exists (const string& name) {
   struct stat buffer;   
   return (stat (name.c_str(), &buffer) == 0); 
@@ -141,10 +148,22 @@ template <typename T> int sign(T val) {
 
 void doPause();
 
+// Files are first written to "filename.tmp" and then renamed to filename, so
+// that a reader never sees a partially written file.
+bool atomicRename(const string& tmp, const string& filename);
+
 namespace bash {
   vector<string> ls(string path);
 }
 
 string replace_all(const string& str, const string &token, const string &s);
 
+// One query per line, with the trailing blanks (and \r) trimmed
+vector<string> loadQueryList(string filename);
+
+// The doc ID of an utterance ID is what lies between its last '/' and its
+// last '_' (the whole name after the last '/' if there is no '_' there)
+string cutoffWaveFilename(const string& utterance);
+void cutoffWaveFilename(vector<string>& docid);
+
 #endif // _UTILITY_H_
@@ -0,0 +1,82 @@
+#ifndef __VECTOR_QUANTIZER_H_
+#define __VECTOR_QUANTIZER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <utility.h>
+
+class distance_fn;
+
+// ====================
+// ===== Codebook =====
+// ====================
+// K centroids trained by k-means (kmeans++ seeding, then Lloyd iterations)
+// on a random sample of the frames of an archive. Frames are assigned to the
+// nearest centroid in Euclidean distance, whatever distance DTW uses later:
+// that one only enters through distanceTable().
+class Codebook {
+public:
+  Codebook(): _K(0), _dim(0) {}
+
+  // At most maxSamples frames (of nFrames x dim) are used. The same seed
+  // gives the same codebook.
+  void train(const float* frames, size_t nFrames, size_t dim, size_t K, size_t nIterations = 20, size_t maxSamples = 100000, size_t nThreads = 0, unsigned int seed = 0);
+
+  size_t size() const { return _K; }
+  size_t getDim() const { return _dim; }
+  const float* centroid(size_t k) const { return &_centroids[k * _dim]; }
+
+  // Index of the centroid nearest to x
+  size_t encode(const float* x) const;
+
+  // K x K, fn(centroid k, centroid l) at [k * K + l]
+  vector<float> distanceTable(distance_fn& fn, size_t nThreads = 0) const;
+
+  // Text: "K dim", then one centroid per line. A codebook for frames of
+  // another dimension than dim is an error.
+  bool save(string filename) const;
+  bool load(string filename, size_t dim);
+
+private:
+  size_t _K;
+  size_t _dim;
+  vector<float> _centroids;
+};
+
+// =============================
+// ===== Quantized Archive =====
+// =============================
+// Every utterance of an archive stored as the codes of its frames: one byte
+// per frame for K <= 256, two bytes otherwise. The pdist of a pair is then a
+// gather from the distance table of the codebook instead of dim operations per
+// cell. Utterances are added a batch at a time, so that the frames of only one
+// batch need be in memory.
+class QuantizedArchive {
+public:
+  QuantizedArchive(const Codebook& codebook);
+
+  // Encode N more utterances (as loadFeatureArchive() gives them), which get
+  // the indices size() .. size() + N - 1
+  void append(const float* data, const unsigned int* offset, int N, int dim, size_t nThreads = 0);
+
+  int size() const { return _N; }
+  size_t length(int i) const { return _offset[i + 1] - _offset[i]; }
+  size_t bytes() const;
+
+  // pdist (length(i) x length(j)) of utterances i and j, from table (K x K)
+  void pair_distance(int i, int j, const float* table, float* pdist) const;
+
+private:
+  template <typename Code>
+  void gather(const Code* c1, const Code* c2, size_t rows, size_t cols, const float* table, float* pdist) const;
+
+  const Codebook& _codebook;
+  int _N;
+  size_t _K;
+  vector<size_t> _offset;	// in frames
+  vector<uint8_t> _codes8;	// K <= 256
+  vector<uint16_t> _codes16;	// otherwise
+};
+
+#endif // __VECTOR_QUANTIZER_H_
@@ -3,23 +3,83 @@
 #include <color.h>
 #include <array.h>
 #include <ipc.h>
+#include <perf.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
-#include <cdtw.h>
 #include <utility.h>
 using namespace std;
 
+// ========================================================
+// ===== Round-trip throughput: shared memory vs FIFO =====
+// ========================================================
+// A child process echoes every vector back. Throughput counts the bytes of
+// both directions.
+
+template <typename Channel>
+void echo(Channel& peer, size_t nRounds) {
+  vector<float> v;
+  range (r, nRounds) {
+    peer >> v;
+    peer << v;
+  }
+}
+
+template <typename Channel>
+double benchmark(size_t length, size_t nRounds) {
+  vector<float> v(length, 1.0f), w;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // The other way round: send on fifo2, receive on fifo1
+    Channel peer("/tmp/fifo2", "/tmp/fifo1");
+    echo(peer, nRounds);
+    _exit(0);
+  }
+
+  Channel ipc("/tmp/fifo1", "/tmp/fifo2");
+
+  perf::Timer timer;
+  timer.start();
+  range (r, nRounds) {
+    ipc << v;
+    ipc >> w;
+  }
+  timer.stop();
+
+  waitpid(pid, NULL, 0);
+
+  if (w != v)
+    fprintf(stderr, "[Error] Echo mismatch\n");
+
+  double bytes = 2.0 * nRounds * length * sizeof(float);
+  return bytes / (timer.getTime() / 1000) / 1e6;
+}
+
 int main (int argc, char* argv[]) {
 
-  vector<double> t(39, 1.0);
+  // Leftovers of an earlier run
+  ShmRing::unlink("/tmp/fifo1");
+  ShmRing::unlink("/tmp/fifo2");
+  FifoIPC("/tmp/fifo1", "/tmp/fifo2");
+
+  printf("%10s %12s %12s\n", "floats", "shm (MB/s)", "fifo (MB/s)");
 
-  IPC ipc;
-  ipc.clear_fifo();
-  while (true) {
-    ipc << t;
-    ipc >> t;
-    print(t);
+  size_t lengths[] = { 39, 1024, 65536, 1 << 20 };
+  range (i, 4) {
+    size_t length = lengths[i];
+    size_t nRounds = std::max((size_t) 4, (1 << 22) / length);
+
+    double shm = benchmark<IPC>(length, nRounds);
+
+    // One write() per element: keep the FIFO runs short
+    double fifo = benchmark<FifoIPC>(length, std::max((size_t) 2, nRounds / 64));
+
+    printf("%10lu "GREEN"%12.1f"COLOREND" %12.1f\n", length, shm, fifo);
   }
 
-  return 0;
+  ShmRing::unlink("/tmp/fifo1");
+  ShmRing::unlink("/tmp/fifo2");
 
+  return 0;
 }
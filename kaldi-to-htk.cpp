@@ -35,11 +35,28 @@ int main(int argc, char* argv[]) {
 
 void saveFeatureArchiveAsHtk(const string& featArk) {
 
-  FILE* fptr = fopen(featArk.c_str(), "r");
-  VulcanUtterance vUtterance;
-  while (vUtterance.LoadKaldi(fptr)) {
-    const FeatureSeq& fs = vUtterance._feature;
-    string docId = vUtterance.fid();
+  KaldiArchiveReader reader;
+  if (!reader.open(featArk)) {
+    fprintf(stderr, "Cannot open feature archive %s\n", featArk.c_str());
+    exit(-1);
+  }
+
+  FeatureArena arena;
+  string docId;
+  while (true) {
+    arena.clear();
+    if (!reader.read(arena, docId))
+      break;
+
+    size_t dim = arena.getDim();
+    const float* frames = arena.data(0);
+
+    FeatureSeq fs(arena.nFrames());
+    foreach (t, fs) {
+      fs[t] = DoubleVector(dim);
+      range (k, dim)
+	fs[t]._data->data[k] = frames[t * dim + k];
+    }
 
     docId = replace_all(docId, "mfc", "gp");
     docId = replace_all(docId, "SI_word", "SI_word_gp");
@@ -49,4 +66,3 @@ void saveFeatureArchiveAsHtk(const string& featArk) {
     save(fs, docId);
   }
 }
-
@@ -4,24 +4,30 @@
 #include <perf.h>
 #include <archive_io.h>
 #include <cmdparser.h>
+#include <pairwise_dtw.h>
+#include <approximate_dtw.h>
 
 #include <fast_dtw.h>
 using namespace std;
 
 void selfTest();
 float calcError(float* s1, float* s2, int N);
-distance_fn* initDistanceMeasure(string dist_type, size_t dim, string theta_fn);
 // void normalize(float* m, int N, float eta);
 // void normalize_in_log(float* m, int N);
-void cvtDistanceToSimilarity(float* m, int N);
-void print(FILE* fid, float* m, int N);
 
 int main (int argc, char* argv[]) {
 
   CmdParser cmdParser(argc, argv);
   cmdParser
-    .add("--ark", "input feature archive")
-    .add("-o", "output filename for the acoustic similarity matrix", false);
+    .add("--ark", "input feature archive (with --query-list, a pattern containing {query})")
+    .add("--ids", "file of utterance IDs (one per line). Only these utterances are loaded,\n"
+		  "through the index cached in <ark>.idx", false)
+    .add("-o", "output filename for the acoustic similarity matrix\n"
+	       "(with --query-list, a pattern containing {query})", false)
+    .add("--query-list", "file of query names (one per line). Every query's archive is scored in\n"
+			 "this one process: archives are loaded while earlier queries are still\n"
+			 "being computed, all queries share one pool of --threads threads, and\n"
+			 "each matrix is written as soon as its query is done", false);
 #ifdef __CUDACC__
   cmdParser
     .add("--gpu-enabled", "set to \"true\" to turn on gpu-acceleration", false, "false")
@@ -30,38 +36,335 @@ int main (int argc, char* argv[]) {
 
   cmdParser
     .addGroup("Distance options")
-    .add("--type", "choose \"Euclidean (eu)\", \"Diagonal Manalanobis (ma)\", \"Log Inner Product (lip)\"")
+    .add("--type", "choose \"Euclidean (eu)\", \"Diagonal Manalanobis (ma)\", \"Log Inner Product (lip)\", \"DTW-DNN (dnn)\"")
     .add("--theta", "specify the file containing the diagnol term of Mahalanobis distance (dim=39)", false)
-    .add("--eta", "Specify the coefficient in the smoothing minimum", false, "-2");
+    .add("--model", "binary DTW-DNN model file (*.bin) for --type=dnn", false)
+    .add("--eta", "Specify the coefficient in the smoothing minimum", false, "-2")
+    .add("--eta-list", "comma-separated etas, e.g. \"-1,-2,-4\", instead of --eta. The frame\n"
+		       "distances of each pair are computed once for all of them, and one\n"
+		       "matrix per eta is written to -o, a pattern containing {eta}", false)
+    .add("--theta-list", "comma-separated theta files instead of --theta, for --type=ma or lip.\n"
+			 "The frames of each pair are compared once for all of them, and one\n"
+			 "matrix per theta is written to -o, a pattern containing {theta}\n"
+			 "(the theta's file name without its directory, which must differ\n"
+			 "from one theta to another)", false);
+
+  cmdParser
+    .addGroup("Output options")
+    .add("--format", "\"text\" or \"bin\" (binary similarity matrix, see sim_matrix.h)", false, "text")
+    .add("--layout", "for --format=bin: \"lower\" (packed lower triangle) or \"full\"", false, "lower")
+    .add("--precision", "for --format=bin: \"float32\" or \"float16\"", false, "float32")
+    .add("--tile-size", "for --format=bin: compute the matrix out-of-core in tiles of this many\n"
+			"utterances (0 to hold it in memory). The scores go to <output>.work and\n"
+			"finished tiles to <output>.tiles, so a killed job can simply be re-run", false, "0")
+    .add("--threads", "number of threads for --tile-size, --update, --cache and --query-list\n"
+		      "(0 for all cores)", false, "0");
+
+  cmdParser
+    .addGroup("Retrieval options")
+    .add("--topk", "only find the k nearest utterances of each query, as \"query doc distance\"\n"
+		   "lines (raw DTW distances, nearest first) instead of the full matrix.\n"
+		   "Alignments that cannot make it into the k best are abandoned early", false, "0")
+    .add("--queries", "for --topk: file of query utterance IDs (default: every utterance)", false)
+    .add("--prefilter", "only align each utterance with the C utterances closest to it in a cheap\n"
+			"summary (mean / std of frames and duration, see prefilter.h). Pairs\n"
+			"left out get the largest distance (similarity 0). 0 to align all", false, "0")
+    .add("--recall", "set to \"true\" to also score every pair and report the recall@k of\n"
+		     "--prefilter (k = --topk, or 10) or --vq, or the error of --landmarks,\n"
+		     "to tune C, K or L", false, "false");
+
+  cmdParser
+    .addGroup("Landmark options")
+    .add("--landmarks", "only align every utterance with L landmark utterances and reconstruct\n"
+			"the rest of the similarity matrix from them (Nystrom, see landmark.h).\n"
+			"0 to align all pairs", false, "0")
+    .add("--landmark-selection", "\"kmeans++\" (on the mean frame of each utterance) or \"random\"", false, "kmeans++")
+    .add("--factors", "for --landmarks: save the low-rank factors of the matrix (text). The\n"
+		      "N x N matrix is then only reconstructed if -o is given", false);
+
+  cmdParser
+    .addGroup("Quantization options")
+    .add("--vq", "quantize every frame to one of K centroids (k-means on the archive, see\n"
+		 "vector_quantizer.h) and align code sequences, pdist being looked up in\n"
+		 "a K x K table of centroid distances. Only the codes are kept in memory.\n"
+		 "0 to align the frames themselves", false, "0")
+    .add("--vq-rescore", "for --vq: align again, exactly, the C nearest utterances of every\n"
+			 "utterance under the quantized distance. The other pairs keep their\n"
+			 "quantized distances", false, "10")
+    .add("--codebook", "for --vq: codebook file, loaded if it exists, otherwise trained and\n"
+		       "saved there so that later runs skip k-means", false);
+
+  cmdParser
+    .addGroup("Preprocessing options")
+    .add("--frame-reduction", "shorten every utterance once when it is loaded (see frame_reduction.h):\n"
+			      "\"skip:N\" keeps every N-th frame, \"average:N\" averages every N\n"
+			      "frames, \"merge:T\" merges consecutive frames within distance T.\n"
+			      "With --recall=true, the full-rate matrix is also computed and the\n"
+			      "MAP / recall@10 of the reduced rankings against it are reported", false);
+
+  cmdParser
+    .addGroup("Cache options")
+    .add("--cache", "score cache file (see score_cache.h), shared by runs and tools. Pairs\n"
+		    "already scored with the same features, distance, theta/model and eta\n"
+		    "are not aligned again", false);
+
+  cmdParser
+    .addGroup("Incremental options")
+    .add("--save-distances", "also save the raw DTW distances (binary), their utterance IDs in\n"
+			     "<file>.ids and what they were computed from in <file>.hashes, so\n"
+			     "that the matrix can later be updated with --update", false)
+    .add("--update", "raw distances saved by an earlier --save-distances with the same\n"
+		     "distance, theta/model and eta. Pairs of utterances still in the archive\n"
+		     "with unchanged features are reused, the others are aligned again.\n"
+		     "The distances are saved back unless --save-distances says otherwise", false);
 
   cmdParser
     .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu")
-    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=ma --theta=<some-trained-theta>");
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=ma --theta=<some-trained-theta>")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --ids=<some-id-list> --type=eu")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu --format=bin -o example.sim")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu --update=example.dist -o example.sim")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=dnn --model=<some-trained-model.bin>")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu --topk=10 -o example.topk")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu --landmarks=20 --recall=true")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu --eta-list=-1,-2,-4 -o example.{eta}.mul-sim")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu --vq=256 --codebook=example.codebook")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.76.ark --type=eu --frame-reduction=average:2 --recall=true")
+    .addGroup("Example: ./pair-wise-dtw --ark=data/example.39.ark --type=ma --theta-list=exp/theta/a,exp/theta/b -o example.{theta}.mul-sim")
+    .addGroup("Example: ./pair-wise-dtw --query-list=110.query --ark=mfcc/{query}.39.ark -o mul-sim/{query}.mul-sim --type=eu");
   
   if(!cmdParser.isOptionLegal())
     cmdParser.showUsageAndExit();
 
   string archive_fn = cmdParser.find("--ark");
+  string ids_fn	    = cmdParser.find("--ids");
   string output_fn  = cmdParser.find("-o");
 #ifdef __CUDACC__
   bool gpuEnabled   = (cmdParser.find("--gpu-enabled") == "true");
 #endif
   bool isSelfTest   = (cmdParser.find("--self-test") == "true");
   string theta_fn   = cmdParser.find("--theta");
+  string model_fn   = cmdParser.find("--model");
   string dist_type  = cmdParser.find("--type");
   float eta	    = str2float(cmdParser.find("--eta"));
+  string eta_list   = cmdParser.find("--eta-list");
+  string theta_list = cmdParser.find("--theta-list");
+  string format	    = cmdParser.find("--format");
+  int layout	    = parseSimMatrixLayout(cmdParser.find("--layout"));
+  int precision	    = parseSimMatrixType(cmdParser.find("--precision"));
+  size_t tileSize   = str2int(cmdParser.find("--tile-size"));
+  size_t nThreads   = str2int(cmdParser.find("--threads"));
+  string update_fn  = cmdParser.find("--update");
+  string saveDist_fn= cmdParser.find("--save-distances");
+  string cache_fn   = cmdParser.find("--cache");
+  string query_list = cmdParser.find("--query-list");
+  size_t topk	    = str2int(cmdParser.find("--topk"));
+  string queries_fn = cmdParser.find("--queries");
+  size_t prefilter  = str2int(cmdParser.find("--prefilter"));
+  bool recall	    = (cmdParser.find("--recall") == "true");
+  size_t landmarks  = str2int(cmdParser.find("--landmarks"));
+  string selection  = cmdParser.find("--landmark-selection");
+  string factors_fn = cmdParser.find("--factors");
+  size_t vq	    = str2int(cmdParser.find("--vq"));
+  size_t vqRescore  = str2int(cmdParser.find("--vq-rescore"));
+  string codebook_fn= cmdParser.find("--codebook");
+  FrameReducer reducer(cmdParser.find("--frame-reduction"));
+
+  // Each of these computes the scores its own way, so at most one is given.
+  // --prefilter is a mode of its own, or the candidates of --topk.
+  vector<string> modes;
+  if (!query_list.empty())		modes.push_back("--query-list");
+  if (!update_fn.empty())		modes.push_back("--update");
+  if (tileSize > 0)			modes.push_back("--tile-size");
+  if (topk > 0)				modes.push_back("--topk");
+  if (prefilter > 0 && topk == 0)	modes.push_back("--prefilter");
+  if (landmarks > 0)			modes.push_back("--landmarks");
+  if (vq > 0)				modes.push_back("--vq");
+  if (!eta_list.empty())		modes.push_back("--eta-list");
+  if (!theta_list.empty())		modes.push_back("--theta-list");
+
+  if (modes.size() > 1) {
+    fprintf(stderr, "%s and %s cannot be used together\n", modes[0].c_str(), modes[1].c_str());
+    return -1;
+  }
+  string mode = modes.empty() ? "" : modes[0];
+
+  // Options that only some modes take ("" is the whole matrix in memory)
+  if (!update_fn.empty() && saveDist_fn.empty())
+    saveDist_fn = update_fn;
+
+  if (!saveDist_fn.empty() && mode != "" && mode != "--update") {
+    fprintf(stderr, "--save-distances cannot be used with %s\n", mode.c_str());
+    return -1;
+  }
+
+  if (!cache_fn.empty() && mode != "" && mode != "--update" && mode != "--query-list") {
+    fprintf(stderr, "--cache cannot be used with %s\n", mode.c_str());
+    return -1;
+  }
+
+  if (!ids_fn.empty() && mode == "--query-list") {
+    fprintf(stderr, "--ids cannot be used with --query-list\n");
+    return -1;
+  }
+
+  // Saved distances do not say at which frame rate they were computed
+  if (reducer.isEnabled() && mode == "--update") {
+    fprintf(stderr, "--frame-reduction cannot be used with --update\n");
+    return -1;
+  }
+
+  if (format != "text" && format != "bin") {
+    fprintf(stderr, "--format must be either \"text\" or \"bin\"\n");
+    return -1;
+  }
+
+  if (format == "bin" && output_fn.empty()) {
+    fprintf(stderr, "--format=bin needs an output file (-o)\n");
+    return -1;
+  }
+
+  if (mode == "--tile-size" && format != "bin") {
+    fprintf(stderr, "--tile-size needs --format=bin\n");
+    return -1;
+  }
+
+  if (mode == "--topk" && format != "text") {
+    fprintf(stderr, "--topk writes text, not --format=%s\n", format.c_str());
+    return -1;
+  }
+
+  // Patterns of the modes writing several matrices
+  vector<string> etas = split(eta_list, ',');
+  if (mode == "--eta-list" && output_fn.find("{eta}") == string::npos) {
+    fprintf(stderr, "With --eta-list, -o must contain {eta}\n");
+    return -1;
+  }
+
+  vector<string> thetas = split(theta_list, ',');
+  if (mode == "--theta-list") {
+    if (dist_type != "ma" && dist_type != "lip") {
+      fprintf(stderr, "--theta-list needs --type=ma or --type=lip\n");
+      return -1;
+    }
+
+    if (output_fn.find("{theta}") == string::npos) {
+      fprintf(stderr, "With --theta-list, -o must contain {theta}\n");
+      return -1;
+    }
+  }
+
+  if (mode == "--query-list" && (output_fn.find("{query}") == string::npos || archive_fn.find("{query}") == string::npos)) {
+    fprintf(stderr, "With --query-list, both --ark and -o must contain {query}\n");
+    return -1;
+  }
+
+  // Only with --cache: the table alone takes tens of MB
+  ScoreCache* cache = NULL;
+  if (!cache_fn.empty()) {
+    cache = new ScoreCache;
+    if (!cache->open(cache_fn)) {
+      fprintf(stderr, "Cannot open score cache %s\n", cache_fn.c_str());
+      return -1;
+    }
+  }
+  uint64_t context = ScoreCache::makeContext(dist_type,
+      ScoreCache::hashFile(theta_fn) ^ ScoreCache::hashFile(model_fn), eta,
+      reducer.isEnabled() ? "fast_dtw+" + reducer.getSpec() : "fast_dtw");
 
   if (isSelfTest)
     selfTest();
 
   perf::Timer timer;
   timer.start();
+
+  if (mode == "--query-list") {
+    computeQueryList(query_list, archive_fn, output_fn, dist_type, theta_fn, model_fn, eta,
+	format, layout, precision, nThreads, cache, context, reducer);
+
+    if (cache) {
+      cache->flush();
+      cache->printStats();
+      delete cache;
+    }
+
+    timer.elapsed();
+    return 0;
+  }
+
+  // Reads the archive a batch at a time itself
+  if (mode == "--vq") {
+    mylog(theta_fn);
+
+    vector<string> ids;
+    if (!ids_fn.empty())
+      ids = loadIdList(ids_fn);
+
+    float* scores = computeQuantizedPairwiseDTW(archive_fn, ids, reducer, dist_type, theta_fn, model_fn, eta, vq, codebook_fn, vqRescore, nThreads, recall, 10);
+    int N = ids.size();
+
+    cvtDistanceToSimilarity(scores, N);
+    saveScores(output_fn, scores, N, format, layout, precision);
+    delete [] scores;
+
+    timer.elapsed();
+    return 0;
+  }
+
   int N, dim; float* data; unsigned int* offset;
-  loadFeatureArchive(archive_fn, data, offset, N, dim); 
+  vector<string> ids;
+  if (ids_fn.empty())
+    loadFeatureArchive(archive_fn, data, offset, N, dim, &ids); 
+  else {
+    ids = loadIdList(ids_fn);
+    loadFeatureArchive(archive_fn, ids, data, offset, N, dim);
+  }
+
+  // Keep the full-rate frames to measure what the reduction costs
+  float* fullData = NULL; unsigned int* fullOffset = NULL;
+  if (reducer.isEnabled() && recall && (mode == "" || mode == "--prefilter")) {
+    fullData = new float[offset[N]];
+    fullOffset = new unsigned int[N + 1];
+    std::copy(data, data + offset[N], fullData);
+    std::copy(offset, offset + N + 1, fullOffset);
+  }
+
+  reducer.reduce(data, offset, N, dim);
+  reducer.printStats();
 
   mylog(theta_fn);
 
-  distance_fn* dist = initDistanceMeasure(dist_type, dim, theta_fn);
+  // Modes writing their own output
+  if (mode == "--theta-list" || mode == "--eta-list" || mode == "--topk" || mode == "--tile-size") {
+    if (mode == "--theta-list")
+      computeThetaList(data, offset, N, dim, dist_type, thetas, eta, output_fn, format, layout, precision, nThreads);
+    else {
+      distance_fn* dist = initDistanceMeasure(dist_type, dim, theta_fn, model_fn);
+
+      if (mode == "--eta-list")
+	computeEtaList(data, offset, N, dim, *dist, etas, output_fn, format, layout, precision, nThreads);
+      else if (mode == "--topk")
+	computeTopk(data, offset, N, dim, *dist, eta, ids, queries_fn, topk, output_fn, nThreads, prefilter, recall);
+      else {
+	// Same input and same distance, same fingerprint
+	string options = dist_type + " " + theta_fn + " " + model_fn + " " + cmdParser.find("--eta");
+	uint64_t fingerprint = fnv1a(options.data(), options.size());
+	fingerprint = fnv1a(offset, (N + 1) * sizeof(unsigned int), fingerprint);
+	fingerprint = fnv1a(data, (size_t) offset[N] * sizeof(float), fingerprint);
+
+	computeTiledPairwiseDTW(data, offset, N, dim, *dist, eta, output_fn, layout, precision, tileSize, nThreads, fingerprint);
+      }
+
+      delete dist;
+    }
+
+    delete [] data;
+    delete [] offset;
+    timer.elapsed();
+    return 0;
+  }
+
+  distance_fn* dist = initDistanceMeasure(dist_type, dim, theta_fn, model_fn);
 
   float* scores = NULL;
 #ifdef __CUDACC__
@@ -69,50 +372,48 @@ int main (int argc, char* argv[]) {
     scores = computePairwiseDTW_in_gpu(data, offset, N, dim);
   else
 #else
+  if (mode == "--update")
+    scores = updatePairwiseDTW(data, offset, N, dim, *dist, eta, ids, update_fn, nThreads, cache, context);
+  else if (mode == "--landmarks")
+    scores = computeLandmarkSimilarity(data, offset, N, dim, *dist, eta, landmarks, selection, ids, factors_fn, nThreads, recall, factors_fn.empty() || !output_fn.empty());
+  else if (mode == "--prefilter")
+    scores = computePrefilteredPairwiseDTW(data, offset, N, dim, *dist, eta, prefilter, nThreads, recall, 10);
+  else if (cache) {
+    scores = new float[(size_t) N * N];
+    computePairwiseDTW(data, offset, N, dim, *dist, eta, scores, vector<bool>(N, true), nThreads, cache, context);
+  }
+  else
     scores = computePairwiseDTW(data, offset, N, dim, *dist, eta);
 #endif
 
-  cvtDistanceToSimilarity(scores, N);
-
-  FILE* fid = (output_fn.empty()) ? stdout : fopen(output_fn.c_str(), "w");
-  print(fid, scores, N);
-  if (fid != stdout) 
-    fclose(fid);
+  if (cache) {
+    cache->flush();
+    cache->printStats();
+    delete cache;
+  }
 
-  delete [] scores;
+  if (!saveDist_fn.empty())
+    saveDistances(saveDist_fn, scores, ids, data, offset, context);
 
-  timer.elapsed();
-
-  return 0;
-}
+  if (fullData) {
+    reportFrameReduction(fullData, fullOffset, N, dim, *dist, eta, scores, ids, nThreads, 10);
+    delete [] fullData;
+    delete [] fullOffset;
+  }
 
-distance_fn* initDistanceMeasure(string dist_type, size_t dim, string theta_fn) {
-  distance_fn* dist;
+  // Landmark scores are similarities already, and there are none with only
+  // --factors asked for
+  if (scores) {
+    if (mode != "--landmarks")
+      cvtDistanceToSimilarity(scores, N);
+    saveScores(output_fn, scores, N, format, layout, precision);
 
-  if (dist_type == "ma") {
-    dist = new mahalanobis_fn(dim);
-    dynamic_cast<mahalanobis_fn*>(dist)->setDiag(theta_fn);
-  }
-  else if (dist_type == "lip") {
-    dist = new log_inner_product_fn(dim);
-    dynamic_cast<mahalanobis_fn*>(dist)->setDiag(theta_fn);
-  }
-  else if (dist_type == "eu")
-    dist = new euclidean_fn;
-  else {
-    fprintf(stderr, "--type unspecified or unknown\n");
-    exit(-1);
+    delete [] scores;
   }
 
-  return dist;
-}
+  timer.elapsed();
 
-void print(FILE* fid, float* m, int N) {
-  for (int i=0; i<N; ++i) {
-    for (int j=0; j<N; ++j)
-      fprintf(fid, "%.6f ", m[i * N + j]);
-    fprintf(fid, "\n");
-  }
+  return 0;
 }
 
 float calcError(float* s1, float* s2, int N) {
@@ -150,29 +451,6 @@ void normalize(float* m, int N, float eta) {
     m[i] = exp(eta * m[i]);
 }
 
-void cvtDistanceToSimilarity(float* m, int N) {
-  float min = m[0];
-  float max = m[0];
-
-  for (int i=0; i<N; ++i) {
-    for (int j=0; j<i; ++j) {
-      if (m[i * N + j] > max) max = m[i * N + j];
-      if (m[i * N + j] < min) min = m[i * N + j];
-    }
-  }
-
-  printf("max = %.7f, min = %.7f \n", max, min);
-
-  if (min - max == 0)
-    return;
-  
-  for (int i=0; i<N; ++i)
-    m[i*N + i] = min;
-  
-  for (int i=0; i<N*N; ++i)
-    m[i] = abs((m[i] - max) / (min - max));
-}
-
 void normalize_in_log(float* m, int N) {
 
   float min = m[0];
@@ -8,6 +8,16 @@ function guard() {
 
 guard
 
+# Usage: ./re-random-training-set.sh [phone-store]
+# With a phone store (extract --phone-store), the instances are numbered
+# from the store index instead of listing data/mfcc/<phone>/
+STORE=$1
+if [ -n "$STORE" ]; then
+  # nPhones is the uint32 at byte 16, the PhoneStoreEntry {first, nInstances}
+  # table starts at byte 56 (see include/phone_store.h)
+  N_PHONES=`od -A n -t u4 -j 16 -N 4 $STORE`
+  COUNTS=(`od -A n -v -t u8 -w16 -j 56 -N $((16 * N_PHONES)) $STORE | awk '{print $2}'`)
+fi
 
 PHONES=`cat data/phones.txt | awk '{print $1"\n"}'`
 
@@ -19,10 +29,15 @@ for p in $PHONES; do
   FOLDER=data/mfcc/$p
   mkdir -p data/train/list/
   LIST=data/train/list/$counter.list
+  COUNT=${COUNTS[$counter]:-0}
   let counter=counter+1
   rm -f $LIST
 
   printf "Shuffing phone \33[33m%6s\33[0m and save it into \33[34m$LIST\33[0m\n" $p
-  ls $FOLDER | shuf > $LIST
+  if [ -n "$STORE" ]; then
+    seq 0 $((COUNT - 1)) | sed 's/$/.mfc/' | shuf > $LIST
+  else
+    ls $FOLDER | shuf > $LIST
+  fi
 
 done
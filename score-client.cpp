@@ -0,0 +1,98 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <color.h>
+#include <cmdparser.h>
+
+#include <score_server.h>
+using namespace std;
+
+int main (int argc, char* argv[]) {
+
+  CmdParser cmdParser(argc, argv);
+  cmdParser
+    .add("--socket", "Unix domain socket of score-server", false, "/tmp/tdtw-score.sock")
+    .add("--ark", "feature archive, as seen by the server", false);
+
+  cmdParser
+    .addGroup("Requests (one of)")
+    .add("--pairs", "file of \"i j\" utterance index pairs, one per line. Prints their distances", false)
+    .add("--matrix", "file of utterance indices. Prints their pair-wise distance matrix", false)
+    .add("--topk", "print the k nearest utterances to --query", false)
+    .add("--query", "utterance index for --topk", false, "0")
+    .add("--stats", "set to \"true\" to print the server's latency percentiles", false, "false");
+
+  cmdParser
+    .addGroup("Example: ./score-client --ark=data/example.76.ark --topk=5 --query=0")
+    .addGroup("Example: ./score-client --stats=true");
+
+  if(!cmdParser.isOptionLegal())
+    cmdParser.showUsageAndExit();
+
+  string socket_fn  = cmdParser.find("--socket");
+  string archive_fn = cmdParser.find("--ark");
+  string pairs_fn   = cmdParser.find("--pairs");
+  string matrix_fn  = cmdParser.find("--matrix");
+  string topk	    = cmdParser.find("--topk");
+  bool stats	    = (cmdParser.find("--stats") == "true");
+
+  ScoreClient client;
+  if (!client.connect(socket_fn)) {
+    fprintf(stderr, "[Error] %s\n", client.getError().c_str());
+    return -1;
+  }
+
+  bool ok = true;
+  if (stats) {
+    string text;
+    if ((ok = client.stats(text)))
+      printf("%s", text.c_str());
+  }
+  else if (!pairs_fn.empty()) {
+    ifstream file(pairs_fn.c_str());
+    vector<pair<uint32_t, uint32_t> > pairs;
+    uint32_t i, j;
+    while (file >> i >> j)
+      pairs.push_back(make_pair(i, j));
+
+    vector<float> d;
+    if ((ok = client.score(archive_fn, pairs, d))) {
+      foreach (k, pairs)
+	printf("%u %u %.6f\n", pairs[k].first, pairs[k].second, d[k]);
+    }
+  }
+  else if (!matrix_fn.empty()) {
+    ifstream file(matrix_fn.c_str());
+    vector<uint32_t> indices;
+    uint32_t i;
+    while (file >> i)
+      indices.push_back(i);
+
+    vector<float> d;
+    if ((ok = client.matrix(archive_fn, indices, d))) {
+      size_t n = indices.size();
+      range (a, n) {
+	range (b, n)
+	  printf("%.6f ", d[a * n + b]);
+	printf("\n");
+      }
+    }
+  }
+  else if (!topk.empty()) {
+    vector<pair<uint32_t, float> > neighbors;
+    uint32_t query = str2int(cmdParser.find("--query"));
+    if ((ok = client.topk(archive_fn, query, str2int(topk), vector<uint32_t>(), neighbors))) {
+      foreach (k, neighbors)
+	printf("%u %.6f\n", neighbors[k].first, neighbors[k].second);
+    }
+  }
+  else
+    cmdParser.showUsageAndExit();
+
+  if (!ok) {
+    fprintf(stderr, "[Error] %s\n", client.getError().c_str());
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <color.h>
+#include <cmdparser.h>
+
+#include <score_server.h>
+using namespace std;
+
+ScoreServer* server = NULL;
+
+void onSignal(int) {
+  if (server)
+    server->stop();
+}
+
+int main (int argc, char* argv[]) {
+
+  CmdParser cmdParser(argc, argv);
+  cmdParser
+    .add("--socket", "Unix domain socket to listen on", false, "/tmp/tdtw-score.sock")
+    .add("--threads", "number of DTW worker threads shared by all clients (0 for all cores)", false, "0")
+    .add("--max-archives", "number of recently used archives kept in memory", false, "16");
+
+  cmdParser
+    .addGroup("Distance options")
+    .add("--type", "choose \"Euclidean (eu)\", \"Diagonal Manalanobis (ma)\", \"Log Inner Product (lip)\", \"DTW-DNN (dnn)\"")
+    .add("--theta", "specify the file containing the diagnol term of Mahalanobis distance (dim=39)", false)
+    .add("--model", "binary DTW-DNN model file (*.bin) for --type=dnn", false)
+    .add("--eta", "Specify the coefficient in the smoothing minimum", false, "-2");
+
+  cmdParser
+    .addGroup("Example: ./score-server --type=ma --theta=<some-trained-theta> &")
+    .addGroup("         ./score-client --ark=data/example.76.ark --topk=5 --query=0");
+
+  if(!cmdParser.isOptionLegal())
+    cmdParser.showUsageAndExit();
+
+  string socket_fn  = cmdParser.find("--socket");
+  size_t nThreads   = str2int(cmdParser.find("--threads"));
+  size_t maxArchives= str2int(cmdParser.find("--max-archives"));
+  string dist_type  = cmdParser.find("--type");
+  string theta_fn   = cmdParser.find("--theta");
+  string model_fn   = cmdParser.find("--model");
+  float eta	    = str2float(cmdParser.find("--eta"));
+
+  ScoreServer::DistanceFactory factory = [&] (int dim) {
+    return initDistanceMeasure(dist_type, dim, theta_fn, model_fn);
+  };
+
+  ScoreServer scoreServer(factory, eta, nThreads, maxArchives);
+  if (!scoreServer.listen(socket_fn))
+    return -1;
+
+  server = &scoreServer;
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  printf("Listening on "GREEN"%s"COLOREND" (Ctrl-C to stop)\n", socket_fn.c_str());
+  scoreServer.run();
+
+  printf("%s", scoreServer.getStats().c_str());
+  server = NULL;
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include <iostream>
+#include <string>
+
+#include <cmdparser.h>
+#include <utility.h>
+
+#include <sim_matrix.h>
+
+using namespace std;
+
+int main (int argc, char* argv[]) {
+
+  CmdParser cmdParser(argc, argv);
+  cmdParser
+    .add("-i", "binary similarity matrix (see sim_matrix.h)")
+    .add("-o", "output text matrix, one row per line (default: stdout)", false)
+    .add("--rows", "only dump these rows, e.g. \"0-99\" (default: all)", false);
+
+  cmdParser
+    .addGroup("Example: ./sim-matrix-to-text -i ITERATION.sim -o ITERATION.mul-sim");
+
+  if(!cmdParser.isOptionLegal())
+    cmdParser.showUsageAndExit();
+
+  string input	= cmdParser.find("-i");
+  string output = cmdParser.find("-o");
+  string rows	= cmdParser.find("--rows");
+
+  SimMatrix matrix;
+  if (!matrix.open(input)) {
+    fprintf(stderr, "Cannot open %s\n", input.c_str());
+    return -1;
+  }
+
+  size_t N = matrix.size();
+  size_t begin = 0, end = N;
+  if (!rows.empty()) {
+    size_t dash = rows.find('-');
+    begin = str2int(rows.substr(0, dash));
+    end = (dash == string::npos) ? begin + 1 : str2int(rows.substr(dash + 1)) + 1;
+    end = std::min(end, N);
+  }
+
+  FILE* fid = output.empty() ? stdout : fopen(output.c_str(), "w");
+  if (!fid) {
+    fprintf(stderr, "Cannot open %s\n", output.c_str());
+    return -1;
+  }
+
+  // Same format as pair-wise-dtw used to write
+  vector<float> row(N);
+  for (size_t i=begin; i<end; ++i) {
+    matrix.getRow(i, row.data());
+    range (j, N)
+      fprintf(fid, "%.6f ", row[j]);
+    fprintf(fid, "\n");
+  }
+
+  if (fid != stdout)
+    fclose(fid);
+
+  return 0;
+}
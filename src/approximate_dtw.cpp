@@ -0,0 +1,558 @@
+#include <approximate_dtw.h>
+#include <pairwise_dtw.h>
+#include <thread_pool.h>
+#include <prefilter.h>
+#include <landmark.h>
+#include <vector_quantizer.h>
+#include <rerank.h>
+#include <kaldi_archive.h>
+#include <atomic>
+#include <set>
+
+// ===========================
+// ===== Top-k Retrieval =====
+// ===========================
+void computeTopk(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, const vector<string>& ids, string queries_fn, size_t k, string output_fn, size_t nThreads, size_t nCandidates, bool recall) {
+
+  vector<int> queries;
+  if (queries_fn.empty()) {
+    for (int i=0; i<N; ++i)
+      queries.push_back(i);
+  }
+  else {
+    map<string, int> index;
+    foreach (i, ids)
+      index[ids[i]] = i;
+
+    vector<string> queryIds = loadIdList(queries_fn);
+    foreach (i, queryIds) {
+      auto itr = index.find(queryIds[i]);
+      if (itr == index.end()) {
+	fprintf(stderr, "[Error] Query %s is not in the archive\n", queryIds[i].c_str());
+	exit(-1);
+      }
+      queries.push_back(itr->second);
+    }
+  }
+
+  vector<float> means = utteranceMeans(data, offset, N, dim);
+  PrefilterIndex index(data, offset, N, dim);
+
+  vector<vector<pair<float, int> > > nearest(queries.size());
+  vector<vector<int> > retrieved(queries.size()), truth(queries.size());
+  vector<TopkStats> stats(queries.size());
+
+  ThreadPool pool(nThreads);
+  foreach (i, queries) {
+    pool.submit([&, i] () {
+      int q = queries[i];
+      vector<int> all;
+      for (int c=0; c<N; ++c) {
+	if (c != q)
+	  all.push_back(c);
+      }
+
+      vector<int> candidates = (nCandidates > 0) ? index.candidates(q, nCandidates) : all;
+      nearest[i] = topkDTW(data, offset, dim, dist, eta, q, candidates, k, means.data(), &stats[i]);
+
+      if (recall) {
+	foreach (j, nearest[i])
+	  retrieved[i].push_back(nearest[i][j].second);
+
+	vector<pair<float, int> > exact = topkDTW(data, offset, dim, dist, eta, q, all, k, means.data());
+	foreach (j, exact)
+	  truth[i].push_back(exact[j].second);
+      }
+    });
+  }
+  pool.wait();
+
+  if (recall)
+    printf("Prefilter recall@%lu with %lu candidates: "GREEN"%.4f"COLOREND"\n", k, nCandidates, recallAtK(truth, retrieved, k));
+
+  TopkStats total;
+  foreach (i, stats) {
+    total.nAligned += stats[i].nAligned;
+    total.nAbandoned += stats[i].nAbandoned;
+    total.nRows += stats[i].nRows;
+    total.nRowsComputed += stats[i].nRowsComputed;
+  }
+
+  printf("Abandoned "GREEN"%lu"COLOREND" of %lu alignments, computed %.1f%% of the DP rows\n",
+      total.nAbandoned, total.nAligned, total.nRows ? 100.0 * total.nRowsComputed / total.nRows : 0.0);
+
+  FILE* fid = (output_fn.empty()) ? stdout : fopen(output_fn.c_str(), "w");
+  if (!fid) {
+    fprintf(stderr, "Cannot open %s\n", output_fn.c_str());
+    exit(-1);
+  }
+
+  foreach (i, queries) {
+    foreach (j, nearest[i])
+      fprintf(fid, "%s %s %.6f\n", ids[queries[i]].c_str(), ids[nearest[i][j].second].c_str(), nearest[i][j].first);
+  }
+
+  if (fid != stdout)
+    fclose(fid);
+}
+
+// =====================
+// ===== Prefilter =====
+// =====================
+// Pairs (i, j) with j among the nCandidates of i, or i among those of j, are
+// aligned. The others are ranked by their summary distance s behind all the
+// aligned ones: max + R * s / sMax, R being the range of the aligned
+// distances and sMax the largest s of a pruned pair.
+float* computePrefilteredPairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, size_t nCandidates, size_t nThreads, bool recall, size_t k) {
+
+  PrefilterIndex index(data, offset, N, dim);
+
+  // partners[i]: the j < i aligned with i, sorted
+  vector<vector<int> > candidates(N), partners(N);
+  for (int i=0; i<N; ++i) {
+    candidates[i] = index.candidates(i, nCandidates);
+    foreach (c, candidates[i]) {
+      int j = candidates[i][c];
+      partners[std::max(i, j)].push_back(std::min(i, j));
+    }
+  }
+
+  size_t nPairs = 0;
+  for (int i=0; i<N; ++i) {
+    std::sort(partners[i].begin(), partners[i].end());
+    partners[i].erase(std::unique(partners[i].begin(), partners[i].end()), partners[i].end());
+    nPairs += partners[i].size();
+  }
+
+  // Aligned pairs get their DTW distance, pruned ones their summary distance
+  // for now
+  float* scores = new float[(size_t) N * N];
+
+  ThreadPool pool(nThreads);
+  for (int i=0; i<N; ++i) {
+    pool.submit([&, i] () {
+      vector<float> pdist, alpha;
+      float* row = scores + (size_t) i * N;
+      row[i] = 0;
+      size_t p = 0;
+      for (int j=0; j<i; ++j) {
+	if (p < partners[i].size() && partners[i][p] == j) {
+	  row[j] = pairDTW(data, offset, dim, dist, eta, i, j, pdist, alpha);
+	  ++p;
+	}
+	else
+	  row[j] = index.distance(i, j);
+      }
+    });
+  }
+  pool.wait();
+
+  float min = FLT_MAX, max = 0, sMax = 0;
+  for (int i=0; i<N; ++i) {
+    const float* row = scores + (size_t) i * N;
+    size_t p = 0;
+    for (int j=0; j<i; ++j) {
+      if (p < partners[i].size() && partners[i][p] == j) {
+	min = std::min(min, row[j]);
+	max = std::max(max, row[j]);
+	++p;
+      }
+      else
+	sMax = std::max(sMax, row[j]);
+    }
+  }
+
+  float R = (nPairs > 0 && max > min) ? max - min : 1;
+  for (int i=0; i<N; ++i) {
+    float* row = scores + (size_t) i * N;
+    size_t p = 0;
+    for (int j=0; j<i; ++j) {
+      if (p < partners[i].size() && partners[i][p] == j)
+	++p;
+      else
+	row[j] = max + (sMax > 0 ? R * row[j] / sMax : R);
+      scores[(size_t) j * N + i] = row[j];
+    }
+  }
+
+  size_t nTotal = (size_t) N * (N - 1) / 2;
+  printf("Prefilter: aligned "GREEN"%lu"COLOREND" of %lu pairs (%.1f%%)\n", nPairs, nTotal, nTotal ? 100.0 * nPairs / nTotal : 0.0);
+
+  if (recall) {
+    float* exact = new float[(size_t) N * N];
+    computePairwiseDTW(data, offset, N, dim, dist, eta, exact, vector<bool>(N, true), nThreads);
+
+    vector<vector<int> > truth = nearestNeighbours(exact, N, k);
+    delete [] exact;
+
+    printf("Prefilter recall@%lu with %lu candidates: "GREEN"%.4f"COLOREND"\n", k, nCandidates, recallAtK(truth, candidates, k));
+  }
+
+  return scores;
+}
+
+// =====================
+// ===== Landmarks =====
+// =====================
+// Exact DTW for the N x L pairs with a landmark only. They are turned into
+// similarities the way cvtDistanceToSimilarity does, with the min / max of
+// these distances, and the N x N similarities are reconstructed from them,
+// unless dense is false: then only the factors are saved and NULL returned.
+float* computeLandmarkSimilarity(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, size_t L, string selection, const vector<string>& ids, string factors_fn, size_t nThreads, bool recall, bool dense) {
+
+  vector<float> means = utteranceMeans(data, offset, N, dim);
+  vector<int> landmarks = selectLandmarks(means.data(), N, dim, L, selection);
+  L = landmarks.size();
+
+  vector<float> C((size_t) N * L);
+
+  ThreadPool pool(nThreads);
+  for (int i=0; i<N; ++i) {
+    pool.submit([&, i] () {
+      vector<float> pdist, alpha;
+      range (l, L)
+	C[(size_t) i * L + l] = (landmarks[l] == i) ? 0 : pairDTW(data, offset, dim, dist, eta, i, landmarks[l], pdist, alpha);
+    });
+  }
+  pool.wait();
+
+  float min = FLT_MAX, max = -FLT_MAX;
+  for (int i=0; i<N; ++i) {
+    range (l, L) {
+      if (landmarks[l] == i)
+	continue;
+      min = std::min(min, C[(size_t) i * L + l]);
+      max = std::max(max, C[(size_t) i * L + l]);
+    }
+  }
+
+  for (int i=0; i<N; ++i) {
+    range (l, L)
+      C[(size_t) i * L + l] = (landmarks[l] == i || max == min) ? 1 : (max - C[(size_t) i * L + l]) / (max - min);
+  }
+
+  NystromFactors factors(landmarks, C, N);
+
+  size_t nTotal = (size_t) N * (N - 1) / 2;
+  printf("Landmarks: aligned "GREEN"%lu"COLOREND" of %lu pairs (%.1f%%), rank "GREEN"%lu"COLOREND"\n",
+      (size_t) N * L, nTotal, nTotal ? 100.0 * N * L / nTotal : 0.0, factors.rank());
+
+  if (!factors_fn.empty())
+    factors.save(factors_fn, ids);
+
+  float* scores = NULL;
+  if (dense) {
+    scores = new float[(size_t) N * N];
+    factors.reconstruct(scores, nThreads);
+  }
+
+  if (recall) {
+    const size_t k = 10;
+
+    float* exact = new float[(size_t) N * N];
+    computePairwiseDTW(data, offset, N, dim, dist, eta, exact, vector<bool>(N, true), nThreads);
+    cvtDistanceToSimilarity(exact, N);
+
+    double se = 0, norm = 0, maxError = 0;
+    for (int i=0; i<N; ++i) {
+      for (int j=0; j<N; ++j) {
+	if (j == i)
+	  continue;
+
+	// As reconstruct() has it
+	float approx = std::max(0.0f, std::min(1.0f, factors(i, j)));
+	double diff = approx - exact[(size_t) i * N + j];
+	se += diff * diff;
+	norm += exact[(size_t) i * N + j] * exact[(size_t) i * N + j];
+	maxError = std::max(maxError, fabs(diff));
+      }
+    }
+
+    vector<vector<int> > truth = nearestNeighbours(exact, N, k, true);
+
+    // Without a dense matrix of our own, reconstruct into the exact one
+    if (!scores)
+      factors.reconstruct(exact, nThreads);
+    vector<vector<int> > retrieved = nearestNeighbours(scores ? scores : exact, N, k, true);
+    delete [] exact;
+
+    size_t n = (size_t) N * (N - 1);
+    printf("Landmark accuracy with L = %lu: RMSE "GREEN"%.4f"COLOREND", max error %.4f, "
+	"relative Frobenius error %.4f, recall@%lu "GREEN"%.4f"COLOREND"\n",
+	L, n ? sqrt(se / n) : 0.0, maxError, norm > 0 ? sqrt(se / norm) : 0.0, k, recallAtK(truth, retrieved, k));
+  }
+
+  return scores;
+}
+
+// ===============================
+// ===== Vector Quantization =====
+// ===============================
+// Utterances read (and, for the re-scoring, aligned) at a time
+#define VQ_BATCH_SIZE 1024
+
+// Frames read to train a codebook: what Codebook::train() samples from
+#define VQ_TRAINING_FRAMES 100000
+
+// Only the codes stay in memory. The archive is read VQ_BATCH_SIZE utterances
+// at a time through its index, reduced and encoded, and all pairs are aligned
+// on code sequences, pdist being gathered from the K x K distances between
+// centroids. The nRescore nearest of every utterance found that way, which
+// are what a ranking is made of, are then aligned again on their frames, read
+// again a batch of pairs at a time. The other pairs keep their quantized
+// distances.
+float* computeQuantizedPairwiseDTW(string archive_fn, vector<string>& ids, FrameReducer& reducer, string dist_type, string theta_fn, string model_fn, float eta, size_t K, string codebook_fn, size_t nRescore, size_t nThreads, bool recall, size_t k) {
+
+  if (ids.empty()) {
+    KaldiArchiveIndex index;
+    if (!index.open(archive_fn)) {
+      fprintf(stderr, "Cannot open archive %s\n", archive_fn.c_str());
+      exit(-1);
+    }
+    ids = index.getKeys();
+  }
+  int N = ids.size();
+
+  if (N == 0) {
+    fprintf(stderr, "[Error] No utterance in %s\n", archive_fn.c_str());
+    exit(-1);
+  }
+
+  // The frame reduction of the encoding pass, applied the same way (but not
+  // counted) whenever frames are read outside of it
+  FrameReducer rereader = reducer;
+
+  Codebook codebook;
+  int dim = 0;
+  if (!codebook_fn.empty() && exists(codebook_fn)) {
+    // The dimension of the frames, to check the codebook against
+    int n; float* data; unsigned int* offset;
+    loadFeatureArchive(archive_fn, vector<string>(1, ids[0]), data, offset, n, dim);
+    delete [] data;
+    delete [] offset;
+
+    if (!codebook.load(codebook_fn, dim)) {
+      fprintf(stderr, "[Error] Cannot load codebook %s\n", codebook_fn.c_str());
+      exit(-1);
+    }
+    printf("Codebook of "GREEN"%lu"COLOREND" centroids loaded from %s\n", codebook.size(), codebook_fn.c_str());
+  }
+  else {
+    // Whole utterances in random order until there are enough frames, put
+    // back in archive order
+    vector<int> order(N);
+    range (i, N)
+      order[i] = i;
+    std::srand(0);
+    std::random_shuffle(order.begin(), order.end());
+
+    map<int, vector<float> > sampled;
+    size_t nFrames = 0;
+    for (int b=0; b<N && nFrames < VQ_TRAINING_FRAMES; b+=VQ_BATCH_SIZE) {
+      int e = std::min(N, b + VQ_BATCH_SIZE);
+      vector<string> batch;
+      for (int i=b; i<e; ++i)
+	batch.push_back(ids[order[i]]);
+
+      int n; float* data; unsigned int* offset;
+      loadFeatureArchive(archive_fn, batch, data, offset, n, dim);
+      rereader.reduce(data, offset, n, dim);
+
+      for (int i=0; i<n && nFrames < VQ_TRAINING_FRAMES; ++i) {
+	sampled[order[b + i]].assign(data + offset[i], data + offset[i + 1]);
+	nFrames += (offset[i + 1] - offset[i]) / dim;
+      }
+
+      delete [] data;
+      delete [] offset;
+    }
+
+    vector<float> frames;
+    frames.reserve(nFrames * dim);
+    for (auto itr = sampled.begin(); itr != sampled.end(); ++itr)
+      frames.insert(frames.end(), itr->second.begin(), itr->second.end());
+
+    codebook.train(frames.data(), nFrames, dim, K, 20, VQ_TRAINING_FRAMES, nThreads);
+    if (!codebook_fn.empty() && !codebook.save(codebook_fn)) {
+      fprintf(stderr, "[Error] Cannot write to %s\n", codebook_fn.c_str());
+      exit(-1);
+    }
+  }
+
+  QuantizedArchive archive(codebook);
+  size_t nFrames = 0;
+  for (int b=0; b<N; b+=VQ_BATCH_SIZE) {
+    vector<string> batch(ids.begin() + b, ids.begin() + std::min(N, b + VQ_BATCH_SIZE));
+
+    int n; float* data; unsigned int* offset;
+    loadFeatureArchive(archive_fn, batch, data, offset, n, dim);
+    reducer.reduce(data, offset, n, dim);
+
+    archive.append(data, offset, n, dim, nThreads);
+    nFrames += offset[n] / dim;
+
+    delete [] data;
+    delete [] offset;
+  }
+  reducer.printStats();
+
+  distance_fn* dist = initDistanceMeasure(dist_type, dim, theta_fn, model_fn);
+  vector<float> table = codebook.distanceTable(*dist, nThreads);
+
+  printf("VQ: "GREEN"%lu"COLOREND" centroids, "GREEN"%.1f"COLOREND" bytes of codes per utterance (%.1f as float frames)\n",
+      codebook.size(), N ? (double) archive.bytes() / N : 0.0, N ? (double) nFrames * dim * sizeof(float) / N : 0.0);
+
+  float* scores = new float[(size_t) N * N];
+
+  ThreadPool pool(nThreads);
+  for (int i=0; i<N; ++i) {
+    pool.submit([&, i] () {
+      vector<float> pdist, alpha;
+      float* row = scores + (size_t) i * N;
+
+      row[i] = 0;
+      for (int j=0; j<i; ++j) {
+	size_t rows = archive.length(i), cols = archive.length(j);
+	if (pdist.size() < rows * cols) {
+	  pdist.resize(rows * cols);
+	  alpha.resize(rows * cols);
+	}
+
+	archive.pair_distance(i, j, table.data(), pdist.data());
+	row[j] = scores[(size_t) j * N + i] = fast_dtw(pdist.data(), rows, cols, dim, eta, alpha.data());
+      }
+    });
+  }
+  pool.wait();
+
+  vector<vector<int> > quantized;
+  if (recall)
+    quantized = nearestNeighbours(scores, N, k);
+
+  // Each pair (i > j) once, however many rankings it is in, sorted by i
+  vector<vector<int> > nearest = nearestNeighbours(scores, N, nRescore);
+  vector<pair<int, int> > pairs;
+  for (int i=0; i<N; ++i) {
+    foreach (r, nearest[i]) {
+      int j = nearest[i][r];
+      pairs.push_back(std::make_pair(std::max(i, j), std::min(i, j)));
+    }
+  }
+  std::sort(pairs.begin(), pairs.end());
+  pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+  // The pairs of VQ_BATCH_SIZE consecutive i at a time, with the frames of
+  // the utterances in them
+  for (size_t begin=0; begin<pairs.size(); ) {
+    size_t end = begin;
+    while (end < pairs.size() && pairs[end].first < pairs[begin].first + VQ_BATCH_SIZE)
+      ++end;
+
+    vector<int> members;
+    for (size_t p=begin; p<end; ++p) {
+      members.push_back(pairs[p].first);
+      members.push_back(pairs[p].second);
+    }
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()), members.end());
+
+    vector<string> batch(members.size());
+    foreach (m, members)
+      batch[m] = ids[members[m]];
+
+    int n; float* data; unsigned int* offset;
+    loadFeatureArchive(archive_fn, batch, data, offset, n, dim);
+    rereader.reduce(data, offset, n, dim);
+
+    size_t chunk = (end - begin + pool.size() * 4 - 1) / (pool.size() * 4);
+    for (size_t b=begin; b<end; b+=chunk) {
+      pool.submit([&, b] () {
+	vector<float> pdist, alpha;
+	for (size_t p=b; p<std::min(b + chunk, end); ++p) {
+	  int i = pairs[p].first, j = pairs[p].second;
+	  int x = std::lower_bound(members.begin(), members.end(), i) - members.begin();
+	  int y = std::lower_bound(members.begin(), members.end(), j) - members.begin();
+	  scores[(size_t) i * N + j] = scores[(size_t) j * N + i] = pairDTW(data, offset, dim, *dist, eta, x, y, pdist, alpha);
+	}
+      });
+    }
+    pool.wait();
+
+    delete [] data;
+    delete [] offset;
+    begin = end;
+  }
+
+  size_t nTotal = (size_t) N * (N - 1) / 2;
+  printf("VQ: re-scored "GREEN"%lu"COLOREND" of %lu pairs (%.1f%%) on the frames, the others stay quantized\n", pairs.size(), nTotal, nTotal ? 100.0 * pairs.size() / nTotal : 0.0);
+
+  // Everything is read again, at full rate for the frame-reduction report
+  if (recall) {
+    int n; float* data; unsigned int* offset;
+    loadFeatureArchive(archive_fn, ids, data, offset, n, dim);
+
+    float* fullData = NULL; unsigned int* fullOffset = NULL;
+    if (reducer.isEnabled()) {
+      fullData = new float[offset[N]];
+      fullOffset = new unsigned int[N + 1];
+      std::copy(data, data + offset[N], fullData);
+      std::copy(offset, offset + N + 1, fullOffset);
+    }
+    rereader.reduce(data, offset, N, dim);
+
+    float* exact = new float[(size_t) N * N];
+    computePairwiseDTW(data, offset, N, dim, *dist, eta, exact, vector<bool>(N, true), nThreads);
+    vector<vector<int> > truth = nearestNeighbours(exact, N, k);
+    delete [] exact;
+    delete [] data;
+    delete [] offset;
+
+    printf("VQ recall@%lu: "GREEN"%.4f"COLOREND" quantized, "GREEN"%.4f"COLOREND" after re-scoring the %lu nearest\n",
+	k, recallAtK(truth, quantized, k), recallAtK(truth, nearestNeighbours(scores, N, k), k), nRescore);
+
+    if (fullData) {
+      reportFrameReduction(fullData, fullOffset, N, dim, *dist, eta, scores, ids, nThreads, k);
+      delete [] fullData;
+      delete [] fullOffset;
+    }
+  }
+
+  delete dist;
+  return scores;
+}
+
+// =======================================
+// ===== Frame-rate Reduction Report =====
+// =======================================
+// The scores of the reduced frames (distances) are ranked against the k
+// nearest neighbours of every utterance under full-rate DTW, which are taken
+// as its relevant documents: the MAP says how much of the ranking survives
+// the reduction. The MAP against real answers comes from graph-rerank on the
+// matrices written.
+void reportFrameReduction(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, const float* scores, const vector<string>& ids, size_t nThreads, size_t k) {
+  float* exact = new float[N * N];
+  computePairwiseDTW(data, offset, N, dim, dist, eta, exact, vector<bool>(N, true), nThreads);
+
+  vector<vector<int> > truth = nearestNeighbours(exact, N, k);
+  delete [] exact;
+
+  // Every utterance ranked, for its AP
+  vector<vector<int> > ranked = nearestNeighbours(scores, N, N);
+  vector<vector<int> > retrieved(N);
+  double sumAP = 0;
+  for (int i=0; i<N; ++i) {
+    std::set<string> relevant;
+    foreach (r, truth[i])
+      relevant.insert(ids[truth[i][r]]);
+
+    retrieved[i].assign(ranked[i].begin(), ranked[i].begin() + std::min(k, ranked[i].size()));
+
+    vector<string> ranking(ranked[i].size());
+    foreach (r, ranked[i])
+      ranking[r] = ids[ranked[i][r]];
+    sumAP += averagePrecision(ranking, relevant);
+  }
+
+  printf("Frame reduction against full rate (its %lu nearest as relevant): MAP "GREEN"%.4f"COLOREND
+      ", recall@%lu "GREEN"%.4f"COLOREND"\n", k, N ? sumAP / N : 0.0, k, recallAtK(truth, retrieved, k));
+}
@@ -1,78 +1,69 @@
 #include <archive_io.h>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread_pool.h>
+#include <bounded_queue.h>
+#include <atomic>
+#include <memory>
 
 // **************************************
 // ***** Load Kaldi Feature Archive *****
 // **************************************
-size_t loadFeatureArchive(const string& featArk, const map<string, vector<Phone> >& phoneLabels, map<size_t, vector<FeatureSeq> >& phoneInstances) {
+// Copy an arena into the old layout of one float array + 32-bit offsets
+static bool toLegacyLayout(const FeatureArena& arena, string filename, float* &data, unsigned int* &offset, int& N, int& dim, string& error) {
 
-  FILE* fptr = fopen(featArk.c_str(), "r");
-  VulcanUtterance vUtterance;
-  while (vUtterance.LoadKaldi(fptr)) {
+  N = arena.size();
+  dim = arena.getDim();
 
-    string docId = vUtterance.fid();
-    if ( phoneLabels.count(docId) == 0 )
-      continue;
-
-    const FeatureSeq& fs = vUtterance._feature;
-    const vector<Phone>& phoneLbl = phoneLabels.find(docId)->second;
-
-    auto offset = fs.begin();
-    for (size_t i=0; i<phoneLbl.size(); ++i) {
-      size_t phoneIdx = phoneLbl[i].first;
-      size_t nFrame = phoneLbl[i].second;
-
-      FeatureSeq fs(nFrame);
-      std::copy(offset, offset + nFrame, fs.begin());
-      offset += nFrame;
-	
-      phoneInstances[phoneIdx].push_back(fs);
-    }
-  }
-
-  size_t nInstance = 0;
-  for (auto i=phoneInstances.cbegin(); i != phoneInstances.cend(); ++i)
-    nInstance += i->second.size();
-  return nInstance;
-}
-
-void loadFeatureArchive(string filename, float* &data, unsigned int* &offset, int& N, int& dim, vector<string>* docid) {
-
-  vector<FeatureSeq> featureSeqs;
-
-  FILE* fptr = fopen(filename.c_str(), "r");
-  vulcan::VulcanUtterance vUtterance;
-  while (vUtterance.LoadKaldi(fptr)) {
-    featureSeqs.push_back(vUtterance._feature);
-    if (docid != NULL)
-      docid->push_back(vUtterance.fid());
+  // offset[] is in floats and only 32-bit
+  if ((uint64_t) arena.nFrames() * dim > UINT_MAX) {
+    error = filename + " is too large for 32-bit offsets, use loadKaldiArchive() instead";
+    return false;
   }
-  fclose(fptr);
-
-  N = featureSeqs.size();
-  dim = featureSeqs[0][0].size();
 
   offset = new unsigned int[N + 1];
   offset[0] = 0;
-  for (int i=1; i<N+1; ++i) {
-    size_t prevLength = featureSeqs[i-1].size();
-    offset[i] = offset[i-1] + prevLength * dim;
-  }
+  for (int i=1; i<N+1; ++i)
+    offset[i] = offset[i-1] + arena.length(i-1) * dim;
 
   size_t totalLength = offset[N];
   data = new float[totalLength];
+  if (N > 0)
+    std::copy(arena.data(0), arena.data(0) + totalLength, data);
 
-  for (int i=0; i<N; ++i) {
-    unsigned int begin = offset[i];
-    unsigned int  end  = offset[i+1];
-    float* d = &data[begin];
-    int length = (end - begin) / dim;
+  return true;
+}
 
-    for (int j=0; j<length; ++j) 
-      for (int k=0; k<dim; ++k)
-	d[j * dim + k] = featureSeqs[i][j]._data->data[k]; 
+static void toLegacyLayout(const FeatureArena& arena, string filename, float* &data, unsigned int* &offset, int& N, int& dim) {
+  string error;
+  if (!toLegacyLayout(arena, filename, data, offset, N, dim, error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    exit(-1);
   }
 }
 
+void loadFeatureArchive(string filename, float* &data, unsigned int* &offset, int& N, int& dim, vector<string>* docid) {
+  FeatureArena arena;
+  loadKaldiArchive(filename, arena, docid);
+  toLegacyLayout(arena, filename, data, offset, N, dim);
+}
+
+void loadFeatureArchive(string filename, const vector<string>& ids, float* &data, unsigned int* &offset, int& N, int& dim) {
+  FeatureArena arena;
+  loadKaldiArchive(filename, ids, arena);
+  toLegacyLayout(arena, filename, data, offset, N, dim);
+}
+
+bool tryLoadFeatureArchive(string filename, float* &data, unsigned int* &offset, int& N, int& dim, string& error) {
+  FeatureArena arena;
+  return tryLoadKaldiArchive(filename, arena, error)
+    && toLegacyLayout(arena, filename, data, offset, N, dim, error);
+}
+
 // ***************************************
 // ***** Save Features as MFCC files *****
 // ***************************************
@@ -83,70 +74,386 @@ void save(const FeatureSeq& featureSeq, const string& filename) {
   tmpInst.SaveHtk(filename, false);
 }
 
-size_t saveFeatureAsMFCC(const map<size_t, vector<FeatureSeq> >& phoneInstances, const vector<string> &phones, string dir) {
-  dir += "/";
+// *******************************************
+// ***** Pipelined Phone Instance Extract *****
+// *******************************************
+// One thread reads utterances, a pool of slicers cuts them into phone
+// instances and a pool of writers saves those, connected by bounded queues,
+// so only a few utterances are ever held in memory.
+//
+// Where every instance goes is planned from the archive index and the
+// alignments before any frame is read: the k-th instance of a phone is its
+// k-th occurrence in archive order, and its place in the phone store is
+// known up front, so writers pwrite() instances in whatever order they come.
+
+struct PlannedUtterance {
+  string key;
+  uint64_t offset;	// in the archive, from the index
+  size_t first;		// its instances are [first, first + labels.size()) in plan
+  const vector<Phone>* labels;
+};
+
+struct PlannedInstance {
+  size_t phone;
+  size_t k;		// k-th instance of the phone
+  size_t global;	// index in the phone store
+};
+
+struct UtteranceJob {
+  const PlannedUtterance* utterance;
+  vector<float> frames;
+  size_t nFrames;
+  size_t dim;
+};
+
+struct InstanceJob {
+  const PlannedInstance* instance;
+  vector<float> frames;
+  size_t nFrames;
+  size_t dim;
+};
+
+static void savePhoneInstanceAsMFCC(const InstanceJob& job, const string& filename) {
+  FeatureSeq fs;
+  fs.reserve(job.nFrames);
+  range (t, job.nFrames) {
+    fs.push_back(DoubleVector(job.dim));
+    range (k, job.dim)
+      fs.back()._data->data[k] = job.frames[t * job.dim + k];
+  }
+  save(fs, filename);
+}
+
+static bool pwriteAll(int fd, const void* buffer, size_t nBytes, uint64_t offset) {
+  const char* p = (const char*) buffer;
+  while (nBytes > 0) {
+    ssize_t n = pwrite(fd, p, nBytes, offset);
+    if (n <= 0)
+      return false;
+    p += n;
+    nBytes -= n;
+    offset += n;
+  }
+  return true;
+}
+
+size_t extractPhoneInstances(const string& featArk, const map<string, vector<Phone> >& phoneLabels, const vector<string>& phones, string mfccDir, string phoneStore, size_t nThreads) {
+
+  // ===== Plan =====
+  KaldiArchiveIndex index;
+  if (!index.open(featArk)) {
+    fprintf(stderr, "Cannot open feature archive %s\n", featArk.c_str());
+    exit(-1);
+  }
+
+  size_t nPhones = phones.size();
+  vector<PlannedUtterance> utterances;
+  vector<PlannedInstance> instances;
+  vector<size_t> count(nPhones, 0);
+
+  const vector<string>& keys = index.getKeys();
+  foreach (i, keys) {
+    auto itr = phoneLabels.find(keys[i]);
+    if (itr == phoneLabels.end())
+      continue;
 
-  size_t nInstanceC = 0;
-  for (auto i=phoneInstances.cbegin(); i != phoneInstances.cend(); ++i) {
+    PlannedUtterance u = { keys[i], index.getOffset(i), instances.size(), &itr->second };
+    utterances.push_back(u);
 
-    string phone = phones[i->first];
-    string folder = dir + phone;
-    const vector<FeatureSeq>& fSeqs = i->second;
+    const vector<Phone>& labels = itr->second;
+    foreach (j, labels) {
+      size_t p = labels[j].first;
+      if (p >= nPhones) {
+	fprintf(stderr, "Phone index %lu of %s is not in the phone table\n", p, keys[i].c_str());
+	exit(-1);
+      }
+      PlannedInstance inst = { p, count[p]++, 0 };
+      instances.push_back(inst);
+    }
+  }
 
-    string ret = exec("mkdir -p " + folder);
+  vector<PhoneStoreEntry> entries(nPhones);
+  range (p, nPhones) {
+    entries[p].first = (p == 0) ? 0 : entries[p-1].first + entries[p-1].nInstances;
+    entries[p].nInstances = count[p];
+  }
+
+  size_t nInstances = instances.size();
+  vector<uint64_t> length(nInstances), offset(nInstances + 1, 0);
+  foreach (u, utterances) {
+    const vector<Phone>& labels = *utterances[u].labels;
+    foreach (j, labels) {
+      PlannedInstance& inst = instances[utterances[u].first + j];
+      inst.global = entries[inst.phone].first + inst.k;
+      length[inst.global] = labels[j].second;
+    }
+  }
+  range (i, nInstances)
+    offset[i + 1] = offset[i] + length[i];
+
+  // ===== Output =====
+  if (!mfccDir.empty()) {
+    mfccDir += "/";
+    range (p, nPhones)
+      if (count[p] > 0)
+	exec("mkdir -p " + mfccDir + phones[p]);
+  }
 
-    ProgressBar pBar("Saving phone instances for \t" GREEN + phone + COLOREND "\t...");
-    for (size_t i=0; i<fSeqs.size(); ++i) {
-      pBar.refresh(double (i+1) / fSeqs.size());
-      save(fSeqs[i], folder + "/" + int2str(i) + ".mfc");
+  PhoneStoreHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, PHONE_STORE_MAGIC, sizeof(header.magic));
+  header.version = PHONE_STORE_VERSION;
+  header.nPhones = nPhones;
+  header.nInstances = nInstances;
+  header.nFrames = offset.back();
+
+  size_t indexEnd = sizeof(PhoneStoreHeader) + nPhones * sizeof(PhoneStoreEntry) + offset.size() * sizeof(uint64_t);
+  header.dataOffset = (indexEnd + PHONE_STORE_ALIGNMENT - 1) / PHONE_STORE_ALIGNMENT * PHONE_STORE_ALIGNMENT;
+
+  // The header goes in last, once dim is known
+  string tmp = phoneStore + ".tmp";
+  int fd = -1;
+  if (!phoneStore.empty()) {
+    fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0
+	|| !pwriteAll(fd, entries.data(), nPhones * sizeof(PhoneStoreEntry), sizeof(PhoneStoreHeader))
+	|| !pwriteAll(fd, offset.data(), offset.size() * sizeof(uint64_t), sizeof(PhoneStoreHeader) + nPhones * sizeof(PhoneStoreEntry))) {
+      fprintf(stderr, "Cannot write %s\n", tmp.c_str());
+      exit(-1);
     }
-    nInstanceC += fSeqs.size();
   }
-  cout << "nInstanceC = " << nInstanceC << endl;
 
-  int nMfccFiles = str2int(exec("ls " + dir + "* | wc -l"));
-  return nMfccFiles;
+  // ===== Pipeline =====
+  if (nThreads == 0)
+    nThreads = ThreadPool::hardwareConcurrency();
+  size_t nSlicers = std::max<size_t>(1, nThreads / 2);
+  size_t nWriters = std::max<size_t>(1, nThreads - nSlicers);
+
+  typedef std::shared_ptr<UtteranceJob> UtterancePtr;
+  typedef std::shared_ptr<InstanceJob> InstancePtr;
+  BoundedQueue<UtterancePtr> utteranceQueue(nSlicers * 2);
+  BoundedQueue<InstancePtr> instanceQueue(nWriters * 64);
+
+  std::atomic<size_t> nWritten(0);
+  std::atomic<bool> failed(false);
+  uint32_t dim = 0;
+
+  vector<std::thread> slicers, writers;
+
+  range (i, nSlicers) {
+    slicers.push_back(std::thread([&] () {
+      UtterancePtr job;
+      while (utteranceQueue.pop(job)) {
+	const PlannedUtterance& u = *job->utterance;
+	const vector<Phone>& labels = *u.labels;
+
+	size_t t = 0;
+	foreach (j, labels) {
+	  size_t nFrames = labels[j].second;
+	  if (t + nFrames > job->nFrames) {
+	    fprintf(stderr, "Alignment of %s is longer than its %lu frames\n", u.key.c_str(), job->nFrames);
+	    exit(-1);
+	  }
+
+	  InstancePtr inst(new InstanceJob);
+	  inst->instance = &instances[u.first + j];
+	  inst->frames.assign(job->frames.begin() + t * job->dim, job->frames.begin() + (t + nFrames) * job->dim);
+	  inst->nFrames = nFrames;
+	  inst->dim = job->dim;
+	  t += nFrames;
+
+	  instanceQueue.push(inst);
+	}
+      }
+    }));
+  }
+
+  range (i, nWriters) {
+    writers.push_back(std::thread([&] () {
+      InstancePtr job;
+      while (instanceQueue.pop(job)) {
+	const PlannedInstance& inst = *job->instance;
+
+	if (fd >= 0) {
+	  uint64_t pos = header.dataOffset + offset[inst.global] * job->dim * sizeof(float);
+	  if (!pwriteAll(fd, job->frames.data(), job->frames.size() * sizeof(float), pos))
+	    failed = true;
+	}
+
+	if (!mfccDir.empty())
+	  savePhoneInstanceAsMFCC(*job, mfccDir + phones[inst.phone] + "/" + int2str(inst.k) + ".mfc");
+
+	++nWritten;
+      }
+    }));
+  }
+
+  // The reader runs on this thread, reading the archive front to back and
+  // stepping over the utterances that have no alignment.
+  KaldiArchiveReader reader;
+  if (!reader.open(featArk)) {
+    fprintf(stderr, "Cannot open feature archive %s\n", featArk.c_str());
+    exit(-1);
+  }
+
+  ProgressBar pBar("Extracting phone instances");
+  FeatureArena arena;
+  string key;
+  size_t u = 0;
+  while (u < utterances.size()) {
+    bool ok = true;
+    while (ok && reader.tell() < utterances[u].offset)
+      ok = reader.skip(key);
+
+    // clear() keeps the dimension, so the reader checks every utterance
+    // against the first one.
+    arena.clear();
+    if (!ok || reader.tell() != utterances[u].offset || !reader.read(arena, key) || key != utterances[u].key)
+      break;
+
+    if (dim == 0)
+      dim = arena.getDim();
+
+    UtterancePtr job(new UtteranceJob);
+    job->utterance = &utterances[u];
+    job->nFrames = arena.nFrames();
+    job->dim = arena.getDim();
+    job->frames.assign(arena.data(0), arena.data(0) + job->nFrames * job->dim);
+
+    utteranceQueue.push(job);
+    pBar.refresh(++u, utterances.size());
+  }
+  reader.close();
+
+  if (u != utterances.size()) {
+    fprintf(stderr, "%s changed while being extracted\n", featArk.c_str());
+    exit(-1);
+  }
+
+  utteranceQueue.close();
+  foreach (i, slicers)
+    slicers[i].join();
+
+  instanceQueue.close();
+  foreach (i, writers)
+    writers[i].join();
+
+  if (fd >= 0) {
+    header.dim = dim;
+    header.fileSize = header.dataOffset + header.nFrames * header.dim * sizeof(float);
+
+    bool ok = !failed
+      && pwriteAll(fd, &header, sizeof(header), 0)
+      && ftruncate(fd, header.fileSize) == 0;
+    ok = (::close(fd) == 0) && ok;
+
+    if (!ok || !atomicRename(tmp, phoneStore)) {
+      fprintf(stderr, "Failed to save phone store to %s\n", phoneStore.c_str());
+      exit(-1);
+    }
+  }
+
+  return nWritten;
 }
 
 // *********************************
 // ***** Load Phone Alignments *****
 // *********************************
-size_t load(string alignmentFile, string modelFile, map<string, vector<Phone> >& phoneLabels, bool dump) {
-  
-  fstream file(alignmentFile.c_str());
+// The alignment file is mmap'ed and cut into line-aligned chunks, which are
+// parsed in parallel in two passes: the first one collects the transition IDs
+// in use, so that (phone, state) can be looked up from plain arrays in the
+// second one instead of asking VulcanHmm for every frame.
+
+typedef std::pair<string, vector<Phone> > AlignedUtterance;
+
+struct AlignmentChunk {
+  const char* begin;
+  const char* end;
+  vector<bool> used;			// transition IDs seen in this chunk
+  vector<AlignedUtterance> utterances;	// in file order
+  string dump;
+};
+
+static bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
 
-  VulcanHmm vHmm;
-  vHmm.LoadKaldiModel(modelFile);
+// Next whitespace-separated token on the current line. Returns false at the
+// end of the line, leaving p on the '\n' (or at end).
+static bool nextToken(const char* &p, const char* end, const char* &tBegin, const char* &tEnd) {
+  while (p < end && isBlank(*p))
+    ++p;
 
-  Array<string> documents;
-  vector<size_t> lengths;
+  if (p == end || *p == '\n')
+    return false;
 
-  string phoneAlignment;
+  tBegin = p;
+  while (p < end && !isBlank(*p) && *p != '\n')
+    ++p;
+  tEnd = p;
 
-  string line;
-  while( std::getline(file, line) ) {
+  return true;
+}
+
+static size_t parseTransId(const char* begin, const char* end) {
+  size_t id = 0;
+  for (const char* p = begin; p < end; ++p) {
+    if (*p < '0' || *p > '9') {
+      fprintf(stderr, "[Error] \"%s\" in the alignment is not a transition ID\n", string(begin, end).c_str());
+      exit(-1);
+    }
+    id = id * 10 + (*p - '0');
+  }
+  return id;
+}
 
-    vector<string> substring = split(line, ' ');
+static void collectTransIds(AlignmentChunk& chunk) {
+  const char *p = chunk.begin, *tBegin, *tEnd;
+
+  while (p < chunk.end) {
+    // Skip the utterance ID
+    if (nextToken(p, chunk.end, tBegin, tEnd)) {
+      while (nextToken(p, chunk.end, tBegin, tEnd)) {
+	size_t id = parseTransId(tBegin, tEnd);
+	if (id >= chunk.used.size())
+	  chunk.used.resize(id + 1, false);
+	chunk.used[id] = true;
+      }
+    }
+    ++p;
+  }
+}
 
-    string docId = substring[0];
-    phoneAlignment += docId + " ";
+static void parseAlignments(AlignmentChunk& chunk, const vector<int>& phoneOf, const vector<int>& stateOf, bool dump) {
+  const char *p = chunk.begin, *tBegin, *tEnd;
+
+  while (p < chunk.end) {
+    if (!nextToken(p, chunk.end, tBegin, tEnd)) {
+      ++p;
+      continue;
+    }
+
+    chunk.utterances.push_back(AlignedUtterance(string(tBegin, tEnd), vector<Phone>()));
+    vector<Phone>& labels = chunk.utterances.back().second;
+
+    if (dump)
+      chunk.dump += chunk.utterances.back().first + " ";
 
     int prevPhoneId = -1;
     int prevStateId = -1;
     int nFrame = 0;
 
-    for (size_t j=1; j<substring.size(); ++j) {
-      int transID = str2int(substring[j]);
-      int phoneId = vHmm.GetPhoneForTransId(transID);
-      int stateId = vHmm.GetStateForTransId(transID);
-      //size_t c = vHmm.GetClassForTransId(transID);
+    while (nextToken(p, chunk.end, tBegin, tEnd)) {
+      size_t transID = parseTransId(tBegin, tEnd);
+      int phoneId = phoneOf[transID];
+      int stateId = stateOf[transID];
 
       // Find a new phone !! Either because different phoneId or a back-transition of state in a HMM
       if (phoneId != prevPhoneId || (phoneId == prevPhoneId && stateId < prevStateId) ) {
 
 	// TODO Push the previous phone instance into phoneLabels.
 	if (prevPhoneId != -1) 
-	  phoneLabels[docId].push_back(Phone(prevPhoneId, nFrame));
+	  labels.push_back(Phone(prevPhoneId, nFrame));
 
 	nFrame = 1;
       }
@@ -154,21 +461,107 @@ size_t load(string alignmentFile, string modelFile, map<string, vector<Phone> >&
 	++nFrame;
       }
 
-      phoneAlignment += int2str(phoneId) + " ";
+      if (dump)
+	chunk.dump += int2str(phoneId) + " ";
 
       prevPhoneId = phoneId;
       prevStateId = stateId;
     }
-    phoneAlignment += "\n";
-    
-    //const vector<Phone>& p = phoneLabels[docId];
 
-    documents.push_back(substring[0]);
-    lengths.push_back(substring.size() - 1);
+    if (dump)
+      chunk.dump += "\n";
+    ++p;
+  }
+}
+
+size_t load(string alignmentFile, string modelFile, map<string, vector<Phone> >& phoneLabels, bool dump) {
+
+  int fd = ::open(alignmentFile.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Cannot open alignment file %s\n", alignmentFile.c_str());
+    exit(-1);
+  }
+
+  size_t size = st.st_size;
+  const char* text = NULL;
+  if (size > 0) {
+    void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "Cannot mmap alignment file %s\n", alignmentFile.c_str());
+      exit(-1);
+    }
+    madvise(addr, size, MADV_SEQUENTIAL);
+    text = (const char*) addr;
+  }
+  ::close(fd);
+
+  ThreadPool pool;
+
+  // Chunk boundaries are moved forward to the beginning of the next line
+  size_t nChunks = std::max<size_t>(1, std::min<size_t>(pool.size() * 4, size / (1 << 20)));
+  vector<AlignmentChunk> chunks(nChunks);
+  const char* end = text + size;
+  range (i, nChunks) {
+    const char* b = (i == 0) ? text : chunks[i-1].end;
+    const char* e = (i == nChunks - 1) ? end : std::max(b, text + size / nChunks * (i + 1));
+    while (e < end && e > b && *(e-1) != '\n')
+      ++e;
+
+    chunks[i].begin = b;
+    chunks[i].end = e;
+  }
+
+  // Pass 1: which transition IDs are used
+  foreach (i, chunks)
+    pool.submit([&chunks, i] () { collectTransIds(chunks[i]); });
+  pool.wait();
+
+  vector<bool> used;
+  foreach (i, chunks) {
+    if (chunks[i].used.size() > used.size())
+      used.resize(chunks[i].used.size(), false);
+    foreach (id, chunks[i].used)
+      if (chunks[i].used[id])
+	used[id] = true;
   }
 
-  if (dump)
-    cout << phoneAlignment << endl;
+  VulcanHmm vHmm;
+  vHmm.LoadKaldiModel(modelFile);
+
+  vector<int> phoneOf(used.size(), -1), stateOf(used.size(), -1);
+  foreach (id, used) {
+    if (!used[id])
+      continue;
+    phoneOf[id] = vHmm.GetPhoneForTransId(id);
+    stateOf[id] = vHmm.GetStateForTransId(id);
+  }
+
+  // Pass 2: segment every utterance into phones
+  foreach (i, chunks)
+    pool.submit([&chunks, &phoneOf, &stateOf, dump, i] () { parseAlignments(chunks[i], phoneOf, stateOf, dump); });
+  pool.wait();
+
+  if (text)
+    munmap((void*) text, size);
+
+  foreach (i, chunks) {
+    const vector<AlignedUtterance>& utterances = chunks[i].utterances;
+    foreach (j, utterances) {
+      const vector<Phone>& labels = utterances[j].second;
+      if (labels.empty())
+	continue;
+
+      vector<Phone>& dst = phoneLabels[utterances[j].first];
+      dst.insert(dst.end(), labels.begin(), labels.end());
+    }
+  }
+
+  if (dump) {
+    foreach (i, chunks)
+      cout << chunks[i].dump;
+    cout << endl;
+  }
 
   size_t nInstance = 0;
   for (auto i=phoneLabels.cbegin(); i != phoneLabels.cend(); ++i)
@@ -1,4 +1,5 @@
 #include <cdtw.h>
+#include <model_io.h>
 using namespace DtwUtil;
 
 #ifdef DTW_SLOPE_CONSTRAINT
@@ -35,7 +36,7 @@ void Bhattacharyya::setDiagFromFile(const string& filename) {
   if (filename.empty())
     return;
 
-  ext::load<double>(_diag, filename);
+  loadTheta<double>(_diag, filename);
 }
 
 vector<double>& Bhattacharyya::getDiag() {
@@ -48,11 +49,23 @@ void Bhattacharyya::setDiag(const vector<double>& diag) {
 }
 
 void Bhattacharyya::updateNormalizer() {
-  size_t k = _diag.size();
+  _normalizer = calcNormalizer(_diag);
+}
+
+double Bhattacharyya::calcNormalizer(const vector<double>& diag) {
+  size_t k = diag.size();
   double product = 1;
-  foreach (i, _diag)
-    product *= _diag[i];
-  _normalizer = 0.5 * (log(product) - k * log(2*PI));
+  foreach (i, diag)
+    product *= diag[i];
+  return 0.5 * (log(product) - k * log(2*PI));
+}
+
+static __thread const double* boundDiag = NULL;
+static __thread double boundNormalizer = 0;
+
+void Bhattacharyya::bind(const vector<double>* diag) {
+  boundDiag = diag ? &(*diag)[0] : NULL;
+  boundNormalizer = diag ? calcNormalizer(*diag) : 0;
 }
 
 float Bhattacharyya::fn(const float* a, const float* b, const int size) {
@@ -63,14 +76,17 @@ float Bhattacharyya::fn(const float* a, const float* b, const int size) {
   ret = -log(ret);
   return ret;*/
 
+  const double* diag = boundDiag ? boundDiag : &Bhattacharyya::_diag[0];
+  double normalizer = boundDiag ? boundNormalizer : _normalizer;
+
   for (int i = 0; i < size; ++i)
-    ret += pow(a[i] - b[i], 2) * Bhattacharyya::_diag[i];
+    ret += pow(a[i] - b[i], 2) * diag[i];
 
   // FIXME After add _normalizer, the objective function increases
   // ( in the opposite direction of minimization of distance)
   // When the _normalizer is removed, the obj is descreased again.
   // Maybe there're something wrong with the calculation of _normalizer.
-  return sqrt(ret) - _normalizer;
+  return sqrt(ret) - normalizer;
 }
 
 vector<double> Bhattacharyya::operator() (const float* x, const float* y) const {
@@ -233,3 +249,122 @@ namespace DtwUtil {
 
   size_t CumulativeDtwRunner::wndSize_ = 3;
 };
+
+// ============================
+// ===== Arena Dtw Runner =====
+// ============================
+void ArenaDtwRunner::init(const float* q, int qL, const float* d, int dL, int dim) {
+  // Keep the shorter one as the query, as CumulativeDtwRunner::init does
+  if (dL < qL) {
+    std::swap(q, d);
+    std::swap(qL, dL);
+  }
+
+  _q = FrameSeq(q, dim);
+  _d = FrameSeq(d, dim);
+  _qL = qL;
+  _dL = dL;
+  _dim = dim;
+}
+
+void ArenaDtwRunner::DTW(bool scoreOnly) {
+  this->calcPdist();
+  this->calcAlpha();
+
+#ifndef NO_HHTT
+  _cScore = _alpha(_qL - 1, _dL - 1);
+#else
+  vector<float> lastRow(_dL);
+  for (int d = 0; d < _dL; ++d)
+    lastRow[d] = _alpha(_qL - 1, d);
+  _cScore = SMIN::eval(&lastRow[0], _dL);
+#endif
+
+  if (scoreOnly)
+    return;
+
+#ifdef DTW_SLOPE_CONSTRAINT
+  if (_cScore == float_inf)
+    return;
+#endif
+  this->calcBeta();
+}
+
+// Every distance is used by both alpha and beta, so compute them only once
+void ArenaDtwRunner::calcPdist() {
+  _pdist.resize(_qL, _dL);
+  for (int q = 0; q < _qL; ++q)
+    for (int d = 0; d < _dL; ++d)
+      _pdist(q, d) = _norm(_q[q], _d[d], _dim);
+}
+
+void ArenaDtwRunner::calcAlpha() {
+  _alpha.resize(_qL, _dL);
+  _alpha.fill(float_inf);
+
+  // q == 0, d == 0
+  _alpha(0, 0) = _pdist(0, 0);
+
+  // q == 0
+  for (int d = 1; d < _dL; ++d)
+#ifndef NO_HHTT
+    _alpha(0, d) = _alpha(0, d - 1) + _pdist(0, d);
+#else
+    _alpha(0, d) = _pdist(0, d);
+#endif
+
+  // d == 0
+  for (int q = 1; q < _qL; ++q)
+    _alpha(q, 0) = _alpha(q - 1, 0) + _pdist(q, 0);
+
+  // interior points
+  for (int q = 1; q < _qL; ++q) {
+    for (int d = 1; d < _dL; ++d) {
+#ifdef DTW_SLOPE_CONSTRAINT
+      if ( abs(q - d) > (int) CumulativeDtwRunner::getWndSize() )
+	continue;
+#endif
+      double s1 = _alpha(q  , d-1),
+	     s2 = _alpha(q-1, d  ),
+	     s3 = _alpha(q-1, d-1);
+
+      _alpha(q, d) = SMIN::eval(s1, s2, s3) + _pdist(q, d);
+    }
+  }
+}
+
+void ArenaDtwRunner::calcBeta() {
+  _beta.resize(_qL, _dL);
+  _beta.fill(float_inf);
+
+  int q = _qL - 1, d = _dL - 1;
+#ifndef NO_HHTT
+  _beta(q, d) = 0;
+  for (d = _dL - 2; d >= 0; --d)
+    _beta(q, d) = _beta(q, d + 1) + _pdist(q, d + 1);
+#else
+  for (d = 0; d < _dL; ++d)
+    _beta(q, d) = 0;
+#endif
+
+  d = _dL - 1;
+  for (q = _qL - 2; q >= 0; --q)
+    _beta(q, d) = _beta(q + 1, d) + _pdist(q + 1, d);
+
+  // interior points
+  for (int q = _qL - 2; q >= 0; --q) {
+    for (int d = _dL - 2; d >= 0; --d) {
+#ifndef NO_HHTT
+#ifdef DTW_SLOPE_CONSTRAINT
+      if ( abs(q - d) > (int) CumulativeDtwRunner::getWndSize() )
+	continue;
+#endif
+#endif
+      double s1 = _beta(q  , d+1) + _pdist(q  , d+1),
+	     s2 = _beta(q+1, d  ) + _pdist(q+1, d  ),
+	     s3 = _beta(q+1, d+1) + _pdist(q+1, d+1);
+
+      _beta(q, d) = SMIN::eval(s1, s2, s3);
+    }
+  }
+}
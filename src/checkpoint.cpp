@@ -0,0 +1,111 @@
+#include <checkpoint.h>
+
+// ==========================
+// ===== Training State =====
+// ==========================
+TrainingState::TrainingState():
+  epoch(0), batch(0), learning_rate(0), seed(0),
+  objective(0), aboutToStop(false), nValidation(0) {}
+
+bool TrainingState::save(string filename) const {
+  string tmp = filename + ".tmp";
+
+  FILE* fid = fopen(tmp.c_str(), "w");
+  if (!fid)
+    return false;
+
+  fprintf(fid, "epoch %lu\n", epoch);
+  fprintf(fid, "batch %lu\n", batch);
+  fprintf(fid, "learning_rate %.9e\n", learning_rate);
+  fprintf(fid, "seed %u\n", seed);
+  fprintf(fid, "objective %.9e\n", objective);
+  fprintf(fid, "aboutToStop %d\n", aboutToStop ? 1 : 0);
+  fprintf(fid, "nValidation %lu\n", nValidation);
+
+  if (fclose(fid) != 0)
+    return false;
+
+  return atomicRename(tmp, filename);
+}
+
+bool TrainingState::load(string filename) {
+  ifstream file(filename.c_str());
+  if (!file.is_open())
+    return false;
+
+  string key, value;
+  while (file >> key >> value) {
+    if (key == "epoch")		    epoch = str2int(value);
+    else if (key == "batch")	    batch = str2int(value);
+    else if (key == "learning_rate")  learning_rate = str2float(value);
+    else if (key == "seed")	    seed = strtoul(value.c_str(), NULL, 10);
+    else if (key == "objective")	    objective = str2double(value);
+    else if (key == "aboutToStop")    aboutToStop = (value == "1");
+    else if (key == "nValidation")    nValidation = str2int(value);
+  }
+
+  return true;
+}
+
+// ========================
+// ===== Checkpointer =====
+// ========================
+Checkpointer::Checkpointer():
+  _hasPending(false), _busy(false), _stop(false), _nWritten(0), _nDropped(0),
+  _thread(&Checkpointer::__run__, this) {}
+
+Checkpointer::~Checkpointer() {
+  this->flush();
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_one();
+  _thread.join();
+}
+
+void Checkpointer::submit(std::function<void ()> job) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_hasPending)
+      ++_nDropped;
+    _pending = job;
+    _hasPending = true;
+  }
+  _cond.notify_one();
+}
+
+void Checkpointer::flush() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (_hasPending || _busy)
+    _idle.wait(lock);
+}
+
+void Checkpointer::__run__() {
+  while (true) {
+    std::function<void ()> job;
+
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (!_hasPending && !_stop)
+	_cond.wait(lock);
+
+      if (!_hasPending && _stop)
+	return;
+
+      job.swap(_pending);
+      _hasPending = false;
+      _busy = true;
+    }
+
+    job();
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _busy = false;
+      ++_nWritten;
+    }
+    _idle.notify_all();
+  }
+}
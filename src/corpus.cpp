@@ -2,6 +2,11 @@
 #include <iostream>
 #include <array.h>
 #include <math_ext.h>
+#include <pbar.h>
+#include <perf.h>
+#include <phone_store.h>
+#include <libdtw/include/dtw_parm.h>
+using namespace DtwUtil;
 using namespace std;
 
 string SubCorpus::FEAT_DIRECTORY = "";
@@ -15,10 +20,25 @@ SubCorpus::SubCorpus(size_t p1, size_t p2, string phone1, string phone2): _p1(p1
 }
 
 vector<ppair> SubCorpus::getSamples(size_t n) {
-  if (n <= 0) return vector<ppair>();
+  vector<std::pair<size_t, size_t> > indices = this->getIndices(n);
 
   vector<ppair> samples;
-  samples.reserve(n);
+  samples.reserve(indices.size());
+
+  foreach (k, indices) {
+    string f1 = FEAT_DIRECTORY + _phone1 + "/" + _list1[indices[k].first];
+    string f2 = FEAT_DIRECTORY + _phone2 + "/" + _list2[indices[k].second];
+    samples.push_back(ppair(f1, f2));
+  }
+
+  return samples;
+}
+
+vector<std::pair<size_t, size_t> > SubCorpus::getIndices(size_t n) {
+  if (n <= 0) return vector<std::pair<size_t, size_t> >();
+
+  vector<std::pair<size_t, size_t> > indices;
+  indices.reserve(n);
 
   size_t c = 0;
 
@@ -28,20 +48,17 @@ vector<ppair> SubCorpus::getSamples(size_t n) {
   for(size_t i=iStart; i<_list1.size(); ++i) {
     for(size_t j=jStart; j<_list2.size(); ++j) {
       if (++c > n) break;
-
-      string f1 = FEAT_DIRECTORY + _phone1 + "/" + _list1[i];
-      string f2 = FEAT_DIRECTORY + _phone2 + "/" + _list2[j];
-      samples.push_back(ppair(f1, f2));
+      indices.push_back(std::make_pair(i, j));
     }
     if (c++ > n) break;
   }
 
-  _counter += samples.size();
+  _counter += indices.size();
 
   if (_counter >= _size)
     _counter -= _size;
 
-  return samples;
+  return indices;
 }
 
 bool SubCorpus::isIntraPhone() const { return (_p1 == _p2); }
@@ -65,7 +82,7 @@ void SubCorpus::setFeatureDirectory(string mfcc_directory) {
 
 
 // ==============================================
-Corpus::Corpus(int phone_set, string filename, string feat_dir, string list_dir) {
+Corpus::Corpus(int phone_set, string filename, string feat_dir, string list_dir): _feat_dir(feat_dir) {
 
   SubCorpus::setListDirectory(list_dir);
   SubCorpus::setFeatureDirectory(feat_dir + "/");
@@ -111,15 +128,78 @@ Array<string> Corpus::getPhoneList(string filename) {
   return list;
 }
 
+// Copy the instances listed in the list files out of the mmap'ed store. The
+// list entry "<k>.mfc" of a phone is its k-th instance in the store.
+void Corpus::loadFeaturesFromStore() {
+  PhoneStore store;
+  if (!store.open(_feat_dir)) {
+    fprintf(stderr, "Cannot open phone store %s\n", _feat_dir.c_str());
+    exit(-1);
+  }
+
+  size_t nInstances = 0, nFrames = 0;
+  foreach (i, _sub_corpus) {
+    const SubCorpus& sub = _sub_corpus[i];
+    if (!sub.isIntraPhone())
+      continue;
+
+    // Every instance is checked here, before store.length() reads past the
+    // index of the store.
+    const Array<string>& list = sub.getList1();
+    nInstances += list.size();
+    foreach (j, list) {
+      size_t k = str2int(list[j]);
+      if (sub._p1 >= store.nPhones() || k >= store.nInstances(sub._p1)) {
+	fprintf(stderr, "Phone %s has no instance %s in %s\n", sub._phone1.c_str(), list[j].c_str(), _feat_dir.c_str());
+	exit(-1);
+      }
+      nFrames += store.length(sub._p1, k);
+    }
+  }
+
+  _base.assign(_phones.size(), 0);
+  _arena.setDim(store.getDim());
+  _arena.reserve(nInstances, nFrames);
+  vector<float> frames;
+
+  foreach (i, _sub_corpus) {
+    const SubCorpus& sub = _sub_corpus[i];
+    if (!sub.isIntraPhone())
+      continue;
+
+    _base[sub._p1] = _arena.size();
+
+    const Array<string>& list = sub.getList1();
+    foreach (j, list) {
+      size_t k = str2int(list[j]);
+      size_t T = store.length(sub._p1, k);
+      if (!_reducer.isEnabled()) {
+	_arena.push_back(store.data(sub._p1, k), T);
+	continue;
+      }
+
+      frames.resize(T * store.getDim());
+      size_t n = _reducer.reduce(store.data(sub._p1, k), T, store.getDim(), frames.data());
+      _reducer.count(T, n);
+      _arena.push_back(frames.data(), n);
+    }
+  }
+}
+
+vector<size_t> Corpus::sampleSubCorpora(size_t n) {
+  vector<size_t> sampledClass = ext::sampleDataFrom(_prior, n);
+  sampledClass = ext::hist(sampledClass);
+  assert(ext::sum(sampledClass) == n);
+  return sampledClass;
+}
+
 vector<tsample> Corpus::getSamples(size_t n) {
   if (n <= 0) return vector<tsample>();
 
   vector<tsample> samples;
   samples.reserve(n);
 
-  vector<size_t> sampledClass = ext::sampleDataFrom(_prior, n);
-  sampledClass = ext::hist(sampledClass);
-  assert(ext::sum(sampledClass) == n);
+  vector<size_t> sampledClass = this->sampleSubCorpora(n);
 
   foreach (i, sampledClass) {
     int nSamples = sampledClass[i];
@@ -142,6 +222,93 @@ vector<tsample> Corpus::getSamples(size_t n) {
   return samples;
 }
 
+vector<isample> Corpus::getSampleIDs(size_t n) {
+  if (n <= 0) return vector<isample>();
+
+  assert(this->isLoaded());
+
+  vector<isample> samples;
+  samples.reserve(n);
+
+  vector<size_t> sampledClass = this->sampleSubCorpora(n);
+
+  foreach (i, sampledClass) {
+    const SubCorpus& sub = _sub_corpus[i];
+    vector<std::pair<size_t, size_t> > indices = _sub_corpus[i].getIndices(sampledClass[i]);
+
+    bool positive = sub.isIntraPhone();
+    foreach (j, indices)
+      samples.push_back(isample(_base[sub._p1] + indices[j].first, _base[sub._p2] + indices[j].second, positive));
+  }
+
+  return samples;
+}
+
+void Corpus::loadFeatures() {
+  if (this->isLoaded())
+    return;
+
+  perf::Timer timer;
+  timer.start();
+
+  if (PhoneStore::isPhoneStore(_feat_dir))
+    this->loadFeaturesFromStore();
+  else
+    this->loadFeaturesFromFiles();
+
+  timer.stop();
+
+  printf("Loaded "BLUE"%lu"COLOREND" phone instances (%lu frames, %.1f MB) in "GREEN"%.2f"COLOREND" secs, "
+      "resident memory = %.1f MB\n", _arena.size(), _arena.nFrames(), _arena.bytes() / 1048576.,
+      timer.getTime() / 1000, getResidentMemory() / 1048576.);
+  _reducer.printStats();
+}
+
+void Corpus::loadFeaturesFromFiles() {
+  // Every phone has exactly one intra-phone sub-corpus, whose _list1 is the
+  // list of all its instances.
+  size_t nInstances = 0;
+  foreach (i, _sub_corpus)
+    if (_sub_corpus[i].isIntraPhone())
+      nInstances += _sub_corpus[i].getList1().size();
+
+  _base.assign(_phones.size(), 0);
+  vector<float> frames;
+
+  ProgressBar pbar("Loading phone instances into memory");
+  size_t counter = 0;
+
+  foreach (i, _sub_corpus) {
+    const SubCorpus& sub = _sub_corpus[i];
+    if (!sub.isIntraPhone())
+      continue;
+
+    _base[sub._p1] = _arena.size();
+
+    const Array<string>& list = sub.getList1();
+    foreach (j, list) {
+      pbar.refresh(counter++, nInstances);
+
+      DtwParm parm(SubCorpus::FEAT_DIRECTORY + sub._phone1 + "/" + list[j]);
+      const DenseFeature& feat = parm.Feat();
+      size_t T = feat.LT(), dim = feat.LF();
+
+      if (_arena.size() == 0) {
+	_arena.setDim(dim);
+	_arena.reserve(nInstances, nInstances * T);
+      }
+
+      frames.resize(T * dim);
+      range (t, T)
+	std::copy(feat[t], feat[t] + dim, frames.begin() + t * dim);
+
+      size_t n = _reducer.reduce(frames.data(), T, dim, frames.data());
+      _reducer.count(T, n);
+      _arena.push_back(frames.data(), n);
+    }
+  }
+}
+
 bool Corpus::isBatchSizeApprop(size_t batchSize) {
   vector<tsample> samples = this->getSamples(batchSize);
 
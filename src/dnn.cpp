@@ -32,12 +32,15 @@ DNN& DNN::operator = (DNN rhs) {
 }
 
 void DNN::load(string prefix) {
-  std::vector<string> n_ppWeights = bash::ls(prefix + "*");
-  _weights.resize(n_ppWeights.size());
+  std::vector<mat> weights;
+  for (size_t i=0; exists(prefix + int2str(i)); ++i)
+    weights.push_back(mat(prefix + int2str(i)));
 
-  foreach (i, _weights)
-    _weights[i] = mat(prefix + int2str(i));
+  this->setWeights(weights);
+}
 
+void DNN::setWeights(const std::vector<mat>& weights) {
+  _weights = weights;
   _dims.resize(_weights.size() + 1);
   
   _dims[0] = _weights[0].getRows() - 1;
@@ -81,6 +84,24 @@ void DNN::randInit() {
 // ===== Feed Forward =====
 // ========================
 
+void DNN::initHiddenOutput(std::vector<vec>& O) const {
+  O.resize(_dims.size());
+
+  // Input layer and hidden layers: [ output, 1 ]
+  for (size_t i=0; i<O.size() - 1; ++i)
+    O[i].resize(_dims[i] + 1);
+
+  // Output layer: no bias
+  O.back().resize(_dims.back());
+}
+
+void DNN::feedForward(const float* x, size_t length, std::vector<vec>* hidden_output) const {
+  assert(hidden_output != NULL);
+  assert(length == _dims[0]);
+
+  ::feedForward(_weights, x, *hidden_output);
+}
+
 /*void DNN::feedForward(const mat& x, std::vector<mat>* hidden_output) {
   assert(hidden_output != NULL);
 
@@ -1,4 +1,35 @@
 #include <fast_dtw.h>
+#include <thread_pool.h>
+#include <pbar.h>
+
+#ifndef __CUDACC__
+// ============================
+// ===== Distance Measure =====
+// ============================
+distance_fn* initDistanceMeasure(string dist_type, size_t dim, string theta_fn, string model_fn) {
+  distance_fn* dist;
+
+  if (dist_type == "ma") {
+    dist = new mahalanobis_fn(dim);
+    dynamic_cast<mahalanobis_fn*>(dist)->setDiag(theta_fn);
+  }
+  else if (dist_type == "lip") {
+    dist = new log_inner_product_fn(dim);
+    dynamic_cast<mahalanobis_fn*>(dist)->setDiag(theta_fn);
+  }
+  else if (dist_type == "eu")
+    dist = new euclidean_fn;
+  else if (dist_type == "dnn")
+    dist = new mapped_dnn_fn(model_fn, dim);
+  else {
+    fprintf(stderr, "--type unspecified or unknown\n");
+    exit(-1);
+  }
+
+  return dist;
+}
+#endif
+
 #define __pow__(x) ((x)*(x))
 
 // =======================================
@@ -19,6 +50,19 @@ euclidean(const float* x, const float* y, size_t dim) {
   return sqrt(d);
 }
 
+float pairDTW(const float* data, const unsigned int* offset, int dim, distance_fn& fn, float eta, int i, int j, vector<float>& pdist, vector<float>& alpha) {
+  size_t length1 = (offset[i + 1] - offset[i]) / dim;
+  size_t length2 = (offset[j + 1] - offset[j]) / dim;
+
+  if (pdist.size() < length1 * length2) {
+    pdist.resize(length1 * length2);
+    alpha.resize(length1 * length2);
+  }
+
+  pair_distance(data + offset[i], data + offset[j], length1, length2, dim, eta, pdist.data(), fn);
+  return fast_dtw(pdist.data(), length1, length2, dim, eta, alpha.data());
+}
+
 float* computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta) {
 
   size_t MAX_LENGTH = 0;
@@ -55,6 +99,101 @@ float* computePairwiseDTW(const float* data, const unsigned int* offset, int N,
   return scores;
 }
 
+void computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta, float* scores, const vector<bool>& needed, size_t nThreads, ScoreCache* cache, uint64_t context) {
+
+  vector<uint64_t> hash;
+  if (cache) {
+    hash.resize(N);
+    for (int i=0; i<N; ++i)
+      hash[i] = ScoreCache::hashFeature(data + offset[i], offset[i + 1] - offset[i]);
+  }
+
+  ThreadPool pool(nThreads);
+  for (int i=0; i<N; ++i) {
+    pool.submit([&, i] () {
+      computePairwiseDTWRow(data, offset, N, dim, fn, eta, scores, i, &needed, cache, hash.data(), context);
+    });
+  }
+  pool.wait();
+}
+
+void computePairwiseDTWRow(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta, float* scores, int i, const vector<bool>* needed, ScoreCache* cache, const uint64_t* hash, uint64_t context) {
+  vector<float> alpha, pdist;
+
+  scores[i * N + i] = 0;
+  for (int j=0; j<i; ++j) {
+    if (needed && !(*needed)[i] && !(*needed)[j])
+      continue;
+
+    uint64_t key = 0;
+    if (cache) {
+      key = ScoreCache::makeKey(hash[i], hash[j], context);
+      float s;
+      if (cache->get(key, s)) {
+	scores[i * N + j] = scores[j * N + i] = s;
+	continue;
+      }
+    }
+
+    float s = pairDTW(data, offset, dim, fn, eta, i, j, pdist, alpha);
+    scores[i * N + j] = scores[j * N + i] = s;
+
+    if (cache)
+      cache->put(key, s);
+  }
+}
+
+size_t computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, float eta, SimMatrix& scores, TileBitmap& tiles, size_t nThreads) {
+
+  size_t nTiles = tiles.nTiles();
+  size_t nDone = tiles.nDone();
+  size_t nComputed = 0;
+
+  std::mutex mutex;
+  ProgressBar pbar("Computing tiles of the pairwise DTW matrix");
+
+  ThreadPool pool(nThreads);
+  range (t, nTiles) {
+    if (tiles.isDone(t))
+      continue;
+
+    pool.submit([&, t] () {
+      size_t rowBegin, rowEnd, colBegin, colEnd;
+      tiles.getTile(t, rowBegin, rowEnd, colBegin, colEnd);
+
+      vector<float> alpha, pdist;
+
+      for (size_t i=rowBegin; i<rowEnd; ++i) {
+	for (size_t j=colBegin; j<colEnd && j<i; ++j) {
+	  size_t length1 = (offset[i + 1] - offset[i]) / dim;
+	  size_t length2 = (offset[j + 1] - offset[j]) / dim;
+
+	  if (pdist.size() < length1 * length2) {
+	    pdist.resize(length1 * length2);
+	    alpha.resize(length1 * length2);
+	  }
+
+	  pair_distance(data + offset[i], data + offset[j], length1, length2, dim, eta, pdist.data(), fn);
+	  scores.set(i, j, fast_dtw(pdist.data(), length1, length2, dim, eta, alpha.data()));
+	}
+      }
+
+      if (!scores.sync(rowBegin, rowEnd)) {
+	fprintf(stderr, "Failed to write scores of tile %lu\n", t);
+	exit(-1);
+      }
+      tiles.markDone(t);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      ++nComputed;
+      pbar.refresh(nDone + nComputed, nTiles);
+    });
+  }
+  pool.wait();
+
+  return nComputed;
+}
+
 inline float addlog(float x, float y) {
   const float MAX_DIFF = -708;
 
@@ -159,6 +298,318 @@ float fast_dtw(float* pdist, size_t rows, size_t cols, size_t dim, float eta, fl
   return distance;
 }
 
+// ================================
+// ===== Several etas at once =====
+// ================================
+void fast_dtw(const float* pdist, size_t rows, size_t cols, const vector<float>& etas, float* distances, vector<float>& buffer) {
+  size_t K = etas.size();
+  if (buffer.size() < 2 * cols * K)
+    buffer.resize(2 * cols * K);
+
+  float* prev = buffer.data();
+  float* cur = prev + cols * K;
+
+  // x == 0
+  range (k, K)
+    cur[k] = pdist[0];
+  for (size_t y = 1; y < cols; ++y) {
+    range (k, K)
+      cur[y * K + k] = cur[(y-1) * K + k] + pdist[y];
+  }
+
+  for (size_t x = 1; x < rows; ++x) {
+    std::swap(prev, cur);
+    const float* p = pdist + x * cols;
+
+    range (k, K)
+      cur[k] = prev[k] + p[0];
+
+    for (size_t y = 1; y < cols; ++y) {
+      float* c = cur + y * K;
+      const float* up = prev + y * K;
+      const float* diag = prev + (y-1) * K;
+      const float* left = c - K;
+      range (k, K)
+	c[k] = (float) smin(up[k], left[k], diag[k], etas[k]) + p[y];
+    }
+  }
+
+  range (k, K)
+    distances[k] = cur[(cols - 1) * K + k];
+}
+
+void pairDTW(const float* data, const unsigned int* offset, int dim, distance_fn& fn, const vector<float>& etas, int i, int j, vector<float>& pdist, vector<float>& buffer, float* distances) {
+  size_t length1 = (offset[i + 1] - offset[i]) / dim;
+  size_t length2 = (offset[j + 1] - offset[j]) / dim;
+
+  if (pdist.size() < length1 * length2)
+    pdist.resize(length1 * length2);
+
+  pair_distance(data + offset[i], data + offset[j], length1, length2, dim, 0, pdist.data(), fn);
+  fast_dtw(pdist.data(), length1, length2, etas, distances, buffer);
+}
+
+void computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& fn, const vector<float>& etas, const vector<SimMatrix*>& scores, size_t nThreads) {
+
+  size_t K = etas.size();
+
+  ThreadPool pool(nThreads);
+  for (int i=0; i<N; ++i) {
+    pool.submit([&, i] () {
+      vector<float> pdist, buffer, distances(K);
+
+      range (k, K)
+	scores[k]->set(i, i, 0);
+
+      for (int j=0; j<i; ++j) {
+	pairDTW(data, offset, dim, fn, etas, i, j, pdist, buffer, distances.data());
+	range (k, K)
+	  scores[k]->set(i, j, distances[k]);
+      }
+    });
+  }
+  pool.wait();
+}
+
+// ===========================================
+// ===== Several diagonal models at once =====
+// ===========================================
+void pair_distance(const float* f1, const float* f2, size_t rows, size_t cols, size_t dim, const vector<vector<float> >& thetas, bool innerProduct, const vector<float*>& pdist, vector<double>& tile) {
+  size_t K = thetas.size();
+  if (!innerProduct && tile.size() < cols * dim)
+    tile.resize(cols * dim);
+
+  // theta[d * K + k]: the K models side by side, one lane each
+  vector<float> theta(dim * K);
+  range (k, K)
+    range (d, dim)
+      theta[d * K + k] = thetas[k][d];
+
+  vector<float> acc(K);
+
+  // Same arithmetic as mahalanobis_fn and log_inner_product_fn, term by term
+  // and in the same order in every lane: the squares are doubles, the
+  // products floats.
+  range (x, rows) {
+    const float* a = f1 + x * dim;
+
+    // A product is as cheap to redo as to look up; squares go through the tile
+    if (innerProduct) {
+      range (y, cols) {
+	const float* b = f2 + y * dim;
+	std::fill(acc.begin(), acc.end(), 0);
+
+	range (d, dim) {
+	  float td = a[d] * b[d];
+	  const float* w = &theta[d * K];
+	  range (k, K)
+	    acc[k] += td * w[k];
+	}
+
+	range (k, K)
+	  pdist[k][x * cols + y] = -log(acc[k]);
+      }
+      continue;
+    }
+
+    range (y, cols) {
+      const float* b = f2 + y * dim;
+      double* t = &tile[y * dim];
+      range (d, dim)
+	t[d] = pow(a[d] - b[d], 2.0);
+    }
+
+    range (y, cols) {
+      const double* t = &tile[y * dim];
+      std::fill(acc.begin(), acc.end(), 0);
+
+      range (d, dim) {
+	double td = t[d];
+	const float* w = &theta[d * K];
+	range (k, K)
+	  acc[k] += td * w[k];
+      }
+
+      range (k, K)
+	pdist[k][x * cols + y] = sqrt(acc[k]);
+    }
+  }
+}
+
+void computePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, const vector<vector<float> >& thetas, bool innerProduct, float eta, const vector<SimMatrix*>& scores, size_t nThreads) {
+
+  size_t K = thetas.size();
+
+  ThreadPool pool(nThreads);
+  for (int i=0; i<N; ++i) {
+    pool.submit([&, i] () {
+      vector<vector<float> > pdist(K);
+      vector<float*> ptr(K);
+      vector<float> alpha;
+      vector<double> tile;
+
+      range (k, K)
+	scores[k]->set(i, i, 0);
+
+      for (int j=0; j<i; ++j) {
+	size_t length1 = (offset[i + 1] - offset[i]) / dim;
+	size_t length2 = (offset[j + 1] - offset[j]) / dim;
+
+	if (alpha.size() < length1 * length2) {
+	  alpha.resize(length1 * length2);
+	  range (k, K)
+	    pdist[k].resize(length1 * length2);
+	}
+
+	range (k, K)
+	  ptr[k] = pdist[k].data();
+
+	pair_distance(data + offset[i], data + offset[j], length1, length2, dim, thetas, innerProduct, ptr, tile);
+
+	range (k, K)
+	  scores[k]->set(i, j, fast_dtw(ptr[k], length1, length2, dim, eta, alpha.data()));
+      }
+    });
+  }
+  pool.wait();
+}
+
+// ===========================
+// ===== Top-k retrieval =====
+// ===========================
+float bounded_dtw(const float* f1, const float* f2, size_t rows, size_t cols, size_t dim, float eta, distance_fn& fn, float threshold, vector<float>& buffer, size_t& nRows) {
+
+  float lowerBound = fn.lowerBound();
+  bool lazy = (lowerBound > -FLT_MAX);
+
+  // [ previous alpha row | current alpha row | pdist ], pdist being one row
+  // when computed lazily and the whole matrix otherwise
+  size_t size = 2 * cols + (lazy ? cols : rows * cols);
+  if (buffer.size() < size)
+    buffer.resize(size);
+
+  float* prev = buffer.data();
+  float* cur = prev + cols;
+  float* pdist = cur + cols;
+
+  if (!lazy) {
+    pair_distance(f1, f2, rows, cols, dim, eta, pdist, fn);
+    lowerBound = *std::min_element(pdist, pdist + rows * cols);
+  }
+
+  float discount = std::max(0.0, log(3.0) / fabs(eta) - lowerBound);
+
+  for (size_t x = 0; x < rows; ++x) {
+    float* p;
+    if (lazy) {
+      p = pdist;
+      for (size_t y = 0; y < cols; ++y)
+	p[y] = fn(f1 + x * dim, f2 + y * dim, dim);
+    }
+    else
+      p = pdist + x * cols;
+
+    // Same recursion (and order of operations) as fast_dtw()
+    if (x == 0) {
+      cur[0] = p[0];
+      for (size_t y = 1; y < cols; ++y)
+	cur[y] = cur[y-1] + p[y];
+    }
+    else {
+      cur[0] = prev[0] + p[0];
+      for (size_t y = 1; y < cols; ++y)
+	cur[y] = (float) smin(prev[y], cur[y-1], prev[y-1], eta) + p[y];
+    }
+
+    nRows = x + 1;
+
+    float bound = FLT_MAX;
+    for (size_t y = 0; y < cols; ++y)
+      bound = std::min(bound, cur[y] - discount * (rows - 1 - x + cols - 1 - y));
+
+    if (bound > threshold)
+      return FLT_MAX;
+
+    std::swap(prev, cur);
+  }
+
+  return prev[cols - 1];
+}
+
+vector<float> utteranceMeans(const float* data, const unsigned int* offset, int N, int dim) {
+  vector<float> means((size_t) N * dim, 0);
+
+  for (int i=0; i<N; ++i) {
+    size_t length = (offset[i + 1] - offset[i]) / dim;
+    float* mean = &means[(size_t) i * dim];
+
+    for (size_t t=0; t<length; ++t) {
+      for (int d=0; d<dim; ++d)
+	mean[d] += data[offset[i] + t * dim + d];
+    }
+
+    for (int d=0; d<dim; ++d)
+      mean[d] /= std::max(length, (size_t) 1);
+  }
+
+  return means;
+}
+
+vector<pair<float, int> > topkDTW(const float* data, const unsigned int* offset, int dim, distance_fn& fn, float eta, int q, const vector<int>& candidates, size_t k, const float* means, TopkStats* stats) {
+
+  if (k == 0)
+    return vector<pair<float, int> >();
+
+  size_t length1 = (offset[q + 1] - offset[q]) / dim;
+
+  vector<pair<float, int> > order(candidates.size());
+  foreach (i, candidates) {
+    int c = candidates[i];
+    size_t length2 = (offset[c + 1] - offset[c]) / dim;
+    float estimate = means ? fn(means + (size_t) q * dim, means + (size_t) c * dim, dim) * std::max(length1, length2) : 0;
+    order[i] = std::make_pair(estimate, c);
+  }
+
+  if (means)
+    std::stable_sort(order.begin(), order.end());
+
+  // Max-heap of the k best so far, its top being the threshold
+  std::priority_queue<pair<float, int> > heap;
+  vector<float> buffer;
+
+  foreach (i, order) {
+    int c = order[i].second;
+    size_t length2 = (offset[c + 1] - offset[c]) / dim;
+    float threshold = (heap.size() < k) ? FLT_MAX : heap.top().first;
+
+    size_t nRows = 0;
+    float d = bounded_dtw(data + offset[q], data + offset[c], length1, length2, dim, eta, fn, threshold, buffer, nRows);
+
+    if (stats) {
+      ++stats->nAligned;
+      stats->nAbandoned += (d == FLT_MAX);
+      stats->nRows += length1;
+      stats->nRowsComputed += nRows;
+    }
+
+    if (d == FLT_MAX || (heap.size() >= k && d >= heap.top().first))
+      continue;
+
+    heap.push(std::make_pair(d, c));
+    if (heap.size() > k)
+      heap.pop();
+  }
+
+  vector<pair<float, int> > nearest;
+  while (!heap.empty()) {
+    nearest.push_back(heap.top());
+    heap.pop();
+  }
+  std::reverse(nearest.begin(), nearest.end());
+
+  return nearest;
+}
+
 // =======================================
 // ===== Dynamic Time Warping in GPU =====
 // =======================================
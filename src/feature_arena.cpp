@@ -0,0 +1,30 @@
+#include <feature_arena.h>
+
+FeatureArena::FeatureArena(size_t dim): _dim(dim), _offset(1, 0) {}
+
+size_t FeatureArena::push_back(const float* data, size_t nFrames) {
+  _data.insert(_data.end(), data, data + nFrames * _dim);
+  _offset.push_back(_offset.back() + nFrames);
+  return this->size() - 1;
+}
+
+float* FeatureArena::append(size_t nFrames) {
+  size_t begin = _data.size();
+  _data.resize(begin + nFrames * _dim);
+  _offset.push_back(_offset.back() + nFrames);
+  return _data.data() + begin;
+}
+
+void FeatureArena::reserve(size_t nSequences, size_t nFrames) {
+  _offset.reserve(nSequences + 1);
+  _data.reserve(nFrames * _dim);
+}
+
+void FeatureArena::clear() {
+  _data.clear();
+  _offset.assign(1, 0);
+}
+
+size_t FeatureArena::bytes() const {
+  return _data.capacity() * sizeof(float) + _offset.capacity() * sizeof(uint64_t);
+}
@@ -0,0 +1,125 @@
+#include <frame_reduction.h>
+#include <color.h>
+#include <cmath>
+#include <cstdlib>
+
+FrameReducer::FrameReducer(string spec):
+  _spec(spec), _method(NONE), _factor(1), _threshold(0), _nIn(0), _nOut(0) {
+
+  if (spec.empty() || spec == "none")
+    return;
+
+  size_t colon = spec.find(':');
+  string method = spec.substr(0, colon);
+  string value = (colon == string::npos) ? "" : spec.substr(colon + 1);
+
+  if (method == "skip" || method == "average") {
+    _method = (method == "skip") ? SKIP : AVERAGE;
+    _factor = atoi(value.c_str());
+    if (_factor < 1) {
+      fprintf(stderr, "[Error] Frame reduction \"%s\" needs a factor of at least 1\n", spec.c_str());
+      exit(-1);
+    }
+  }
+  else if (method == "merge") {
+    _method = MERGE;
+    _threshold = atof(value.c_str());
+    if (value.empty() || _threshold < 0) {
+      fprintf(stderr, "[Error] Frame reduction \"%s\" needs a non-negative threshold\n", spec.c_str());
+      exit(-1);
+    }
+  }
+  else {
+    fprintf(stderr, "[Error] Unknown frame reduction \"%s\" (\"skip:N\", \"average:N\" or \"merge:T\")\n", spec.c_str());
+    exit(-1);
+  }
+}
+
+// Every frame written is a function of frames at or after its own position
+// in the input, all read before it is written, so in == out is safe.
+size_t FrameReducer::reduce(const float* in, size_t length, size_t dim, float* out) const {
+  if (_method == NONE || length == 0) {
+    if (out != in)
+      std::copy(in, in + length * dim, out);
+    return length;
+  }
+
+  size_t n = 0;
+  vector<double> sum(dim);
+
+  if (_method == SKIP) {
+    for (size_t t=0; t<length; t+=_factor, ++n)
+      std::copy(in + t * dim, in + (t + 1) * dim, out + n * dim);
+    return n;
+  }
+
+  if (_method == AVERAGE) {
+    for (size_t t=0; t<length; t+=_factor, ++n) {
+      size_t end = std::min(t + _factor, length);
+      std::fill(sum.begin(), sum.end(), 0);
+      for (size_t s=t; s<end; ++s) {
+	range (d, dim)
+	  sum[d] += in[s * dim + d];
+      }
+
+      range (d, dim)
+	out[n * dim + d] = sum[d] / (end - t);
+    }
+    return n;
+  }
+
+  // MERGE
+  size_t begin = 0;
+  while (begin < length) {
+    std::fill(sum.begin(), sum.end(), 0);
+    range (d, dim)
+      sum[d] = in[begin * dim + d];
+
+    size_t end = begin + 1;
+    while (end < length) {
+      double dist = 0;
+      range (d, dim) {
+	double x = in[end * dim + d] - sum[d] / (end - begin);
+	dist += x * x;
+      }
+
+      if (sqrt(dist) > _threshold)
+	break;
+
+      range (d, dim)
+	sum[d] += in[end * dim + d];
+      ++end;
+    }
+
+    range (d, dim)
+      out[n * dim + d] = sum[d] / (end - begin);
+    ++n;
+    begin = end;
+  }
+
+  return n;
+}
+
+void FrameReducer::reduce(float* data, unsigned int* offset, int N, int dim) {
+  if (_method == NONE)
+    return;
+
+  unsigned int begin = offset[0];
+  for (int i=0; i<N; ++i) {
+    size_t length = (offset[i + 1] - begin) / dim;
+    size_t n = this->reduce(data + begin, length, dim, data + offset[i]);
+    this->count(length, n);
+
+    begin = offset[i + 1];
+    offset[i + 1] = offset[i] + n * dim;
+  }
+}
+
+void FrameReducer::printStats() const {
+  if (_method == NONE)
+    return;
+
+  double r = this->ratio();
+  printf("Frame reduction "BLUE"%s"COLOREND": %lu -> %lu frames ("GREEN"%.2fx"COLOREND"), "
+      "about %.1fx fewer DTW cells\n", _spec.c_str(), _nIn, _nOut, r, r * r);
+}
@@ -1,21 +1,314 @@
 #include <ipc.h>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
+#define SHM_RING_MAGIC "TDTWIPC"
+#define SHM_ATTACH_TIMEOUT_MS 5000
+
+// ===== futex =====
+// Not FUTEX_PRIVATE: the words live in memory shared by two processes
+static void futexWait(std::atomic<uint32_t>* addr, uint32_t expected) {
+  syscall(SYS_futex, (uint32_t*) addr, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static void futexWake(std::atomic<uint32_t>* addr) {
+  syscall(SYS_futex, (uint32_t*) addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// POSIX shared memory names are "/something" without any other '/', so a
+// FIFO path such as /tmp/fifo1 becomes /tmp-fifo1
+static string shmName(string name) {
+  foreach (i, name) {
+    if (name[i] == '/')
+      name[i] = '-';
+  }
+  name[0] = '/';
+  return name;
+}
+
+// ==============================
+// ===== Shared-Memory Ring =====
+// ==============================
+ShmRing::ShmRing(): _header(NULL), _data(NULL), _mask(0), _size(0), _creator(false) {
+}
+
+ShmRing::~ShmRing() {
+  this->close();
+}
+
+bool ShmRing::open(string name, size_t capacity) {
+  this->close();
+
+  size_t n = 1;
+  while (n < capacity)
+    n <<= 1;
+
+  string shm = shmName(name);
+
+  // Whoever creates the object lays out the header, then writes the magic last
+  bool creator = true;
+  int fd = shm_open(shm.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    creator = false;
+    fd = shm_open(shm.c_str(), O_RDWR, 0600);
+  }
+
+  if (fd < 0) {
+    perror(("[Error] Cannot open shared memory " + shm).c_str());
+    return false;
+  }
+
+  if (creator && ftruncate(fd, sizeof(ShmRingHeader) + n) != 0) {
+    perror(("[Error] Cannot allocate shared memory " + shm).c_str());
+    ::close(fd);
+    return false;
+  }
+
+  // Wait for the creator to size it and fill in the header, but not forever:
+  // a creator that died in between never will.
+  struct stat st;
+  int waited = 0;
+  while (!creator && (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ShmRingHeader))) {
+    if (waited++ >= SHM_ATTACH_TIMEOUT_MS) {
+      fprintf(stderr, "[Error] Shared memory %s was never sized by its creator\n", shm.c_str());
+      ::close(fd);
+      return false;
+    }
+    usleep(1000);
+  }
+
+  size_t size = creator ? sizeof(ShmRingHeader) + n : st.st_size;
+  void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if (addr == MAP_FAILED) {
+    perror(("[Error] Cannot map shared memory " + shm).c_str());
+    return false;
+  }
+
+  ShmRingHeader* header = (ShmRingHeader*) addr;
+  if (creator) {
+    header->capacity = n;
+    header->head = 0;
+    header->tail = 0;
+    header->dataSeq = 0;
+    header->spaceSeq = 0;
+    header->readerWaiting = 0;
+    header->writerWaiting = 0;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    memcpy(header->magic, SHM_RING_MAGIC, sizeof(header->magic));
+  }
+  else {
+    while (memcmp((const char*) header->magic, SHM_RING_MAGIC, sizeof(header->magic)) != 0) {
+      if (waited++ >= SHM_ATTACH_TIMEOUT_MS) {
+	fprintf(stderr, "[Error] Shared memory %s was never initialized by its creator\n", shm.c_str());
+	munmap(addr, size);
+	return false;
+      }
+      usleep(1000);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (sizeof(ShmRingHeader) + header->capacity != size) {
+      fprintf(stderr, "[Error] Shared memory %s has an unexpected size\n", shm.c_str());
+      munmap(addr, size);
+      return false;
+    }
+  }
+
+  _header = header;
+  _data = (char*) addr + sizeof(ShmRingHeader);
+  _mask = header->capacity - 1;
+  _size = size;
+  _creator = creator;
+  return true;
+}
+
+void ShmRing::close() {
+  if (_header)
+    munmap(_header, _size);
+
+  _header = NULL;
+  _data = NULL;
+  _creator = false;
+}
+
+void ShmRing::unlink(string name) {
+  shm_unlink(shmName(name).c_str());
+}
+
+void ShmRing::write(const void* data, size_t n) {
+  const char* p = (const char*) data;
+  size_t capacity = _mask + 1;
+
+  while (n > 0) {
+    uint64_t head = _header->head.load(std::memory_order_relaxed);
+
+    // Wait for room. The flag is raised before the last look at tail, so
+    // the reader either sees it or we see the tail it moved.
+    size_t room;
+    while ((room = capacity - (head - _header->tail.load())) == 0) {
+      uint32_t seq = _header->spaceSeq.load();
+      _header->writerWaiting = 1;
+      if (capacity - (head - _header->tail.load()) == 0)
+	futexWait(&_header->spaceSeq, seq);
+      _header->writerWaiting = 0;
+    }
+
+    // At most two pieces: up to the end of the ring, then from its start
+    size_t m = std::min(n, room);
+    size_t begin = head & _mask;
+    size_t first = std::min(m, capacity - begin);
+    memcpy(_data + begin, p, first);
+    memcpy(_data, p + first, m - first);
+
+    _header->head.store(head + m);
+    _header->dataSeq.fetch_add(1);
+    if (_header->readerWaiting.load())
+      futexWake(&_header->dataSeq);
+
+    p += m;
+    n -= m;
+  }
+}
+
+void ShmRing::read(void* data, size_t n) {
+  char* p = (char*) data;
+  size_t capacity = _mask + 1;
+
+  while (n > 0) {
+    uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+
+    size_t available;
+    while ((available = _header->head.load() - tail) == 0) {
+      uint32_t seq = _header->dataSeq.load();
+      _header->readerWaiting = 1;
+      if (_header->head.load() == tail)
+	futexWait(&_header->dataSeq, seq);
+      _header->readerWaiting = 0;
+    }
+
+    size_t m = std::min(n, available);
+    size_t begin = tail & _mask;
+    size_t first = std::min(m, capacity - begin);
+    memcpy(p, _data + begin, first);
+    memcpy(p + first, _data, m - first);
+
+    _header->tail.store(tail + m);
+    _header->spaceSeq.fetch_add(1);
+    if (_header->writerWaiting.load())
+      futexWake(&_header->spaceSeq);
+
+    p += m;
+    n -= m;
+  }
+}
+
+// =============================
+// ===== Inter-Process I/O =====
+// =============================
 IPC::IPC(string fifo1, string fifo2) {
   _fifo1 = (fifo1.empty()) ? "/tmp/fifo1" : fifo1;
   _fifo2 = (fifo2.empty()) ? "/tmp/fifo2" : fifo2;
 
-  __createFifoIfNotExists(_fifo1);
-  __createFifoIfNotExists(_fifo2);
+  this->__open();
 }
 
+// A ring outlives its processes unless unlinked. Each side removes the one it
+// created, so the next run starts with empty rings instead of attaching to
+// stale ones (whose head / tail are left over from this run).
 IPC::~IPC () {
-  close(_in);
-  close(_out);
+  if (_out.isCreator())
+    ShmRing::unlink(_fifo1);
+  if (_in.isCreator())
+    ShmRing::unlink(_fifo2);
+}
+
+void IPC::__open() {
+  if (!_out.open(_fifo1) || !_in.open(_fifo2))
+    throw "Cannot open shared memory for " + _fifo1 + " and " + _fifo2;
 }
 
+// Same framing as the FIFO version: length, element size, elements
 template <typename T>
 IPC& IPC::operator << (const vector<T>& vec) {
-  cout << "Sending..." << endl;
+  size_t l = vec.size();
+  size_t nBytesPerElement = sizeof(T);
+  _out.write(&l, sizeof(l));
+  _out.write(&nBytesPerElement, sizeof(nBytesPerElement));
+  _out.write(vec.data(), l * sizeof(T));
+
+  return *this;
+}
+
+template <typename T>
+IPC& IPC::operator >> (vector<T>& vec) {
+  size_t length, nBytesPerElement;
+  _in.read(&length, sizeof(length));
+  _in.read(&nBytesPerElement, sizeof(nBytesPerElement));
+
+  if (nBytesPerElement != sizeof(T))
+    throw string("IPC: element size mismatch");
+
+  vec.resize(length);
+  _in.read(vec.data(), length * sizeof(T));
+
+  return *this;
+}
+
+IPC& IPC::operator << (string msg) {
+  size_t l = msg.size();
+  _out.write(&l, sizeof(l));
+  _out.write(msg.data(), l);
+
+  return *this;
+}
+
+IPC& IPC::operator >> (string& ack) {
+  size_t l;
+  _in.read(&l, sizeof(l));
+
+  ack.resize(l);
+  if (l > 0)
+    _in.read(&ack[0], l);
+
+  return *this;
+}
+
+void IPC::clear_fifo() {
+  _out.close();
+  _in.close();
+  ShmRing::unlink(_fifo1);
+  ShmRing::unlink(_fifo2);
+  this->__open();
+}
+
+template IPC& IPC::operator << (const vector<double>& vec);
+template IPC& IPC::operator << (const vector<float>& vec);
+
+template IPC& IPC::operator >> (vector<double>& vec);
+template IPC& IPC::operator >> (vector<float>& vec);
+
+// =================
+// ===== FIFOs =====
+// =================
+FifoIPC::FifoIPC(string fifo1, string fifo2) {
+  _fifo1 = (fifo1.empty()) ? "/tmp/fifo1" : fifo1;
+  _fifo2 = (fifo2.empty()) ? "/tmp/fifo2" : fifo2;
+
+  __createFifoIfNotExists(_fifo1);
+  __createFifoIfNotExists(_fifo2);
+}
+
+FifoIPC::~FifoIPC () {
+}
+
+template <typename T>
+FifoIPC& FifoIPC::operator << (const vector<T>& vec) {
   int _out = open(_fifo1.c_str(), O_WRONLY);
 
   size_t l = vec.size();
@@ -27,32 +320,28 @@ IPC& IPC::operator << (const vector<T>& vec) {
     write(_out, &vec[i], sizeof(vec[i]));
 
   close(_out);
-  cout << "[Done]" << endl;
+  return *this;
 }
 
 template <typename T>
-IPC& IPC::operator >> (vector<T>& vec) {
-  cout << "Receiving..." << endl;
+FifoIPC& FifoIPC::operator >> (vector<T>& vec) {
   int _in  = open(_fifo2.c_str(), O_RDONLY);
 
   size_t length;
   while ( read(_in, &length, sizeof(length)) <= 0 );
 
-  cout << "length = " << length << endl;
-
   size_t nBytesPerElement;
   read(_in, &nBytesPerElement, sizeof(nBytesPerElement));
 
   vec.resize(length);
   foreach (i, vec)
-    read(_in, &vec[i], sizeof(T)); 
+    read(_in, &vec[i], sizeof(T));
   close(_in);
-  cout << "[Done]" << endl;
 
   return *this;
 }
 
-IPC& IPC::operator << (string msg) {
+FifoIPC& FifoIPC::operator << (string msg) {
   int _out = open(_fifo1.c_str(), O_WRONLY);
   write(_out, msg.c_str(), msg.size());
   close(_out);
@@ -60,7 +349,7 @@ IPC& IPC::operator << (string msg) {
   return *this;
 }
 
-IPC& IPC::operator >> (string& ack) {
+FifoIPC& FifoIPC::operator >> (string& ack) {
   const size_t MAX_BUF = 65536;
   char buf[MAX_BUF];
 
@@ -74,14 +363,14 @@ IPC& IPC::operator >> (string& ack) {
   return *this;
 }
 
-void IPC::clear_fifo() {
+void FifoIPC::clear_fifo() {
   exec("rm " + _fifo1);
   exec("rm " + _fifo2);
   __createFifoIfNotExists(_fifo1);
   __createFifoIfNotExists(_fifo2);
 }
 
-void IPC::__createFifoIfNotExists(string fifo) {
+void FifoIPC::__createFifoIfNotExists(string fifo) {
   string ret;
   if (!exists(fifo))
     ret = exec("mkfifo " + fifo);
@@ -89,8 +378,8 @@ void IPC::__createFifoIfNotExists(string fifo) {
     throw "Cannot create fifo " + fifo;
 }
 
-template IPC& IPC::operator << (const vector<double>& vec);
-template IPC& IPC::operator << (const vector<float>& vec);
+template FifoIPC& FifoIPC::operator << (const vector<double>& vec);
+template FifoIPC& FifoIPC::operator << (const vector<float>& vec);
 
-template IPC& IPC::operator >> (vector<double>& vec);
-template IPC& IPC::operator >> (vector<float>& vec);
+template FifoIPC& FifoIPC::operator >> (vector<double>& vec);
+template FifoIPC& FifoIPC::operator >> (vector<float>& vec);
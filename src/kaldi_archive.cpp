@@ -0,0 +1,436 @@
+#include <kaldi_archive.h>
+#include <cstring>
+#include <cstdlib>
+#include <sys/stat.h>
+
+KaldiArchiveReader::KaldiArchiveReader(): _fid(NULL), _lastWasFloatMatrix(false), _exitOnError(true) {}
+
+KaldiArchiveReader::~KaldiArchiveReader() {
+  this->close();
+}
+
+bool KaldiArchiveReader::open(string filename, size_t bufferSize) {
+  this->close();
+
+  _filename = filename;
+  _error.clear();
+  _fid = fopen(filename.c_str(), "rb");
+  if (!_fid) {
+    _error = "cannot open " + filename;
+    return false;
+  }
+
+  // Large reads, so that loading runs close to disk bandwidth
+  _buffer.resize(bufferSize);
+  setvbuf(_fid, &_buffer[0], _IOFBF, _buffer.size());
+  return true;
+}
+
+void KaldiArchiveReader::close() {
+  if (_fid)
+    fclose(_fid);
+  _fid = NULL;
+}
+
+uint64_t KaldiArchiveReader::tell() const {
+  return ftello(_fid);
+}
+
+bool KaldiArchiveReader::seek(uint64_t offset) {
+  return fseeko(_fid, offset, SEEK_SET) == 0;
+}
+
+// Always returns false, so that callers can "return error(...)"
+bool KaldiArchiveReader::error(const string& key, const string& msg) {
+  _error = _filename + ": utterance \"" + key + "\": " + msg;
+
+  if (_exitOnError) {
+    fprintf(stderr, "[Error] %s\n", _error.c_str());
+    exit(-1);
+  }
+
+  return false;
+}
+
+bool KaldiArchiveReader::read(FeatureArena& arena, string& key) {
+  bool binary;
+  if (!readKey(key) || !isBinary(key, binary))
+    return false;
+
+  _lastWasFloatMatrix = false;
+  return binary ? readBinary(arena, key) : readText(arena, key);
+}
+
+bool KaldiArchiveReader::skip(string& key) {
+  bool binary;
+  if (!readKey(key) || !isBinary(key, binary))
+    return false;
+
+  if (!binary) {
+    int c;
+    while ((c = getc(_fid)) != EOF && c != ']');
+    if (c == EOF)
+      return error(key, "unexpected end of file in text matrix");
+    return true;
+  }
+
+  char token[4] = {0};
+  if (fread(token, 1, 3, _fid) != 3)
+    return error(key, "unexpected end of file");
+
+  size_t size = strcmp(token, "FM ") == 0 ? sizeof(float)
+	      : strcmp(token, "DM ") == 0 ? sizeof(double) : 0;
+  if (size == 0)
+    return error(key, "unsupported matrix type \"" + string(token) + "\" (only FM and DM are supported)");
+
+  int32_t rows, cols;
+  if (!readInt32(key, rows) || !readInt32(key, cols))
+    return false;
+
+  if (rows < 0 || cols < 0)
+    return error(key, "negative matrix size");
+
+  if (fseeko(_fid, (int64_t) rows * cols * size, SEEK_CUR) != 0)
+    return error(key, "unexpected end of file");
+
+  return true;
+}
+
+bool KaldiArchiveReader::isBinary(const string& key, bool& binary) {
+  int c = getc(_fid);
+  if (c != '\0') {
+    ungetc(c, _fid);
+    binary = false;
+    return true;
+  }
+
+  if (getc(_fid) != 'B')
+    return error(key, "expect binary marker \"\\0B\"");
+
+  binary = true;
+  return true;
+}
+
+// The key is everything up to the first space, after skipping leading
+// whitespace (e.g. the newline left by the previous text matrix). Returns
+// false with no error at the end of the archive.
+bool KaldiArchiveReader::readKey(string& key) {
+  key.clear();
+
+  int c;
+  while ((c = getc(_fid)) != EOF && isspace(c));
+
+  if (c == EOF)
+    return false;
+
+  do {
+    key.push_back(c);
+  } while ((c = getc(_fid)) != EOF && c != ' ');
+
+  if (c == EOF)
+    return error(key, "unexpected end of file after the key");
+
+  return true;
+}
+
+bool KaldiArchiveReader::readInt32(const string& key, int32_t& value) {
+  int size = getc(_fid);
+  value = 0;
+
+  if (size != sizeof(int32_t) || fread(&value, sizeof(int32_t), 1, _fid) != 1)
+    return error(key, "bad matrix size");
+
+  return true;
+}
+
+bool KaldiArchiveReader::readBinary(FeatureArena& arena, const string& key) {
+  char token[4] = {0};
+  if (fread(token, 1, 3, _fid) != 3)
+    return error(key, "unexpected end of file");
+
+  bool isFloat = strcmp(token, "FM ") == 0;
+  bool isDouble = strcmp(token, "DM ") == 0;
+
+  if (!isFloat && !isDouble)
+    return error(key, "unsupported matrix type \"" + string(token) + "\" (only FM and DM are supported)");
+
+  int32_t rows, cols;
+  if (!readInt32(key, rows) || !readInt32(key, cols))
+    return false;
+
+  if (rows < 0 || cols < 0)
+    return error(key, "negative matrix size");
+
+  if (arena.getDim() == 0)
+    arena.setDim(cols);
+  else if (rows > 0 && (size_t) cols != arena.getDim())
+    return error(key, "dimension " + int2str(cols) + " differs from " + int2str(arena.getDim()));
+
+  size_t n = (size_t) rows * cols;
+  float* data = arena.append(rows);
+
+  if (isFloat) {
+    if (fread(data, sizeof(float), n, _fid) != n)
+      return error(key, "unexpected end of file");
+    _lastWasFloatMatrix = true;
+    return true;
+  }
+
+  _doubles.resize(n);
+  if (fread(_doubles.data(), sizeof(double), n, _fid) != n)
+    return error(key, "unexpected end of file");
+
+  range (i, n)
+    data[i] = _doubles[i];
+  return true;
+}
+
+// "[" then one row per line, and "]" right after the last number
+bool KaldiArchiveReader::readText(FeatureArena& arena, const string& key) {
+  int c;
+  while ((c = getc(_fid)) != EOF && isspace(c));
+  if (c != '[')
+    return error(key, "expect \"[\"");
+
+  vector<float> data;
+  size_t cols = 0, rows = 0;
+  bool done = false, ok = true;
+  string msg;
+
+  char* line = NULL;
+  size_t capacity = 0;
+
+  while (ok && !done && getline(&line, &capacity, _fid) != -1) {
+    char* p = line;
+    size_t n = 0;
+
+    while (true) {
+      while (*p && isspace(*p)) ++p;
+      if (*p == '\0')
+	break;
+      if (*p == ']') {
+	done = true;
+	break;
+      }
+
+      char* end;
+      float v = strtof(p, &end);
+      if (end == p) {
+	ok = false;
+	msg = "bad number in text matrix";
+	break;
+      }
+
+      data.push_back(v);
+      p = end;
+      ++n;
+    }
+
+    if (!ok || n == 0)
+      continue;
+
+    if (cols == 0)
+      cols = n;
+    else if (n != cols) {
+      ok = false;
+      msg = "rows of different lengths in text matrix";
+    }
+    ++rows;
+  }
+
+  free(line);
+
+  if (!ok)
+    return error(key, msg);
+
+  if (!done)
+    return error(key, "unexpected end of file in text matrix");
+
+  if (arena.getDim() == 0)
+    arena.setDim(cols);
+  else if (rows > 0 && cols != arena.getDim())
+    return error(key, "dimension " + int2str(cols) + " differs from " + int2str(arena.getDim()));
+
+  float* dst = arena.append(rows);
+  std::copy(data.begin(), data.end(), dst);
+  return true;
+}
+
+bool tryLoadKaldiArchive(string filename, FeatureArena& arena, string& error, vector<string>* keys) {
+  KaldiArchiveReader reader;
+  reader.setExitOnError(false);
+  if (!reader.open(filename)) {
+    error = reader.getError();
+    return false;
+  }
+
+  struct stat st;
+  size_t fileSize = (stat(filename.c_str(), &st) == 0) ? st.st_size : 0;
+
+  size_t n = 0;
+  string key;
+  while (reader.read(arena, key)) {
+    if (keys != NULL)
+      keys->push_back(key);
+
+    // A binary float archive is (almost) all frames. Reserve for it once the
+    // dimension is known, instead of growing the arena step by step. Text and
+    // double archives would be over-reserved by up to 2x or more.
+    if (n++ == 0 && arena.getDim() > 0 && reader.lastWasFloatMatrix())
+      arena.reserve(0, fileSize / sizeof(float) / arena.getDim());
+  }
+
+  error = reader.getError();
+  return error.empty();
+}
+
+size_t loadKaldiArchive(string filename, FeatureArena& arena, vector<string>* keys) {
+  size_t n = arena.size();
+
+  string error;
+  if (!tryLoadKaldiArchive(filename, arena, error, keys)) {
+    fprintf(stderr, "[Error] %s\n", error.c_str());
+    exit(-1);
+  }
+
+  return arena.size() - n;
+}
+
+void loadKaldiArchive(string filename, const vector<string>& ids, FeatureArena& arena) {
+  KaldiArchiveIndex index;
+  if (!index.open(filename)) {
+    fprintf(stderr, "Cannot open archive %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  // Only a few frames are read after each seek, so a small buffer
+  KaldiArchiveReader reader;
+  reader.open(filename, 1 << 16);
+
+  string key;
+  foreach (i, ids) {
+    int pos = index.find(ids[i]);
+    if (pos < 0) {
+      fprintf(stderr, "Utterance %s is not in %s\n", ids[i].c_str(), filename.c_str());
+      exit(-1);
+    }
+
+    if (!reader.seek(index.getOffset(pos)) || !reader.read(arena, key) || key != ids[i]) {
+      fprintf(stderr, "[Error] Cannot read utterance %s from %s (stale index %s?)\n",
+	  ids[i].c_str(), filename.c_str(), KaldiArchiveIndex::getCacheFilename(filename).c_str());
+      exit(-1);
+    }
+  }
+}
+
+vector<string> loadIdList(string filename) {
+  ifstream file(filename.c_str());
+  if (!file.is_open()) {
+    fprintf(stderr, "Cannot open %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  vector<string> ids;
+  string line;
+  while (std::getline(file, line)) {
+    stringstream ss(line);
+    string id;
+    if (ss >> id)
+      ids.push_back(id);
+  }
+
+  return ids;
+}
+
+// ===============================
+// ===== Kaldi Archive Index =====
+// ===============================
+#define ARCHIVE_INDEX_MAGIC "TDTWIDX"
+#define ARCHIVE_INDEX_VERSION 1
+
+string KaldiArchiveIndex::getCacheFilename(const string& archive) {
+  return archive + ".idx";
+}
+
+bool KaldiArchiveIndex::open(string archive) {
+  struct stat st;
+  if (stat(archive.c_str(), &st) != 0)
+    return false;
+
+  string cache = getCacheFilename(archive);
+  if (!loadCache(cache, st.st_size, st.st_mtime)) {
+    build(archive);
+    saveCache(cache, st.st_size, st.st_mtime);
+  }
+
+  _position.clear();
+  foreach (i, _keys)
+    _position[_keys[i]] = i;
+
+  return true;
+}
+
+int KaldiArchiveIndex::find(const string& key) const {
+  auto itr = _position.find(key);
+  return itr == _position.end() ? -1 : (int) itr->second;
+}
+
+void KaldiArchiveIndex::build(const string& archive) {
+  _keys.clear();
+  _offsets.clear();
+
+  KaldiArchiveReader reader;
+  reader.open(archive, 1 << 16);
+
+  string key;
+  uint64_t offset = reader.tell();
+  while (reader.skip(key)) {
+    _keys.push_back(key);
+    _offsets.push_back(offset);
+    offset = reader.tell();
+  }
+}
+
+// Text cache: a header line, then "<key> <offset>" per utterance
+bool KaldiArchiveIndex::loadCache(const string& filename, uint64_t size, uint64_t mtime) {
+  ifstream file(filename.c_str());
+  if (!file.is_open())
+    return false;
+
+  string magic;
+  int version;
+  uint64_t cachedSize, cachedMtime;
+  size_t n;
+
+  if (!(file >> magic >> version >> cachedSize >> cachedMtime >> n)
+      || magic != ARCHIVE_INDEX_MAGIC || version != ARCHIVE_INDEX_VERSION
+      || cachedSize != size || cachedMtime != mtime)
+    return false;
+
+  _keys.resize(n);
+  _offsets.resize(n);
+  range (i, n) {
+    if (!(file >> _keys[i] >> _offsets[i]))
+      return false;
+  }
+
+  return true;
+}
+
+void KaldiArchiveIndex::saveCache(const string& filename, uint64_t size, uint64_t mtime) const {
+  string tmp = filename + ".tmp";
+  FILE* fid = fopen(tmp.c_str(), "w");
+
+  // e.g. a read-only folder. The index is just not cached then.
+  if (!fid)
+    return;
+
+  fprintf(fid, "%s %d %lu %lu %lu\n", ARCHIVE_INDEX_MAGIC, ARCHIVE_INDEX_VERSION, size, mtime, _keys.size());
+  foreach (i, _keys)
+    fprintf(fid, "%s %lu\n", _keys[i].c_str(), _offsets[i]);
+
+  if (fclose(fid) == 0)
+    atomicRename(tmp, filename);
+  else
+    remove(tmp.c_str());
+}
@@ -0,0 +1,228 @@
+#include <landmark.h>
+#include <thread_pool.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+vector<int> selectLandmarks(const float* points, int N, int dim, size_t L, string method, unsigned int seed) {
+  L = std::min(L, (size_t) N);
+  std::srand(seed);
+
+  vector<int> landmarks;
+
+  if (method == "random") {
+    vector<int> all(N);
+    for (int i=0; i<N; ++i)
+      all[i] = i;
+
+    std::random_shuffle(all.begin(), all.end());
+    landmarks.assign(all.begin(), all.begin() + L);
+  }
+  else if (method == "kmeans++") {
+    // Squared distance of every point to its closest landmark so far
+    vector<double> d2(N, 0);
+
+    int first = std::rand() % std::max(N, 1);
+    if (L > 0)
+      landmarks.push_back(first);
+
+    for (int i=0; i<N && L > 0; ++i) {
+      for (int d=0; d<dim; ++d) {
+	double x = points[i * dim + d] - points[first * dim + d];
+	d2[i] += x * x;
+      }
+    }
+
+    while (landmarks.size() < L) {
+      double total = 0;
+      for (int i=0; i<N; ++i)
+	total += d2[i];
+
+      // Every point left coincides with a landmark: take any other one
+      int next = -1;
+      if (total > 0) {
+	double r = (double) std::rand() / RAND_MAX * total;
+	for (int i=0; i<N && next < 0; ++i) {
+	  r -= d2[i];
+	  if (r <= 0 && d2[i] > 0)
+	    next = i;
+	}
+      }
+
+      if (next < 0) {
+	for (int i=0; i<N && next < 0; ++i) {
+	  if (std::find(landmarks.begin(), landmarks.end(), i) == landmarks.end())
+	    next = i;
+	}
+      }
+
+      landmarks.push_back(next);
+      for (int i=0; i<N; ++i) {
+	double s = 0;
+	for (int d=0; d<dim; ++d) {
+	  double x = points[i * dim + d] - points[next * dim + d];
+	  s += x * x;
+	}
+	d2[i] = std::min(d2[i], s);
+      }
+      d2[next] = 0;
+    }
+  }
+  else {
+    fprintf(stderr, "[Error] Unknown landmark selection \"%s\" (\"random\" or \"kmeans++\")\n", method.c_str());
+    exit(-1);
+  }
+
+  std::sort(landmarks.begin(), landmarks.end());
+  return landmarks;
+}
+
+void symmetricEigen(vector<double> A, size_t n, vector<double>& lambda, vector<double>& U) {
+  U.assign(n * n, 0);
+  range (i, n)
+    U[i * n + i] = 1;
+
+  const size_t MAX_SWEEP = 100;
+  for (size_t sweep=0; sweep<MAX_SWEEP; ++sweep) {
+    double off = 0, total = 0;
+    range (i, n) {
+      range (j, n) {
+	total += A[i * n + j] * A[i * n + j];
+	if (i != j)
+	  off += A[i * n + j] * A[i * n + j];
+      }
+    }
+
+    if (off <= 1e-22 * total)
+      break;
+
+    for (size_t p=0; p<n; ++p) {
+      for (size_t q=p+1; q<n; ++q) {
+	double apq = A[p * n + q];
+	if (apq == 0)
+	  continue;
+
+	// Rotate (p, q) so that A[p][q] becomes 0
+	double theta = (A[q * n + q] - A[p * n + p]) / (2 * apq);
+	double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+	double c = 1 / sqrt(t * t + 1);
+	double s = t * c;
+
+	range (k, n) {
+	  double akp = A[k * n + p], akq = A[k * n + q];
+	  A[k * n + p] = c * akp - s * akq;
+	  A[k * n + q] = s * akp + c * akq;
+	}
+
+	range (k, n) {
+	  double apk = A[p * n + k], aqk = A[q * n + k];
+	  A[p * n + k] = c * apk - s * aqk;
+	  A[q * n + k] = s * apk + c * aqk;
+	}
+
+	range (k, n) {
+	  double ukp = U[k * n + p], ukq = U[k * n + q];
+	  U[k * n + p] = c * ukp - s * ukq;
+	  U[k * n + q] = s * ukp + c * ukq;
+	}
+      }
+    }
+  }
+
+  lambda.resize(n);
+  range (i, n)
+    lambda[i] = A[i * n + i];
+}
+
+NystromFactors::NystromFactors(const vector<int>& landmarks, const vector<float>& C, int N):
+  _N(N), _landmarks(landmarks) {
+
+  size_t L = landmarks.size();
+
+  vector<double> W(L * L);
+  range (k, L) {
+    range (l, L)
+      W[k * L + l] = (C[landmarks[k] * L + l] + C[landmarks[l] * L + k]) / 2;
+  }
+
+  vector<double> lambda, U;
+  symmetricEigen(W, L, lambda, U);
+
+  // Near-duplicate landmarks give tiny eigenvalues whose inverse blows the
+  // reconstruction up; dropping the ones below 1% of the largest keeps the
+  // error falling steadily as L grows.
+  const double EIGEN_CUTOFF = 1e-2;
+  double largest = 0;
+  range (k, L)
+    largest = std::max(largest, fabs(lambda[k]));
+
+  vector<size_t> kept;
+  range (k, L) {
+    if (fabs(lambda[k]) > EIGEN_CUTOFF * largest)
+      kept.push_back(k);
+  }
+
+  size_t r = kept.size();
+  _sign.resize(r);
+  range (m, r)
+    _sign[m] = (lambda[kept[m]] > 0) ? 1 : -1;
+
+  _G.assign((size_t) N * r, 0);
+  for (int i=0; i<N; ++i) {
+    range (m, r) {
+      size_t k = kept[m];
+      double g = 0;
+      range (l, L)
+	g += C[i * L + l] * U[l * L + k];
+      _G[i * r + m] = g / sqrt(fabs(lambda[k]));
+    }
+  }
+}
+
+float NystromFactors::operator () (int i, int j) const {
+  size_t r = this->rank();
+  const float* gi = &_G[i * r];
+  const float* gj = &_G[j * r];
+
+  float s = 0;
+  range (m, r)
+    s += gi[m] * _sign[m] * gj[m];
+  return s;
+}
+
+void NystromFactors::reconstruct(float* S, size_t nThreads) const {
+  ThreadPool pool(nThreads);
+  for (int i=0; i<_N; ++i) {
+    pool.submit([this, S, i] () {
+      S[(size_t) i * _N + i] = 1;
+      for (int j=0; j<i; ++j)
+	S[(size_t) i * _N + j] = S[(size_t) j * _N + i] = std::max(0.0f, std::min(1.0f, (*this)(i, j)));
+    });
+  }
+  pool.wait();
+}
+
+void NystromFactors::save(string filename, const vector<string>& ids) const {
+  FILE* fid = filename.empty() ? stdout : fopen(filename.c_str(), "w");
+
+  if (!fid) {
+    fprintf(stderr, "[Error] Cannot write to %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  size_t r = this->rank();
+  fprintf(fid, "%d %lu\n", _N, r);
+  range (m, r)
+    fprintf(fid, "%g ", _sign[m]);
+  fprintf(fid, "\n");
+
+  for (int i=0; i<_N; ++i) {
+    fprintf(fid, "%s", ((size_t) i < ids.size()) ? ids[i].c_str() : int2str(i).c_str());
+    range (m, r)
+      fprintf(fid, " %.7g", _G[i * r + m]);
+    fprintf(fid, "\n");
+  }
+
+  if (fid != stdout)
+    fclose(fid);
+}
@@ -1,4 +1,8 @@
 #include <model.h>
+#include <cerrno>
+#include <cstring>
+#include <ftw.h>
+#include <sys/stat.h>
 
 // ===============================
 // ===== Class DTW-DNN Model =====
@@ -19,36 +23,30 @@ Model& Model::operator = (Model rhs) {
 
 void Model::initHiddenOutputAndGradient() {
 
-  hidden_output.hox.resize(_pp.getNLayer());
-  hidden_output.hoy.resize(_pp.getNLayer());
-  hidden_output.hod.resize(_dtw.getNLayer());
+  this->initHiddenOutput(hidden_output);
 
   gradient.grad1.resize(_pp.getWeights().size());
   gradient.grad2.resize(_pp.getWeights().size());
   gradient.grad4.resize(_dtw.getWeights().size());
 }
 
+void Model::initHiddenOutput(HIDDEN_OUTPUT& O) const {
+  _pp.initHiddenOutput(O.hox);
+  _pp.initHiddenOutput(O.hoy);
+  O.hoz.resize(_dtw.getDims()[0]);
+  _dtw.initHiddenOutput(O.hod);
+}
+
 float Model::evaluate(const float* x, const float* y) {
-  int length = _pp.getDims()[0];
-  return this->evaluate(vec(x, x+length), vec(y, y+length));
+  return this->evaluate(x, y, hidden_output);
 }
 
 float Model::evaluate(const vec& x, const vec& y) {
+  return this->evaluate(&x[0], &y[0], hidden_output);
+}
 
-  HIDDEN_OUTPUT_ALIASING(hidden_output, Ox, Oy, Om, Od);
-
-  _pp.feedForward(x, &Ox);
-  _pp.feedForward(y, &Oy);
-
-  Ox.back() = ext::softmax(Ox.back());
-  Oy.back() = ext::softmax(Oy.back());
-
-  Om = Ox.back() & Oy.back() & _w;
-
-  _dtw.feedForward(Om, &Od);
-
-  float d = Od.back()[0];
-  return d;
+float Model::evaluate(const float* x, const float* y, HIDDEN_OUTPUT& O) const {
+  return evaluateModel(_pp.getWeights(), &_w[0], _dtw.getWeights(), x, y, O);
 }
 
 void Model::train(const vec& x, const vec& y) {
@@ -57,12 +55,13 @@ void Model::train(const vec& x, const vec& y) {
   this->updateParameters(this->gradient);
 }
 
-void Model::calcGradient(const float* x, const float* y) {
-  int length = _pp.getDims()[0];
-  this->calcGradient(vec(x, x + length), vec(y, y+length));
+void Model::calcGradient(const vec& x, const vec& y) {
+  this->calcGradient(&x[0], &y[0]);
 }
 
-void Model::calcGradient(const vec& x, const vec& y) {
+// Back-propagate through the hidden outputs left by the last call to
+// evaluate(x, y). x and y themselves are not needed anymore.
+void Model::calcGradient(const float* x, const float* y) {
 
   HIDDEN_OUTPUT_ALIASING(hidden_output, Ox, Oy, Om, Od);
   GRADIENT_REF(gradient, ppg1, ppg2, middle_gradient, dtw_gradient);
@@ -125,7 +124,18 @@ void Model::getEmptyGradient(GRADIENT& g) {
   _dtw.getEmptyGradient(g4);
 }
 
-void Model::load(string folder) {
+void Model::load(string path) {
+  if (ModelFile::isModelFile(path)) {
+    this->loadBinary(path);
+    return;
+  }
+
+  // A save() interrupted between its two renames left the model in .old
+  string folder = path;
+  while (!folder.empty() && folder[folder.size() - 1] == '/')
+    folder.erase(folder.size() - 1);
+  if (!exists(folder) && exists(folder + ".old"))
+    folder += ".old";
   folder += "/";
 
   _pp.load(folder + "pp.w.");
@@ -137,19 +147,117 @@ void Model::load(string folder) {
   this->initHiddenOutputAndGradient();
 }
 
-void Model::save(string folder) const {
+// rm -rf and mkdir -p on the checkpoint folders, without a shell, so that
+// paths are taken literally and every failure is reported
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+  if (remove(path) != 0) {
+    fprintf(stderr, "[Warning] Cannot remove %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static bool removeFolder(const string& folder) {
+  struct stat st;
+  if (lstat(folder.c_str(), &st) != 0)
+    return errno == ENOENT;
+  return nftw(folder.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+static bool makeFolder(const string& folder) {
+  for (size_t p = folder.find('/', 1); ; p = folder.find('/', p + 1)) {
+    string prefix = folder.substr(0, p);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "[Warning] Cannot create %s: %s\n", prefix.c_str(), strerror(errno));
+      return false;
+    }
+    if (p == string::npos)
+      return true;
+  }
+}
+
+void Model::save(string path) const {
+
+  if (ends_with(path, ".bin")) {
+    this->saveBinary(path);
+    return;
+  }
+
+  // Written to a sibling folder first, which then replaces the old one, so
+  // that a checkpoint on disk is never half old and half new weights.
+  string folder = path;
+  while (!folder.empty() && folder[folder.size() - 1] == '/')
+    folder.erase(folder.size() - 1);
+
+  string tmp = folder + ".tmp", old = folder + ".old";
+  if (!removeFolder(tmp) || !removeFolder(old) || !makeFolder(tmp)) {
+    fprintf(stderr, "[Warning] Cannot prepare %s, model not saved\n", tmp.c_str());
+    return;
+  }
 
-  folder += "/";
-  
   const std::vector<mat>& ppw = _pp.getWeights();
   foreach (i, ppw)
-    ppw[i].saveas(folder + "pp.w." + int2str(i));
+    ppw[i].saveas(tmp + "/pp.w." + int2str(i));
 
-  ext::save(this->_w, folder + "m.w");
+  ext::save(this->_w, tmp + "/m.w");
+
+  const std::vector<mat>& dtww = _dtw.getWeights();
+  foreach (i, dtww)
+    dtww[i].saveas(tmp + "/dtw.w." + int2str(i));
+
+  if (exists(folder) && rename(folder.c_str(), old.c_str()) != 0) {
+    fprintf(stderr, "[Warning] Cannot replace model in %s\n", folder.c_str());
+    return;
+  }
+
+  if (atomicRename(tmp, folder)) {
+    if (!removeFolder(old))
+      fprintf(stderr, "[Warning] Cannot remove previous model %s\n", old.c_str());
+  }
+  else if (exists(old) && rename(old.c_str(), folder.c_str()) != 0)
+    fprintf(stderr, "[Warning] Cannot restore model from %s\n", old.c_str());
+}
 
+void Model::saveBinary(string filename) const {
+  const std::vector<mat>& ppw = _pp.getWeights();
   const std::vector<mat>& dtww = _dtw.getWeights();
+
+  ModelFileWriter writer(DNN_MODEL_FILE, ppw.size());
+
+  foreach (i, ppw)
+    writer.add(ppw[i]);
+
+  writer.add(this->_w);
+
+  foreach (i, dtww)
+    writer.add(dtww[i]);
+
+  if (!writer.save(filename))
+    fprintf(stderr, "[Warning] Failed to save model to %s\n", filename.c_str());
+}
+
+void Model::loadBinary(string filename) {
+  ModelFile file;
+  if (!file.open(filename) || file.type() != DNN_MODEL_FILE) {
+    fprintf(stderr, "Cannot load DTW-DNN model from %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  size_t nPPLayers = file.nPPLayers();
+  std::vector<mat> ppw(nPPLayers), dtww(file.nBlobs() - nPPLayers - 1);
+
+  foreach (i, ppw)
+    file.copyTo(i, ppw[i]);
+
+  file.copyTo(nPPLayers, this->_w);
+
   foreach (i, dtww)
-    dtww[i].saveas(folder + "dtw.w." + int2str(i));
+    file.copyTo(nPPLayers + 1 + i, dtww[i]);
+
+  _pp.setWeights(ppw);
+  _dtw.setWeights(dtww);
+
+  this->initHiddenOutputAndGradient();
 }
 
 void Model::print() const {
@@ -168,6 +276,33 @@ void swap(Model& lhs, Model& rhs) {
   swap(lhs._dtw, rhs._dtw);
 }
 
+// =========================================
+// ===== DTW-DNN Model (memory-mapped) =====
+// =========================================
+bool MappedModel::open(string filename) {
+  if (!_file.open(filename) || _file.type() != DNN_MODEL_FILE)
+    return false;
+
+  size_t nPPLayers = _file.nPPLayers();
+  size_t nBlobs = _file.nBlobs();
+
+  _pp.clear();
+  _dtw.clear();
+
+  range (i, nPPLayers)
+    _pp.push_back(weight_view(_file.data(i), _file.rows(i), _file.cols(i)));
+
+  _w = _file.data(nPPLayers);
+
+  for (size_t i=nPPLayers + 1; i<nBlobs; ++i)
+    _dtw.push_back(weight_view(_file.data(i), _file.rows(i), _file.cols(i)));
+
+  return true;
+}
+
+float MappedModel::evaluate(const float* x, const float* y, HIDDEN_OUTPUT& O) const {
+  return evaluateModel(_pp, _w, _dtw, x, y, O);
+}
 
 GRADIENT& operator += (GRADIENT& g1, const GRADIENT& g2) {
   GRADIENT_REF(g1, g1_1, g1_2, g1_3, g1_4);
@@ -0,0 +1,235 @@
+#include <model_io.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+uint64_t fnv1a(const void* data, size_t nBytes, uint64_t hash) {
+  const unsigned char* p = (const unsigned char*) data;
+  for (size_t i=0; i<nBytes; ++i) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static uint64_t align(uint64_t offset) {
+  return (offset + MODEL_FILE_ALIGNMENT - 1) / MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT;
+}
+
+// Every weight matrix of a DTW-DNN carries a bias row, so a layer has one
+// more row than the layer before it has columns. m.w is 1 x (output of the
+// PP-DNN), and the DTW-DNN takes that (plus bias) as input.
+static bool hasValidShapes(const ModelFileHeader* header, const ModelBlob* blobs) {
+  size_t nBlobs = header->nBlobs;
+  size_t nPPLayers = header->nPPLayers;
+
+  if (header->type == DIAG_MODEL_FILE)
+    return nBlobs >= 1 && blobs[0].rows == 1 && blobs[0].cols > 0;
+
+  if (header->type != DNN_MODEL_FILE)
+    return true;
+
+  // pp.w.0 ... , m.w and at least one dtw.w
+  if (nPPLayers == 0 || nBlobs < nPPLayers + 2)
+    return false;
+
+  range (i, nBlobs) {
+    if (blobs[i].rows == 0 || blobs[i].cols == 0)
+      return false;
+  }
+
+  for (size_t i=1; i<nPPLayers; ++i) {
+    if (blobs[i].rows != blobs[i-1].cols + 1)
+      return false;
+  }
+
+  const ModelBlob& m = blobs[nPPLayers];
+  if (m.rows != 1 || m.cols != blobs[nPPLayers - 1].cols)
+    return false;
+
+  if (blobs[nPPLayers + 1].rows != m.cols + 1)
+    return false;
+
+  for (size_t i=nPPLayers + 2; i<nBlobs; ++i) {
+    if (blobs[i].rows != blobs[i-1].cols + 1)
+      return false;
+  }
+
+  return true;
+}
+
+// ===========================
+// ===== ModelFileWriter =====
+// ===========================
+ModelFileWriter::ModelFileWriter(uint32_t type, uint32_t nPPLayers): _type(type), _nPPLayers(nPPLayers) {}
+
+void ModelFileWriter::add(const Matrix2D<float>& m) {
+  size_t rows = m.getRows();
+  size_t cols = m.getCols();
+
+  vector<float> data(rows * cols);
+  range (i, rows)
+    std::copy(m[i], m[i] + cols, data.begin() + i * cols);
+
+  _rows.push_back(rows);
+  _cols.push_back(cols);
+  _data.push_back(data);
+}
+
+void ModelFileWriter::add(const float* data, size_t rows, size_t cols) {
+  _rows.push_back(rows);
+  _cols.push_back(cols);
+  _data.push_back(vector<float>(data, data + rows * cols));
+}
+
+bool ModelFileWriter::save(string filename) const {
+
+  size_t nBlobs = _data.size();
+
+  ModelFileHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+  header.version = MODEL_FILE_VERSION;
+  header.type = _type;
+  header.nBlobs = nBlobs;
+  header.nPPLayers = _nPPLayers;
+
+  vector<ModelBlob> blobs(nBlobs);
+  uint64_t offset = align(sizeof(ModelFileHeader) + nBlobs * sizeof(ModelBlob));
+  uint64_t checksum = fnv1a(NULL, 0);
+
+  foreach (i, blobs) {
+    blobs[i].offset = offset;
+    blobs[i].rows = _rows[i];
+    blobs[i].cols = _cols[i];
+
+    size_t nBytes = _data[i].size() * sizeof(float);
+    checksum = fnv1a(&_data[i][0], nBytes, checksum);
+    offset = align(offset + nBytes);
+  }
+
+  header.fileSize = offset;
+  header.checksum = checksum;
+
+  string tmp = filename + ".tmp";
+  FILE* fid = fopen(tmp.c_str(), "wb");
+  if (!fid)
+    return false;
+
+  static const char padding[MODEL_FILE_ALIGNMENT] = {0};
+
+  bool ok = fwrite(&header, sizeof(header), 1, fid) == 1;
+  if (nBlobs > 0)
+    ok = ok && fwrite(&blobs[0], sizeof(ModelBlob), nBlobs, fid) == nBlobs;
+
+  uint64_t pos = sizeof(ModelFileHeader) + nBlobs * sizeof(ModelBlob);
+  foreach (i, blobs) {
+    ok = ok && fwrite(padding, 1, blobs[i].offset - pos, fid) == blobs[i].offset - pos;
+
+    size_t n = _data[i].size();
+    ok = ok && fwrite(&_data[i][0], sizeof(float), n, fid) == n;
+    pos = blobs[i].offset + n * sizeof(float);
+  }
+  ok = ok && fwrite(padding, 1, header.fileSize - pos, fid) == header.fileSize - pos;
+
+  ok = (fclose(fid) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+// =====================
+// ===== ModelFile =====
+// =====================
+ModelFile::ModelFile(): _addr(NULL), _size(0), _header(NULL), _blobs(NULL) {}
+
+ModelFile::~ModelFile() {
+  this->close();
+}
+
+bool ModelFile::isModelFile(string filename) {
+  FILE* fid = fopen(filename.c_str(), "rb");
+  if (!fid)
+    return false;
+
+  char magic[8] = {0};
+  size_t n = fread(magic, 1, sizeof(magic), fid);
+  fclose(fid);
+
+  return n == sizeof(magic) && strncmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool ModelFile::open(string filename) {
+  this->close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ModelFileHeader)) {
+    ::close(fd);
+    return false;
+  }
+
+  _size = st.st_size;
+  _addr = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (_addr == MAP_FAILED) {
+    _addr = NULL;
+    return false;
+  }
+
+  const ModelFileHeader* header = (const ModelFileHeader*) _addr;
+  const ModelBlob* blobs = (const ModelBlob*) (header + 1);
+
+  bool ok = strncmp(header->magic, MODEL_FILE_MAGIC, sizeof(header->magic)) == 0
+    && header->version == MODEL_FILE_VERSION
+    && header->fileSize == _size
+    && sizeof(ModelFileHeader) + header->nBlobs * sizeof(ModelBlob) <= _size;
+
+  uint64_t checksum = fnv1a(NULL, 0);
+  for (size_t i=0; ok && i<header->nBlobs; ++i) {
+    size_t nBytes = (size_t) blobs[i].rows * blobs[i].cols * sizeof(float);
+    ok = blobs[i].offset % MODEL_FILE_ALIGNMENT == 0 && blobs[i].offset <= _size && nBytes <= _size - blobs[i].offset;
+    if (ok)
+      checksum = fnv1a((const char*) _addr + blobs[i].offset, nBytes, checksum);
+  }
+
+  ok = ok && hasValidShapes(header, blobs);
+
+  if (!ok || checksum != header->checksum) {
+    fprintf(stderr, "[Error] %s is not a valid model file (version %u expected)\n", filename.c_str(), MODEL_FILE_VERSION);
+    this->close();
+    return false;
+  }
+
+  _header = header;
+  _blobs = blobs;
+  return true;
+}
+
+void ModelFile::close() {
+  if (_addr != NULL)
+    munmap(_addr, _size);
+
+  _addr = NULL;
+  _size = 0;
+  _header = NULL;
+  _blobs = NULL;
+}
+
+void ModelFile::copyTo(size_t i, Matrix2D<float>& m) const {
+  size_t rows = this->rows(i);
+  size_t cols = this->cols(i);
+  const float* d = this->data(i);
+
+  m.resize(rows, cols);
+  range (r, rows)
+    std::copy(d + r * cols, d + (r + 1) * cols, m[r]);
+}
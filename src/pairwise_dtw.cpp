@@ -0,0 +1,487 @@
+#include <pairwise_dtw.h>
+#include <thread_pool.h>
+#include <bounded_queue.h>
+#include <mutex>
+#include <atomic>
+
+// ========================
+// ===== Score Output =====
+// ========================
+void cvtDistanceToSimilarity(float* m, int N) {
+  float min = m[0];
+  float max = m[0];
+
+  for (int i=0; i<N; ++i) {
+    for (int j=0; j<i; ++j) {
+      if (m[i * N + j] > max) max = m[i * N + j];
+      if (m[i * N + j] < min) min = m[i * N + j];
+    }
+  }
+
+  printf("max = %.7f, min = %.7f \n", max, min);
+
+  if (min - max == 0)
+    return;
+  
+  for (int i=0; i<N; ++i)
+    m[i*N + i] = min;
+  
+  for (int i=0; i<N*N; ++i)
+    m[i] = abs((m[i] - max) / (min - max));
+}
+
+// Same as cvtDistanceToSimilarity(float*, int), streaming from the raw
+// distances on disk to a new matrix file. Text is what print() writes.
+void cvtDistanceToSimilarity(const SimMatrix& distances, string output_fn, int layout, int precision, string format) {
+  size_t N = distances.size();
+
+  // m[0][0] = 0 seeds both, as above
+  float min = 0;
+  float max = 0;
+
+  for (size_t i=0; i<N; ++i) {
+    for (size_t j=0; j<i; ++j) {
+      float d = distances.get(i, j);
+      if (d > max) max = d;
+      if (d < min) min = d;
+    }
+  }
+
+  printf("max = %.7f, min = %.7f \n", max, min);
+
+  string tmp = output_fn + ".tmp";
+  if (format == "text") {
+    FILE* fid = fopen(tmp.c_str(), "w");
+    if (!fid) {
+      fprintf(stderr, "Cannot open %s\n", tmp.c_str());
+      exit(-1);
+    }
+
+    for (size_t i=0; i<N; ++i) {
+      for (size_t j=0; j<N; ++j) {
+	float m = distances.get(i, j);
+	if (min - max != 0) {
+	  if (i == j)
+	    m = min;
+	  m = abs((m - max) / (min - max));
+	}
+	fprintf(fid, "%.6f ", m);
+      }
+      fprintf(fid, "\n");
+    }
+
+    if (fclose(fid) != 0 || !atomicRename(tmp, output_fn)) {
+      fprintf(stderr, "Failed to save similarity matrix to %s\n", output_fn.c_str());
+      exit(-1);
+    }
+    return;
+  }
+
+  SimMatrix similarity;
+  if (!similarity.create(tmp, N, layout, precision)) {
+    fprintf(stderr, "Cannot create %s\n", tmp.c_str());
+    exit(-1);
+  }
+
+  for (size_t i=0; i<N; ++i) {
+    for (size_t j=0; j<=i; ++j) {
+      float m = distances.get(i, j);
+      if (min - max != 0) {
+	if (i == j)
+	  m = min;
+	m = abs((m - max) / (min - max));
+      }
+
+      similarity.set(i, j, m);
+      if (layout == SIM_MATRIX_FULL)
+	similarity.set(j, i, m);
+    }
+  }
+
+  bool ok = similarity.sync();
+  similarity.close();
+
+  if (!ok || !atomicRename(tmp, output_fn)) {
+    fprintf(stderr, "Failed to save similarity matrix to %s\n", output_fn.c_str());
+    exit(-1);
+  }
+}
+
+void print(FILE* fid, float* m, int N) {
+  for (int i=0; i<N; ++i) {
+    for (int j=0; j<N; ++j)
+      fprintf(fid, "%.6f ", m[i * N + j]);
+    fprintf(fid, "\n");
+  }
+}
+
+void saveScores(string output_fn, float* scores, int N, string format, int layout, int precision, size_t nThreads) {
+  if (format == "bin")
+    saveSimMatrix(output_fn, scores, N, layout, precision, nThreads);
+  else {
+    FILE* fid = (output_fn.empty()) ? stdout : fopen(output_fn.c_str(), "w");
+    if (!fid) {
+      fprintf(stderr, "Cannot open %s\n", output_fn.c_str());
+      exit(-1);
+    }
+    print(fid, scores, N);
+    if (fid != stdout) 
+      fclose(fid);
+  }
+}
+
+// ==============================
+// ===== Incremental Update =====
+// ==============================
+// Distances between utterances already in prev_fn are copied from there, the
+// rest are computed. Utterances no longer in the archive are dropped.
+float* updatePairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, const vector<string>& ids, string prev_fn, size_t nThreads, ScoreCache* cache, uint64_t context) {
+
+  SimMatrix prev;
+  if (!prev.open(prev_fn)) {
+    fprintf(stderr, "Cannot open previous distances %s\n", prev_fn.c_str());
+    exit(-1);
+  }
+
+  vector<string> prevIds = loadIdList(prev_fn + ".ids");
+  if (prevIds.size() != prev.size()) {
+    fprintf(stderr, "%s.ids has %lu utterances but %s has %lu\n", prev_fn.c_str(), prevIds.size(), prev_fn.c_str(), prev.size());
+    exit(-1);
+  }
+
+  uint64_t prevContext;
+  vector<uint64_t> prevHash;
+  if (!loadDistanceHashes(prev_fn + ".hashes", prevContext, prevHash) || prevHash.size() != prevIds.size()) {
+    fprintf(stderr, "[Error] %s.hashes is missing or does not match %s.ids. Run again without --update\n", prev_fn.c_str(), prev_fn.c_str());
+    exit(-1);
+  }
+
+  if (prevContext != context) {
+    fprintf(stderr, "[Error] %s was computed with another distance, theta/model, eta or frame reduction\n", prev_fn.c_str());
+    exit(-1);
+  }
+
+  map<string, size_t> prevIndex;
+  foreach (i, prevIds)
+    prevIndex[prevIds[i]] = i;
+
+  // An utterance whose features changed is aligned again, like a new one
+  vector<uint64_t> hash = hashUtterances(data, offset, N);
+  vector<int> from(N, -1);
+  vector<bool> needed(N, true);
+  size_t nReused = 0, nKept = 0;
+  for (int i=0; i<N; ++i) {
+    auto itr = prevIndex.find(ids[i]);
+    if (itr == prevIndex.end())
+      continue;
+
+    ++nKept;
+    if (prevHash[itr->second] == hash[i]) {
+      from[i] = itr->second;
+      needed[i] = false;
+      ++nReused;
+    }
+  }
+
+  printf("Reusing "GREEN"%lu"COLOREND" utterances, "BLUE"%lu"COLOREND" new, "BLUE"%lu"COLOREND" changed, "ORANGE"%lu"COLOREND" removed\n",
+      nReused, N - nKept, nKept - nReused, prevIds.size() - nKept);
+
+  float* scores = new float[N * N];
+  for (int i=0; i<N; ++i) {
+    for (int j=0; j<N; ++j) {
+      if (from[i] >= 0 && from[j] >= 0)
+	scores[i * N + j] = prev.get(from[i], from[j]);
+    }
+  }
+
+  computePairwiseDTW(data, offset, N, dim, dist, eta, scores, needed, nThreads, cache, context);
+  return scores;
+}
+
+vector<uint64_t> hashUtterances(const float* data, const unsigned int* offset, int N) {
+  vector<uint64_t> hash(N);
+  for (int i=0; i<N; ++i)
+    hash[i] = ScoreCache::hashFeature(data + offset[i], offset[i + 1] - offset[i]);
+  return hash;
+}
+
+// "context <hex>", then "<hex>" per utterance, in the order of <file>.ids
+bool loadDistanceHashes(string filename, uint64_t& context, vector<uint64_t>& hash) {
+  FILE* fid = fopen(filename.c_str(), "r");
+  if (!fid)
+    return false;
+
+  hash.clear();
+  unsigned long long h;
+  bool ok = fscanf(fid, "context %llx", &h) == 1;
+  context = h;
+
+  while (ok && fscanf(fid, "%llx", &h) == 1)
+    hash.push_back(h);
+
+  fclose(fid);
+  return ok;
+}
+
+void saveDistances(string filename, const float* scores, const vector<string>& ids, const float* data, const unsigned int* offset, uint64_t context) {
+  saveSimMatrix(filename, scores, ids.size(), SIM_MATRIX_LOWER, SIM_MATRIX_FLOAT32);
+
+  int N = ids.size();
+  vector<uint64_t> hash = hashUtterances(data, offset, N);
+
+  string hashes_fn = filename + ".hashes";
+  string hashes_tmp = hashes_fn + ".tmp";
+  FILE* fid = fopen(hashes_tmp.c_str(), "w");
+  if (!fid) {
+    fprintf(stderr, "Cannot open %s\n", hashes_tmp.c_str());
+    exit(-1);
+  }
+
+  fprintf(fid, "context %016llx\n", (unsigned long long) context);
+  foreach (i, hash)
+    fprintf(fid, "%016llx\n", (unsigned long long) hash[i]);
+
+  if (fclose(fid) != 0 || !atomicRename(hashes_tmp, hashes_fn)) {
+    fprintf(stderr, "Failed to save %s\n", hashes_fn.c_str());
+    exit(-1);
+  }
+
+  string ids_fn = filename + ".ids";
+  string tmp = ids_fn + ".tmp";
+  fid = fopen(tmp.c_str(), "w");
+  if (!fid) {
+    fprintf(stderr, "Cannot open %s\n", tmp.c_str());
+    exit(-1);
+  }
+
+  foreach (i, ids)
+    fprintf(fid, "%s\n", ids[i].c_str());
+
+  if (fclose(fid) != 0 || !atomicRename(tmp, ids_fn)) {
+    fprintf(stderr, "Failed to save %s\n", ids_fn.c_str());
+    exit(-1);
+  }
+}
+
+// =============================
+// ===== Out-of-core Tiles =====
+// =============================
+void computeTiledPairwiseDTW(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, float eta, string output_fn, int layout, int precision, size_t tileSize, size_t nThreads, uint64_t fingerprint) {
+
+  string work_fn = output_fn + ".work";
+  string tiles_fn = output_fn + ".tiles";
+
+  TileBitmap tiles;
+  bool resumed = false;
+  if (!tiles.open(tiles_fn, N, tileSize, fingerprint, resumed)) {
+    fprintf(stderr, "Cannot open %s\n", tiles_fn.c_str());
+    exit(-1);
+  }
+
+  // Raw distances, always a float32 lower triangle
+  SimMatrix distances;
+  resumed = resumed && exists(work_fn) && distances.open(work_fn, true)
+    && distances.size() == (size_t) N
+    && distances.getLayout() == SIM_MATRIX_LOWER
+    && distances.getType() == SIM_MATRIX_FLOAT32;
+
+  if (!resumed) {
+    // Any tile marked done belongs to some other job
+    tiles.close();
+    remove(tiles_fn.c_str());
+    tiles.open(tiles_fn, N, tileSize, fingerprint, resumed);
+
+    if (!distances.create(work_fn, N, SIM_MATRIX_LOWER, SIM_MATRIX_FLOAT32)) {
+      fprintf(stderr, "Cannot create %s\n", work_fn.c_str());
+      exit(-1);
+    }
+  }
+  else
+    printf("Resuming: "GREEN"%lu"COLOREND" of %lu tiles already done\n", tiles.nDone(), tiles.nTiles());
+
+  computePairwiseDTW(data, offset, N, dim, dist, eta, distances, tiles, nThreads);
+  printf("\n");
+
+  cvtDistanceToSimilarity(distances, output_fn, layout, precision);
+
+  distances.close();
+  tiles.close();
+  remove(work_fn.c_str());
+  remove(tiles_fn.c_str());
+}
+
+// =========================================
+// ===== Several etas / thetas at once =====
+// =========================================
+// Raw distances of one of the K matrices, a float32 lower triangle next to
+// its output
+static SimMatrix* createWorkMatrix(string output_fn, int N) {
+  string work_fn = output_fn + ".work";
+  SimMatrix* distances = new SimMatrix;
+  if (!distances->create(work_fn, N, SIM_MATRIX_LOWER, SIM_MATRIX_FLOAT32)) {
+    fprintf(stderr, "Cannot create %s\n", work_fn.c_str());
+    exit(-1);
+  }
+  return distances;
+}
+
+static void saveWorkMatrix(SimMatrix* distances, string output_fn, string format, int layout, int precision) {
+  cvtDistanceToSimilarity(*distances, output_fn, layout, precision, format);
+  distances->close();
+  delete distances;
+  remove((output_fn + ".work").c_str());
+}
+
+void computeEtaList(const float* data, const unsigned int* offset, int N, int dim, distance_fn& dist, const vector<string>& etas, string output_pattern, string format, int layout, int precision, size_t nThreads) {
+
+  size_t K = etas.size();
+  vector<float> values(K);
+  vector<string> output_fn(K);
+  vector<SimMatrix*> distances(K);
+  range (k, K) {
+    values[k] = str2float(etas[k]);
+    output_fn[k] = replace_all(output_pattern, "{eta}", etas[k]);
+    distances[k] = createWorkMatrix(output_fn[k], N);
+  }
+
+  computePairwiseDTW(data, offset, N, dim, dist, values, distances, nThreads);
+
+  range (k, K) {
+    printf("eta = "BLUE"%s"COLOREND": ", etas[k].c_str());
+    saveWorkMatrix(distances[k], output_fn[k], format, layout, precision);
+  }
+}
+
+void computeThetaList(const float* data, const unsigned int* offset, int N, int dim, string dist_type, const vector<string>& thetas, float eta, string output_pattern, string format, int layout, int precision, size_t nThreads) {
+
+  // {theta} is the file name alone, so a/theta and b/theta would write the
+  // same matrix
+  size_t K = thetas.size();
+  vector<string> names(K);
+  map<string, string> seen;
+  range (k, K) {
+    size_t slash = thetas[k].find_last_of('/');
+    names[k] = (slash == string::npos) ? thetas[k] : thetas[k].substr(slash + 1);
+    if (seen.count(names[k])) {
+      fprintf(stderr, "[Error] %s and %s would both be written to %s\n", seen[names[k]].c_str(), thetas[k].c_str(), replace_all(output_pattern, "{theta}", names[k]).c_str());
+      exit(-1);
+    }
+    seen[names[k]] = thetas[k];
+  }
+
+  vector<vector<float> > diags(K);
+  range (k, K) {
+    loadTheta(diags[k], thetas[k]);
+    if (diags[k].size() != (size_t) dim) {
+      fprintf(stderr, "[Error] %s has %lu dimensions, but the features have %d\n", thetas[k].c_str(), diags[k].size(), dim);
+      exit(-1);
+    }
+  }
+
+  vector<string> output_fn(K);
+  vector<SimMatrix*> distances(K);
+  range (k, K) {
+    output_fn[k] = replace_all(output_pattern, "{theta}", names[k]);
+    distances[k] = createWorkMatrix(output_fn[k], N);
+  }
+
+  computePairwiseDTW(data, offset, N, dim, diags, dist_type == "lip", eta, distances, nThreads);
+
+  range (k, K) {
+    printf("theta = "BLUE"%s"COLOREND": ", thetas[k].c_str());
+    saveWorkMatrix(distances[k], output_fn[k], format, layout, precision);
+  }
+}
+
+// =============================
+// ===== Multi-query Batch =====
+// =============================
+// Loading or computing at most this many queries at a time. Loading the next
+// archive overlaps with the rows of the ones before it still in the pool.
+#define MAX_QUERIES_IN_FLIGHT 3
+
+struct QueryJob {
+  string name;
+  string output_fn;
+  int N, dim;
+  float* data;
+  unsigned int* offset;
+  float* scores;
+  vector<uint64_t> hash;
+  std::atomic<int> nRowsLeft;
+};
+
+void computeQueryList(string list_fn, string archive_pattern, string output_pattern, string dist_type, string theta_fn, string model_fn, float eta, string format, int layout, int precision, size_t nThreads, ScoreCache* cache, uint64_t context, FrameReducer& reducer) {
+
+  vector<string> queries = loadQueryList(list_fn);
+  printf("[Info] # of query: "GREEN"%lu"COLOREND"\n", queries.size());
+
+  ThreadPool pool(nThreads);
+  BoundedQueue<int> inFlight(MAX_QUERIES_IN_FLIGHT);
+  std::mutex mutex;
+  size_t nFinished = 0;
+
+  distance_fn* dist = NULL;
+
+  // The last row of a query to finish writes its matrix and frees it
+  auto finish = [&] (QueryJob* job) {
+    cvtDistanceToSimilarity(job->scores, job->N);
+    saveScores(job->output_fn, job->scores, job->N, format, layout, precision, 1);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      printf("[%lu/%lu] Query "BLUE"%s"COLOREND" (%d utterances) saved to %s\n",
+	  ++nFinished, queries.size(), job->name.c_str(), job->N, job->output_fn.c_str());
+    }
+
+    delete [] job->data;
+    delete [] job->offset;
+    delete [] job->scores;
+    delete job;
+
+    int q;
+    inFlight.pop(q);
+  };
+
+  foreach (q, queries) {
+    inFlight.push(q);
+
+    QueryJob* job = new QueryJob;
+    job->name = queries[q];
+    job->output_fn = replace_all(output_pattern, "{query}", job->name);
+    loadFeatureArchive(replace_all(archive_pattern, "{query}", job->name), job->data, job->offset, job->N, job->dim);
+    reducer.reduce(job->data, job->offset, job->N, job->dim);
+
+    if (!dist)
+      dist = initDistanceMeasure(dist_type, job->dim, theta_fn, model_fn);
+
+    int N = job->N;
+    job->scores = new float[N * N];
+    job->nRowsLeft = N;
+
+    if (cache) {
+      job->hash.resize(N);
+      for (int i=0; i<N; ++i)
+	job->hash[i] = ScoreCache::hashFeature(job->data + job->offset[i], job->offset[i + 1] - job->offset[i]);
+    }
+
+    if (N == 0) {
+      pool.submit([&, job] () { finish(job); });
+      continue;
+    }
+
+    // Longest rows first
+    for (int i=N-1; i>=0; --i) {
+      pool.submit([&, job, i] () {
+	computePairwiseDTWRow(job->data, job->offset, job->N, job->dim, *dist, eta, job->scores, i,
+	    NULL, cache, job->hash.data(), context);
+
+	if (--job->nRowsLeft == 0)
+	  finish(job);
+      });
+    }
+  }
+
+  pool.wait();
+  reducer.printStats();
+}
@@ -0,0 +1,103 @@
+#include <phone_store.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+PhoneStore::PhoneStore(): _addr(NULL), _size(0), _header(NULL), _entries(NULL), _offset(NULL), _frames(NULL) {}
+
+PhoneStore::~PhoneStore() {
+  this->close();
+}
+
+bool PhoneStore::isPhoneStore(string filename) {
+  FILE* fid = fopen(filename.c_str(), "rb");
+  if (!fid)
+    return false;
+
+  char magic[8] = {0};
+  size_t n = fread(magic, 1, sizeof(magic), fid);
+  fclose(fid);
+
+  return n == sizeof(magic) && strncmp(magic, PHONE_STORE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool PhoneStore::open(string filename) {
+  this->close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(PhoneStoreHeader)) {
+    ::close(fd);
+    return false;
+  }
+
+  _size = st.st_size;
+  _addr = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (_addr == MAP_FAILED) {
+    _addr = NULL;
+    return false;
+  }
+
+  const PhoneStoreHeader* header = (const PhoneStoreHeader*) _addr;
+  const PhoneStoreEntry* entries = (const PhoneStoreEntry*) (header + 1);
+  const uint64_t* offset = (const uint64_t*) (entries + header->nPhones);
+
+  size_t indexEnd = sizeof(PhoneStoreHeader) + header->nPhones * sizeof(PhoneStoreEntry)
+    + (header->nInstances + 1) * sizeof(uint64_t);
+
+  bool ok = strncmp(header->magic, PHONE_STORE_MAGIC, sizeof(header->magic)) == 0
+    && header->version == PHONE_STORE_VERSION
+    && header->fileSize == _size
+    && header->dataOffset % PHONE_STORE_ALIGNMENT == 0
+    && indexEnd <= header->dataOffset
+    && header->dataOffset + header->nFrames * header->dim * sizeof(float) <= _size;
+
+  for (size_t p=0; ok && p<header->nPhones; ++p)
+    ok = entries[p].first + entries[p].nInstances <= header->nInstances;
+
+  ok = ok && offset[0] == 0 && offset[header->nInstances] == header->nFrames;
+
+  if (!ok) {
+    fprintf(stderr, "[Error] %s is not a valid phone store (version %u expected)\n", filename.c_str(), PHONE_STORE_VERSION);
+    this->close();
+    return false;
+  }
+
+  _header = header;
+  _entries = entries;
+  _offset = offset;
+  _frames = (const float*) ((const char*) _addr + header->dataOffset);
+
+  // The frames are read once, from the beginning to the end
+  madvise(_addr, _size, MADV_SEQUENTIAL);
+
+  return true;
+}
+
+void PhoneStore::close() {
+  if (_addr != NULL)
+    munmap(_addr, _size);
+
+  _addr = NULL;
+  _size = 0;
+  _header = NULL;
+  _entries = NULL;
+  _offset = NULL;
+  _frames = NULL;
+}
+
+size_t PhoneStore::length(size_t phone, size_t k) const {
+  size_t i = _entries[phone].first + k;
+  return _offset[i + 1] - _offset[i];
+}
+
+const float* PhoneStore::data(size_t phone, size_t k) const {
+  size_t i = _entries[phone].first + k;
+  return _frames + _offset[i] * _header->dim;
+}
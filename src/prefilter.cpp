@@ -0,0 +1,117 @@
+#include <prefilter.h>
+#include <algorithm>
+#include <cmath>
+#include <set>
+
+PrefilterIndex::PrefilterIndex(const float* data, const unsigned int* offset, int N, int dim):
+  _N(N), _size(2 * dim + 1), _summary((size_t) N * _size, 0) {
+
+  // [ mean | standard deviation | duration bucket ]
+  for (int i=0; i<N; ++i) {
+    size_t length = (offset[i + 1] - offset[i]) / dim;
+    const float* f = data + offset[i];
+    float* s = &_summary[i * _size];
+
+    for (size_t t=0; t<length; ++t) {
+      for (int d=0; d<dim; ++d) {
+	s[d] += f[t * dim + d];
+	s[dim + d] += f[t * dim + d] * f[t * dim + d];
+      }
+    }
+
+    for (int d=0; d<dim; ++d) {
+      float mean = s[d] / std::max(length, (size_t) 1);
+      float var = s[dim + d] / std::max(length, (size_t) 1) - mean * mean;
+      s[d] = mean;
+      s[dim + d] = sqrt(std::max(var, 0.0f));
+    }
+
+    s[2 * dim] = floor(2 * log2((double) std::max(length, (size_t) 1)));
+  }
+
+  // Standardize every coordinate, so none dominates the distance
+  range (k, _size) {
+    double sum = 0, sum2 = 0;
+    for (int i=0; i<N; ++i) {
+      float x = _summary[i * _size + k];
+      sum += x;
+      sum2 += x * x;
+    }
+
+    double mean = sum / std::max(N, 1);
+    double stddev = sqrt(std::max(sum2 / std::max(N, 1) - mean * mean, 0.0));
+    if (stddev == 0)
+      stddev = 1;
+
+    for (int i=0; i<N; ++i)
+      _summary[i * _size + k] = (_summary[i * _size + k] - mean) / stddev;
+  }
+}
+
+float PrefilterIndex::distance(int i, int j) const {
+  const float* x = &_summary[i * _size];
+  const float* y = &_summary[j * _size];
+
+  float d = 0;
+  for (size_t k=0; k<_size; ++k)
+    d += (x[k] - y[k]) * (x[k] - y[k]);
+  return d;
+}
+
+vector<int> PrefilterIndex::candidates(int q, size_t C) const {
+  vector<std::pair<float, int> > d;
+  d.reserve(_N);
+  for (int j=0; j<_N; ++j) {
+    if (j != q)
+      d.push_back(std::make_pair(this->distance(q, j), j));
+  }
+
+  C = std::min(C, d.size());
+  std::partial_sort(d.begin(), d.begin() + C, d.end());
+
+  vector<int> c(C);
+  range (i, C)
+    c[i] = d[i].second;
+  return c;
+}
+
+vector<vector<int> > nearestNeighbours(const float* scores, int N, size_t k, bool similarity) {
+  vector<vector<int> > nearest(N);
+  for (int i=0; i<N; ++i) {
+    const float* row = scores + (size_t) i * N;
+    vector<pair<float, int> > r;
+    r.reserve(N);
+    for (int j=0; j<N; ++j) {
+      if (j != i)
+	r.push_back(std::make_pair(similarity ? -row[j] : row[j], j));
+    }
+
+    size_t m = std::min(k, r.size());
+    std::partial_sort(r.begin(), r.begin() + m, r.end());
+    range (n, m)
+      nearest[i].push_back(r[n].second);
+  }
+
+  return nearest;
+}
+
+double recallAtK(const vector<vector<int> >& truth, const vector<vector<int> >& retrieved, size_t k) {
+  double recall = 0;
+  size_t n = 0;
+
+  foreach (q, truth) {
+    size_t m = std::min(k, truth[q].size());
+    if (m == 0)
+      continue;
+
+    std::set<int> found(retrieved[q].begin(), retrieved[q].end());
+    size_t hits = 0;
+    range (i, m)
+      hits += found.count(truth[q][i]);
+
+    recall += (double) hits / m;
+    ++n;
+  }
+
+  return n ? recall / n : 1;
+}
@@ -0,0 +1,242 @@
+#include <rerank.h>
+#include <sim_matrix.h>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+
+// ============================
+// ===== Similarity Graph =====
+// ============================
+SimilarityGraph::SimilarityGraph(const float* S, size_t N, size_t knn):
+  _N(N), _sparse(knn > 0 && knn + 1 < N) {
+
+  if (!_sparse) {
+    _dense.assign(S, S + N * N);
+
+    range (i, N) {
+      float* row = &_dense[i * N];
+      row[i] = 0;
+
+      double sum = 0;
+      range (j, N)
+	sum += row[j] = std::max(row[j], 0.0f);
+
+      if (sum > 0) {
+	range (j, N)
+	  row[j] /= sum;
+      }
+    }
+    return;
+  }
+
+  _rowPtr.resize(N + 1, 0);
+  _col.reserve(N * knn);
+  _value.reserve(N * knn);
+
+  vector<pair<float, int> > neighbours;
+  range (i, N) {
+    neighbours.clear();
+    range (j, N) {
+      if (j != i && S[i * N + j] > 0)
+	neighbours.push_back(std::make_pair(-S[i * N + j], (int) j));
+    }
+
+    size_t k = std::min(knn, neighbours.size());
+    std::partial_sort(neighbours.begin(), neighbours.begin() + k, neighbours.end());
+
+    double sum = 0;
+    range (m, k)
+      sum -= neighbours[m].first;
+
+    range (m, k) {
+      _col.push_back(neighbours[m].second);
+      _value.push_back(-neighbours[m].first / sum);
+    }
+    _rowPtr[i + 1] = _col.size();
+  }
+}
+
+void SimilarityGraph::multiplyTransposed(const vector<double>& x, vector<double>& y) const {
+  y.assign(_N, 0);
+
+  if (!_sparse) {
+    range (i, _N) {
+      const float* row = &_dense[i * _N];
+      double xi = x[i];
+      range (j, _N)
+	y[j] += xi * row[j];
+    }
+    return;
+  }
+
+  range (i, _N) {
+    double xi = x[i];
+    for (size_t m=_rowPtr[i]; m<_rowPtr[i + 1]; ++m)
+      y[_col[m]] += xi * _value[m];
+  }
+}
+
+vector<double> randomWalk(const SimilarityGraph& graph, const vector<double>& r0, double p, size_t maxIteration, double tolerance) {
+  size_t N = graph.size();
+  vector<double> r(r0), y;
+
+  range (iteration, maxIteration) {
+    graph.multiplyTransposed(r, y);
+
+    double change = 0;
+    range (i, N) {
+      double next = (1 - p) * r0[i] + p * y[i];
+      change += fabs(next - r[i]);
+      r[i] = next;
+    }
+
+    if (change < tolerance)
+      break;
+  }
+
+  return r;
+}
+
+vector<double> pseudoRelevanceFeedback(const float* S, size_t N, const vector<double>& r0, double p, size_t M) {
+  vector<pair<double, size_t> > first(N);
+  range (i, N)
+    first[i] = std::make_pair(-r0[i], i);
+
+  M = std::min(M, N);
+  std::partial_sort(first.begin(), first.begin() + M, first.end());
+
+  vector<double> r(N);
+  range (i, N) {
+    double s = 0;
+    range (m, M)
+      s += S[i * N + first[m].second];
+    r[i] = (1 - p) * r0[i] + p * (M > 0 ? s / M : 0);
+  }
+
+  return r;
+}
+
+vector<double> normalizeScores(const vector<double>& scores) {
+  vector<double> r(scores);
+  if (r.empty())
+    return r;
+
+  double min = *std::min_element(r.begin(), r.end());
+  double max = *std::max_element(r.begin(), r.end());
+
+  double sum = 0;
+  foreach (i, r)
+    sum += r[i] = (max > min) ? (r[i] - min) / (max - min) : 1;
+
+  if (sum > 0) {
+    foreach (i, r)
+      r[i] /= sum;
+  }
+
+  return r;
+}
+
+// ======================
+// ===== Evaluation =====
+// ======================
+double averagePrecision(const vector<string>& ranking, const std::set<string>& relevant) {
+  if (relevant.empty())
+    return 0;
+
+  double sum = 0;
+  size_t hits = 0;
+  foreach (i, ranking) {
+    if (relevant.count(ranking[i])) {
+      ++hits;
+      sum += (double) hits / (i + 1);
+    }
+  }
+
+  return sum / relevant.size();
+}
+
+double precisionAt(const vector<string>& ranking, const std::set<string>& relevant, size_t k) {
+  if (k == 0)
+    return 0;
+
+  size_t hits = 0;
+  for (size_t i=0; i<k && i<ranking.size(); ++i)
+    hits += relevant.count(ranking[i]);
+
+  return (double) hits / k;
+}
+
+std::map<string, QueryAnswer> loadAnswers(string filename) {
+  ifstream file(filename.c_str());
+  if (!file.is_open()) {
+    fprintf(stderr, "Cannot open %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  std::map<string, QueryAnswer> answers;
+  string line;
+  while (std::getline(file, line)) {
+    stringstream ss(line);
+    string qid, query, docid;
+    int relevance = 1;
+    if (!(ss >> qid >> query >> docid))
+      continue;
+    ss >> relevance;
+
+    answers[query].qid = qid;
+    if (relevance > 0)
+      answers[query].relevant.insert(docid);
+  }
+
+  return answers;
+}
+
+bool loadScoreMatrix(string filename, vector<float>& m, size_t& N) {
+
+  if (SimMatrix::isSimMatrix(filename)) {
+    SimMatrix matrix;
+    if (!matrix.open(filename))
+      return false;
+
+    N = matrix.size();
+    m.resize(N * N);
+    range (i, N)
+      matrix.getRow(i, &m[i * N]);
+    return true;
+  }
+
+  ifstream file(filename.c_str());
+  if (!file.is_open())
+    return false;
+
+  m.clear();
+  N = 0;
+  string line;
+  while (std::getline(file, line)) {
+    const char* p = line.c_str();
+    char* end;
+    size_t n = 0;
+    for (float x = strtof(p, &end); end != p; x = strtof(p, &end)) {
+      m.push_back(x);
+      p = end;
+      ++n;
+    }
+
+    if (n == 0)
+      continue;
+
+    if (N > 0 && n != N) {
+      fprintf(stderr, "[Error] %s: row %lu has %lu columns instead of %lu\n", filename.c_str(), m.size() / N, n, N);
+      return false;
+    }
+    N = n;
+  }
+
+  if (N > 0 && m.size() != N * N) {
+    fprintf(stderr, "[Error] %s is not square (%lu x %lu)\n", filename.c_str(), m.size() / N, N);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,264 @@
+#include <score_cache.h>
+#include <model_io.h>
+#include <cstring>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Key 0 marks an empty slot, score PENDING one whose score is not stored yet
+#define EMPTY_KEY 0
+#define PENDING_SCORE 0xFFFFFFFFu
+#define MAX_PROBE 64
+#define RECORD_SIZE (sizeof(uint64_t) + sizeof(float))
+#define FLUSH_RECORDS 4096
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+ScoreCache::ScoreCache(size_t capacity): _slots(NULL), _mask(0), _maxSize(0),
+  _size(0), _hits(0), _misses(0), _dropped(0), _loaded(0), _fd(-1) {
+  this->allocate(capacity);
+}
+
+void ScoreCache::allocate(size_t capacity) {
+  size_t n = 1;
+  while (n < capacity)
+    n <<= 1;
+
+  delete [] _slots;
+  _slots = new Slot[n];
+  range (i, n) {
+    _slots[i].key = EMPTY_KEY;
+    _slots[i].score = PENDING_SCORE;
+  }
+
+  _mask = n - 1;
+  _maxSize = n / 4 * 3;
+  _size = 0;
+}
+
+ScoreCache::~ScoreCache() {
+  this->close();
+  delete [] _slots;
+}
+
+// ===== In memory =====
+bool ScoreCache::get(uint64_t key, float& score) {
+  if (key == EMPTY_KEY)
+    key = 1;
+
+  for (size_t i=0; i<MAX_PROBE; ++i) {
+    Slot& slot = _slots[(key + i) & _mask];
+    uint64_t k = slot.key.load();
+
+    if (k == EMPTY_KEY)
+      break;
+
+    if (k == key) {
+      uint32_t bits = slot.score.load();
+      if (bits == PENDING_SCORE)
+	break;
+
+      memcpy(&score, &bits, sizeof(score));
+      ++_hits;
+      return true;
+    }
+  }
+
+  ++_misses;
+  return false;
+}
+
+void ScoreCache::put(uint64_t key, float score) {
+  if (insert(key, score))
+    append(key, score);
+}
+
+// True if the key was not there before
+bool ScoreCache::insert(uint64_t key, float score) {
+  if (key == EMPTY_KEY)
+    key = 1;
+
+  uint32_t bits;
+  memcpy(&bits, &score, sizeof(bits));
+  if (bits == PENDING_SCORE || std::isnan(score))
+    return false;
+
+  if (_size >= _maxSize) {
+    this->drop();
+    return false;
+  }
+
+  for (size_t i=0; i<MAX_PROBE; ++i) {
+    Slot& slot = _slots[(key + i) & _mask];
+
+    uint64_t expected = EMPTY_KEY;
+    if (slot.key.compare_exchange_strong(expected, key)) {
+      slot.score.store(bits);
+      ++_size;
+      return true;
+    }
+
+    // Someone else is storing the same pair
+    if (expected == key)
+      return false;
+  }
+
+  this->drop();
+  return false;
+}
+
+// The table cannot grow while other threads probe it, so a full table only
+// warns (once) and keeps serving the scores it has.
+void ScoreCache::drop() {
+  if (_dropped++ == 0)
+    fprintf(stderr, "[Warning] Score cache is full (%lu of %lu slots), new scores are not cached\n",
+	(size_t) _size, _mask + 1);
+}
+
+// ===== On disk =====
+bool ScoreCache::open(string filename) {
+  this->close();
+
+  int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  char header[8] = {0};
+  strncpy(header, SCORE_CACHE_MAGIC, sizeof(header) - 1);
+  header[7] = SCORE_CACHE_VERSION;
+
+  size_t size = st.st_size;
+  if (size < sizeof(header)) {
+    if (ftruncate(fd, 0) != 0 || write(fd, header, sizeof(header)) != sizeof(header)) {
+      ::close(fd);
+      return false;
+    }
+    size = sizeof(header);
+  }
+  else {
+    vector<char> data(size);
+    if (pread(fd, data.data(), size, 0) != (ssize_t) size || memcmp(data.data(), header, sizeof(header)) != 0) {
+      fprintf(stderr, "[Error] %s is not a score cache (version %u expected)\n", filename.c_str(), SCORE_CACHE_VERSION);
+      ::close(fd);
+      return false;
+    }
+
+    // Grow the (still empty) table so that every record fits under the
+    // load limit, with as much room again for new scores.
+    size_t nRecords = (size - sizeof(header)) / RECORD_SIZE;
+    if (_size == 0 && nRecords * 2 > _maxSize)
+      this->allocate(nRecords * 2 * 4 / 3 + 1);
+
+    range (i, nRecords) {
+      const char* p = data.data() + sizeof(header) + i * RECORD_SIZE;
+      uint64_t key;
+      float score;
+      memcpy(&key, p, sizeof(key));
+      memcpy(&score, p + sizeof(key), sizeof(score));
+      _loaded += insert(key, score);
+    }
+
+    // Drop a half-written record at the end
+    size_t valid = sizeof(header) + nRecords * RECORD_SIZE;
+    if (valid != size && ftruncate(fd, valid) != 0) {
+      ::close(fd);
+      return false;
+    }
+  }
+
+  _fd = fd;
+  _filename = filename;
+  return true;
+}
+
+void ScoreCache::append(uint64_t key, float score) {
+  if (_fd < 0)
+    return;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  size_t n = _pending.size();
+  _pending.resize(n + RECORD_SIZE);
+  memcpy(&_pending[n], &key, sizeof(key));
+  memcpy(&_pending[n + sizeof(key)], &score, sizeof(score));
+
+  if (_pending.size() >= FLUSH_RECORDS * RECORD_SIZE) {
+    if (write(_fd, _pending.data(), _pending.size()) != (ssize_t) _pending.size())
+      fprintf(stderr, "[Warning] Failed to append to score cache %s\n", _filename.c_str());
+    _pending.clear();
+  }
+}
+
+void ScoreCache::flush() {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (_fd < 0 || _pending.empty())
+    return;
+
+  if (write(_fd, _pending.data(), _pending.size()) != (ssize_t) _pending.size())
+    fprintf(stderr, "[Warning] Failed to append to score cache %s\n", _filename.c_str());
+  _pending.clear();
+}
+
+void ScoreCache::close() {
+  this->flush();
+
+  if (_fd >= 0)
+    ::close(_fd);
+  _fd = -1;
+}
+
+void ScoreCache::printStats() const {
+  size_t hits = _hits, misses = _misses;
+  size_t total = hits + misses;
+
+  printf("Score cache: "GREEN"%lu"COLOREND" hits, "ORANGE"%lu"COLOREND" misses (%.1f%% hit rate), "
+      "%lu loaded from disk, %lu stored, %lu dropped\n",
+      hits, misses, total ? 100.0 * hits / total : 0.0, _loaded, (size_t) _size - _loaded, (size_t) _dropped);
+}
+
+// ===== Key =====
+uint64_t ScoreCache::hashFeature(const float* data, size_t nFloats) {
+  return fnv1a(data, nFloats * sizeof(float));
+}
+
+uint64_t ScoreCache::hashFile(string filename) {
+  if (filename.empty())
+    return 0;
+
+  FILE* fid = fopen(filename.c_str(), "rb");
+  if (!fid)
+    return 0;
+
+  uint64_t hash = fnv1a(NULL, 0);
+  char buffer[1 << 16];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), fid)) > 0)
+    hash = fnv1a(buffer, n, hash);
+
+  fclose(fid);
+  return hash;
+}
+
+uint64_t ScoreCache::makeContext(string distance, uint64_t params, float eta, string variant) {
+  uint64_t hash = fnv1a(distance.data(), distance.size());
+  hash = fnv1a(&params, sizeof(params), hash);
+  hash = fnv1a(&eta, sizeof(eta), hash);
+  return fnv1a(variant.data(), variant.size(), hash);
+}
+
+uint64_t ScoreCache::makeKey(uint64_t a, uint64_t b, uint64_t context) {
+  return mix(mix(mix(a) ^ b) ^ context);
+}
@@ -0,0 +1,639 @@
+#include <score_server.h>
+#include <archive_io.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+// Pairs per job on the worker pool
+#define PAIRS_PER_JOB 32
+#define POLL_INTERVAL_MS 200
+
+// ===== Messages =====
+void ScoreMessage::putString(const string& s) {
+  this->put((uint32_t) s.size());
+  _data.insert(_data.end(), s.begin(), s.end());
+}
+
+bool ScoreMessage::getString(string& s) {
+  uint32_t length;
+  if (!this->get(length) || length > _data.size() - _pos)
+    return false;
+
+  s.assign(&_data[0] + _pos, length);
+  _pos += length;
+  return true;
+}
+
+static bool writeAll(int fd, const char* p, size_t n) {
+  while (n > 0) {
+    ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+static bool readAll(int fd, char* p, size_t n) {
+  while (n > 0) {
+    ssize_t r = ::read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+bool sendMessage(int fd, uint16_t type, uint16_t status, uint32_t id, const ScoreMessage& payload) {
+  const vector<char>& data = payload.buffer();
+
+  // header.size is only 32-bit, and the other side would refuse it anyway
+  if (data.size() > MAX_MESSAGE_SIZE)
+    return false;
+
+  ScoreMessageHeader header;
+  header.magic = SCORE_SERVER_MAGIC;
+  header.type = type;
+  header.status = status;
+  header.id = id;
+  header.size = data.size();
+
+  // One write for small messages
+  vector<char> buffer(sizeof(header) + data.size());
+  memcpy(&buffer[0], &header, sizeof(header));
+  if (!data.empty())
+    memcpy(&buffer[sizeof(header)], &data[0], data.size());
+
+  return writeAll(fd, buffer.data(), buffer.size());
+}
+
+bool recvMessage(int fd, ScoreMessageHeader& header, ScoreMessage& payload) {
+  if (!readAll(fd, (char*) &header, sizeof(header)))
+    return false;
+
+  if (header.magic != SCORE_SERVER_MAGIC || header.size > MAX_MESSAGE_SIZE)
+    return false;
+
+  payload.clear();
+  payload.buffer().resize(header.size);
+  return header.size == 0 || readAll(fd, &payload.buffer()[0], header.size);
+}
+
+// ===== Archive cache =====
+std::shared_ptr<LoadedArchive> ArchiveCache::get(const string& filename, string& error) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    error = "cannot open " + filename;
+    return std::shared_ptr<LoadedArchive>();
+  }
+
+  Pending pending;
+  std::promise<std::shared_ptr<LoadedArchive> > promise;
+  bool load = false;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (auto itr = _archives.begin(); itr != _archives.end(); ++itr) {
+      if (itr->filename != filename)
+	continue;
+
+      Entry entry = *itr;
+      _archives.erase(itr);
+
+      // Changed on disk: drop it and load it again below. Requests still
+      // holding the old one keep it alive until they are done.
+      if (entry.mtime == st.st_mtime) {
+	pending = entry.archive;
+	_archives.push_front(entry);
+      }
+      break;
+    }
+
+    // Not there yet: a placeholder that later requests wait on
+    if (!pending.valid()) {
+      pending = promise.get_future();
+      load = true;
+
+      Entry entry = { filename, st.st_mtime, pending };
+      _archives.push_front(entry);
+      while (_archives.size() > _capacity)
+	_archives.pop_back();
+    }
+  }
+
+  if (load) {
+    std::shared_ptr<LoadedArchive> archive(new LoadedArchive);
+    archive->filename = filename;
+    archive->mtime = st.st_mtime;
+
+    // A failed load is not kept, so the next request tries again
+    if (!tryLoadFeatureArchive(filename, archive->data, archive->offset, archive->N, archive->dim, archive->error)) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto itr = _archives.begin(); itr != _archives.end(); ++itr) {
+	if (itr->filename == filename && itr->mtime == st.st_mtime) {
+	  _archives.erase(itr);
+	  break;
+	}
+      }
+    }
+
+    promise.set_value(archive);
+  }
+
+  std::shared_ptr<LoadedArchive> archive = pending.get();
+  if (!archive->error.empty()) {
+    error = archive->error;
+    return std::shared_ptr<LoadedArchive>();
+  }
+
+  return archive;
+}
+
+// ===== Latency =====
+void LatencyStats::add(int type, double ms) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  Samples& s = _samples[type];
+  if (s.ms.size() < _window)
+    s.ms.push_back(ms);
+  else
+    s.ms[s.next] = ms;
+
+  s.next = (s.next + 1) % _window;
+  ++s.count;
+}
+
+static float percentile(vector<float>& v, double p) {
+  size_t k = std::min(v.size() - 1, (size_t) (p * v.size()));
+  std::nth_element(v.begin(), v.begin() + k, v.end());
+  return v[k];
+}
+
+string LatencyStats::report() const {
+  const char* names[] = { "", "score", "matrix", "topk", "stats" };
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  stringstream ss;
+  ss << "type\trequests\tp50 (ms)\tp90 (ms)\tp99 (ms)\tmax (ms)" << endl;
+  for (auto itr = _samples.begin(); itr != _samples.end(); ++itr) {
+    vector<float> v = itr->second.ms;
+    if (v.empty())
+      continue;
+
+    int type = itr->first;
+    ss << ((type >= 1 && type <= 4) ? names[type] : "?") << "\t" << itr->second.count;
+    ss << "\t" << percentile(v, 0.50) << "\t" << percentile(v, 0.90) << "\t" << percentile(v, 0.99);
+    ss << "\t" << *std::max_element(v.begin(), v.end()) << endl;
+  }
+
+  return ss.str();
+}
+
+// ===== Server =====
+ScoreServer::ScoreServer(DistanceFactory factory, float eta, size_t nThreads, size_t maxArchives):
+  _factory(factory), _distance(NULL), _dim(0), _eta(eta), _pool(nThreads),
+  _archives(maxArchives), _fd(-1), _stop(false) {
+}
+
+ScoreServer::~ScoreServer() {
+  if (_fd >= 0) {
+    ::close(_fd);
+    unlink(_socketPath.c_str());
+  }
+}
+
+bool ScoreServer::listen(string socketPath) {
+  struct sockaddr_un addr;
+  if (socketPath.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "[Error] Socket path %s is too long\n", socketPath.c_str());
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+  // A socket file left by a killed server
+  unlink(socketPath.c_str());
+
+  _fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_fd < 0 || bind(_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || ::listen(_fd, SOMAXCONN) != 0) {
+    perror("[Error] Cannot listen on the socket");
+    return false;
+  }
+
+  _socketPath = socketPath;
+  return true;
+}
+
+void ScoreServer::run() {
+  while (!_stop) {
+    // Wake up now and then to see if stop() was called
+    struct pollfd p;
+    p.fd = _fd;
+    p.events = POLLIN;
+    if (poll(&p, 1, POLL_INTERVAL_MS) <= 0)
+      continue;
+
+    int fd = accept(_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    // Reap connections already closed
+    for (auto itr = _connections.begin(); itr != _connections.end(); ) {
+      if (*itr->done) {
+	itr->thread.join();
+	::close(itr->fd);
+	itr = _connections.erase(itr);
+      }
+      else
+	++itr;
+    }
+
+    _connections.push_back(Connection());
+    Connection& c = _connections.back();
+    c.fd = fd;
+    c.done.reset(new std::atomic<bool>(false));
+
+    std::shared_ptr<std::atomic<bool> > done = c.done;
+    c.thread = std::thread([this, fd, done] () {
+      this->serve(fd);
+      *done = true;
+    });
+  }
+
+  // Unblock the connections waiting in read()
+  for (auto itr = _connections.begin(); itr != _connections.end(); ++itr)
+    shutdown(itr->fd, SHUT_RDWR);
+
+  for (auto itr = _connections.begin(); itr != _connections.end(); ++itr) {
+    itr->thread.join();
+    ::close(itr->fd);
+  }
+  _connections.clear();
+}
+
+void ScoreServer::serve(int fd) {
+  ScoreMessageHeader header;
+  ScoreMessage request, response;
+
+  while (!_stop && recvMessage(fd, header, request)) {
+    auto start = std::chrono::system_clock::now();
+
+    response.clear();
+    string error;
+    bool ok = this->handle(header, request, response, error);
+    if (ok && response.buffer().size() > MAX_MESSAGE_SIZE) {
+      ok = false;
+      error = "response over the message size limit (" + int2str(MAX_MESSAGE_SIZE >> 20) + " MB), ask for fewer utterances";
+    }
+
+    if (!ok) {
+      response.clear();
+      response.buffer().assign(error.begin(), error.end());
+    }
+
+    if (!sendMessage(fd, header.type, ok ? 0 : 1, header.id, response))
+      break;
+
+    auto end = std::chrono::system_clock::now();
+    _latency.add(header.type, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.);
+  }
+
+  // Closed by run(), after the thread is joined
+}
+
+bool ScoreServer::handle(const ScoreMessageHeader& header, ScoreMessage& request, ScoreMessage& response, string& error) {
+  switch (header.type) {
+    case SCORE_MSG_SCORE:
+      return this->score(request, response, error);
+    case SCORE_MSG_MATRIX:
+      return this->matrix(request, response, error);
+    case SCORE_MSG_TOPK:
+      return this->topk(request, response, error);
+    case SCORE_MSG_STATS: {
+      string text = this->getStats();
+      response.buffer().assign(text.begin(), text.end());
+      return true;
+    }
+    default:
+      error = "unknown request type " + int2str(header.type);
+      return false;
+  }
+}
+
+std::shared_ptr<LoadedArchive> ScoreServer::getArchive(ScoreMessage& request, string& error) {
+  string filename;
+  if (!request.getString(filename)) {
+    error = "malformed request";
+    return std::shared_ptr<LoadedArchive>();
+  }
+
+  std::shared_ptr<LoadedArchive> archive = _archives.get(filename, error);
+  if (!archive)
+    return archive;
+
+  // The distance (e.g. theta) is made for the first archive's dimension
+  std::lock_guard<std::mutex> lock(_distanceMutex);
+  if (!_distance) {
+    _distance = _factory(archive->dim);
+    _dim = archive->dim;
+  }
+
+  if (archive->dim != _dim) {
+    error = filename + " has dimension " + int2str(archive->dim) + ", " + int2str(_dim) + " expected";
+    return std::shared_ptr<LoadedArchive>();
+  }
+
+  return archive;
+}
+
+bool ScoreServer::checkIndex(const LoadedArchive& archive, const vector<uint32_t>& indices, string& error) {
+  foreach (i, indices) {
+    if (indices[i] >= (uint32_t) archive.N) {
+      error = "utterance " + int2str(indices[i]) + " out of range (" + archive.filename
+	+ " has " + int2str(archive.N) + ")";
+      return false;
+    }
+  }
+  return true;
+}
+
+void ScoreServer::computeDistances(const LoadedArchive& archive, const vector<uint32_t>& i, const vector<uint32_t>& j, float* d) {
+  size_t n = i.size();
+  size_t nJobs = (n + PAIRS_PER_JOB - 1) / PAIRS_PER_JOB;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t nLeft = nJobs;
+
+  for (size_t b=0; b<n; b+=PAIRS_PER_JOB) {
+    size_t e = std::min(n, b + PAIRS_PER_JOB);
+    _pool.submit([&, b, e] () {
+      vector<float> pdist, alpha;
+      for (size_t k=b; k<e; ++k)
+	d[k] = pairDTW(archive.data, archive.offset, archive.dim, *_distance, _eta, i[k], j[k], pdist, alpha);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--nLeft == 0)
+	cond.notify_one();
+    });
+  }
+
+  // Not _pool.wait(): that would also wait for other connections' jobs
+  std::unique_lock<std::mutex> lock(mutex);
+  while (nLeft > 0)
+    cond.wait(lock);
+}
+
+bool ScoreServer::score(ScoreMessage& request, ScoreMessage& response, string& error) {
+  std::shared_ptr<LoadedArchive> archive = this->getArchive(request, error);
+  if (!archive)
+    return false;
+
+  uint32_t n;
+  vector<uint32_t> pairs;
+  if (!request.get(n) || !request.get(pairs, 2 * (size_t) n)) {
+    error = "malformed request";
+    return false;
+  }
+
+  if (!this->checkIndex(*archive, pairs, error))
+    return false;
+
+  vector<uint32_t> i(n), j(n);
+  range (k, n) {
+    i[k] = pairs[2 * k];
+    j[k] = pairs[2 * k + 1];
+  }
+
+  vector<float> d(n);
+  this->computeDistances(*archive, i, j, d.data());
+
+  response.put(d);
+  return true;
+}
+
+bool ScoreServer::matrix(ScoreMessage& request, ScoreMessage& response, string& error) {
+  std::shared_ptr<LoadedArchive> archive = this->getArchive(request, error);
+  if (!archive)
+    return false;
+
+  uint32_t n;
+  vector<uint32_t> indices;
+  if (!request.get(n) || !request.get(indices, n)) {
+    error = "malformed request";
+    return false;
+  }
+
+  // Refuse before aligning anything rather than after, at serialization
+  if ((size_t) n * n * sizeof(float) > MAX_MESSAGE_SIZE) {
+    error = "response over the message size limit (" + int2str(MAX_MESSAGE_SIZE >> 20) + " MB), ask for fewer utterances";
+    return false;
+  }
+
+  if (!this->checkIndex(*archive, indices, error))
+    return false;
+
+  // Lower triangle only, mirrored below
+  vector<uint32_t> i, j;
+  range (a, n) {
+    range (b, a) {
+      i.push_back(indices[a]);
+      j.push_back(indices[b]);
+    }
+  }
+
+  vector<float> d(i.size());
+  this->computeDistances(*archive, i, j, d.data());
+
+  vector<float> m((size_t) n * n, 0);
+  size_t k = 0;
+  range (a, n) {
+    range (b, a) {
+      m[(size_t) a * n + b] = m[(size_t) b * n + a] = d[k];
+      ++k;
+    }
+  }
+
+  response.put(m);
+  return true;
+}
+
+bool ScoreServer::topk(ScoreMessage& request, ScoreMessage& response, string& error) {
+  std::shared_ptr<LoadedArchive> archive = this->getArchive(request, error);
+  if (!archive)
+    return false;
+
+  uint32_t query, k, n;
+  vector<uint32_t> candidates;
+  if (!request.get(query) || !request.get(k) || !request.get(n) || !request.get(candidates, n)) {
+    error = "malformed request";
+    return false;
+  }
+
+  // k neighbors of 8 bytes each, at most one per utterance of the archive
+  size_t nNeighbors = std::min((size_t) k, (size_t) (n == 0 ? archive->N : n));
+  if (sizeof(uint32_t) + nNeighbors * (sizeof(uint32_t) + sizeof(float)) > MAX_MESSAGE_SIZE) {
+    error = "response over the message size limit (" + int2str(MAX_MESSAGE_SIZE >> 20) + " MB), ask for a smaller k";
+    return false;
+  }
+
+  if (n == 0) {
+    for (int c=0; c<archive->N; ++c) {
+      if ((uint32_t) c != query)
+	candidates.push_back(c);
+    }
+  }
+
+  if (!this->checkIndex(*archive, candidates, error) || !this->checkIndex(*archive, vector<uint32_t>(1, query), error))
+    return false;
+
+  vector<uint32_t> q(candidates.size(), query);
+  vector<float> d(candidates.size());
+  this->computeDistances(*archive, q, candidates, d.data());
+
+  vector<std::pair<float, uint32_t> > neighbors(candidates.size());
+  foreach (c, candidates)
+    neighbors[c] = std::make_pair(d[c], candidates[c]);
+
+  k = std::min((size_t) k, neighbors.size());
+  std::partial_sort(neighbors.begin(), neighbors.begin() + k, neighbors.end());
+
+  response.put(k);
+  range (c, k) {
+    response.put(neighbors[c].second);
+    response.put(neighbors[c].first);
+  }
+  return true;
+}
+
+// ===== Client =====
+bool ScoreClient::connect(string socketPath) {
+  this->close();
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+  _fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_fd < 0 || ::connect(_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    _error = "cannot connect to " + socketPath;
+    this->close();
+    return false;
+  }
+
+  return true;
+}
+
+void ScoreClient::close() {
+  if (_fd >= 0)
+    ::close(_fd);
+  _fd = -1;
+}
+
+bool ScoreClient::request(uint16_t type, const ScoreMessage& payload, ScoreMessage& response) {
+  uint32_t id = ++_id;
+
+  if (payload.buffer().size() > MAX_MESSAGE_SIZE) {
+    _error = "request over the message size limit (" + int2str(MAX_MESSAGE_SIZE >> 20) + " MB)";
+    return false;
+  }
+
+  ScoreMessageHeader header;
+  if (_fd < 0 || !sendMessage(_fd, type, 0, id, payload) || !recvMessage(_fd, header, response)) {
+    _error = "lost connection to the score server";
+    this->close();
+    return false;
+  }
+
+  if (header.id != id || header.type != type) {
+    _error = "unexpected response from the score server";
+    this->close();
+    return false;
+  }
+
+  if (header.status != 0) {
+    const vector<char>& text = response.buffer();
+    _error = string(text.begin(), text.end());
+    return false;
+  }
+
+  return true;
+}
+
+bool ScoreClient::score(string archive, const vector<std::pair<uint32_t, uint32_t> >& pairs, vector<float>& distances) {
+  ScoreMessage payload, response;
+  payload.putString(archive);
+  payload.put((uint32_t) pairs.size());
+  foreach (k, pairs) {
+    payload.put(pairs[k].first);
+    payload.put(pairs[k].second);
+  }
+
+  if (!this->request(SCORE_MSG_SCORE, payload, response))
+    return false;
+
+  return response.get(distances, pairs.size());
+}
+
+bool ScoreClient::matrix(string archive, const vector<uint32_t>& indices, vector<float>& distances) {
+  ScoreMessage payload, response;
+  payload.putString(archive);
+  payload.put((uint32_t) indices.size());
+  payload.put(indices);
+
+  if (!this->request(SCORE_MSG_MATRIX, payload, response))
+    return false;
+
+  return response.get(distances, indices.size() * indices.size());
+}
+
+bool ScoreClient::topk(string archive, uint32_t query, uint32_t k, const vector<uint32_t>& candidates, vector<std::pair<uint32_t, float> >& neighbors) {
+  ScoreMessage payload, response;
+  payload.putString(archive);
+  payload.put(query);
+  payload.put(k);
+  payload.put((uint32_t) candidates.size());
+  payload.put(candidates);
+
+  if (!this->request(SCORE_MSG_TOPK, payload, response))
+    return false;
+
+  uint32_t m;
+  if (!response.get(m))
+    return false;
+
+  neighbors.resize(m);
+  range (i, m) {
+    if (!response.get(neighbors[i].first) || !response.get(neighbors[i].second))
+      return false;
+  }
+
+  return true;
+}
+
+bool ScoreClient::stats(string& text) {
+  ScoreMessage payload, response;
+  if (!this->request(SCORE_MSG_STATS, payload, response))
+    return false;
+
+  text.assign(response.buffer().begin(), response.buffer().end());
+  return true;
+}
@@ -0,0 +1,442 @@
+#include <sim_matrix.h>
+#include <thread_pool.h>
+#include <cstring>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// ===================
+// ===== float16 =====
+// ===================
+// IEEE 754 half precision, round to nearest even.
+uint16_t float2half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+
+  uint16_t sign = (x >> 16) & 0x8000;
+  int32_t exponent = ((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+
+  // NaN and infinity
+  if (((x >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+  // Overflow to infinity
+  if (exponent >= 31)
+    return sign | 0x7c00;
+
+  // Subnormal or zero
+  if (exponent <= 0) {
+    if (exponent < -10)
+      return sign;
+
+    mantissa |= 0x800000;
+    uint32_t shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1)))
+      ++half;
+    return sign | half;
+  }
+
+  uint32_t half = (exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    ++half;	// may carry into the exponent, which is still right
+
+  return sign | half;
+}
+
+float half2float(uint16_t h) {
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+
+  if (exponent == 0x1f)
+    x = sign | 0x7f800000 | (mantissa << 13);
+  else if (exponent != 0)
+    x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  else if (mantissa == 0)
+    x = sign;
+  else {
+    // Subnormal: normalize it
+    exponent = 127 - 15 + 1;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// ======================
+// ===== Sim Matrix =====
+// ======================
+static size_t elementSize(int type) {
+  return type == SIM_MATRIX_FLOAT16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+static uint64_t align(uint64_t offset) {
+  return (offset + SIM_MATRIX_ALIGNMENT - 1) / SIM_MATRIX_ALIGNMENT * SIM_MATRIX_ALIGNMENT;
+}
+
+SimMatrix::SimMatrix(): _addr(NULL), _size(0), _header(NULL), _data(NULL) {}
+
+SimMatrix::~SimMatrix() {
+  this->close();
+}
+
+uint64_t SimMatrix::nElements(size_t N, int layout) {
+  return layout == SIM_MATRIX_LOWER ? (uint64_t) N * (N + 1) / 2 : (uint64_t) N * N;
+}
+
+bool SimMatrix::isSimMatrix(string filename) {
+  FILE* fid = fopen(filename.c_str(), "rb");
+  if (!fid)
+    return false;
+
+  char magic[8] = {0};
+  size_t n = fread(magic, 1, sizeof(magic), fid);
+  fclose(fid);
+
+  return n == sizeof(magic) && strncmp(magic, SIM_MATRIX_MAGIC, sizeof(magic)) == 0;
+}
+
+bool SimMatrix::create(string filename, size_t N, int layout, int type) {
+  this->close();
+
+  SimMatrixHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, SIM_MATRIX_MAGIC, sizeof(header.magic));
+  header.version = SIM_MATRIX_VERSION;
+  header.layout = layout;
+  header.type = type;
+  header.N = N;
+  header.dataOffset = align(sizeof(SimMatrixHeader));
+  header.fileSize = header.dataOffset + nElements(N, layout) * elementSize(type);
+
+  int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  // ftruncate() gives a sparse, zero-filled file
+  bool ok = ftruncate(fd, header.fileSize) == 0
+    && pwrite(fd, &header, sizeof(header), 0) == sizeof(header)
+    && this->map(fd, header.fileSize, true);
+  ::close(fd);
+
+  if (!ok) {
+    this->close();
+    return false;
+  }
+
+  return true;
+}
+
+bool SimMatrix::open(string filename, bool writable) {
+  this->close();
+
+  int fd = ::open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0
+    && (size_t) st.st_size >= sizeof(SimMatrixHeader)
+    && this->map(fd, st.st_size, writable);
+  ::close(fd);
+
+  if (!ok)
+    return false;
+
+  const SimMatrixHeader* header = _header;
+  ok = strncmp(header->magic, SIM_MATRIX_MAGIC, sizeof(header->magic)) == 0
+    && header->version == SIM_MATRIX_VERSION
+    && (header->layout == SIM_MATRIX_FULL || header->layout == SIM_MATRIX_LOWER)
+    && (header->type == SIM_MATRIX_FLOAT32 || header->type == SIM_MATRIX_FLOAT16)
+    && header->fileSize == _size
+    && header->dataOffset % SIM_MATRIX_ALIGNMENT == 0
+    && header->dataOffset + nElements(header->N, header->layout) * elementSize(header->type) <= _size;
+
+  if (!ok) {
+    fprintf(stderr, "[Error] %s is not a valid similarity matrix (version %u expected)\n", filename.c_str(), SIM_MATRIX_VERSION);
+    this->close();
+    return false;
+  }
+
+  _data = (char*) _addr + header->dataOffset;
+  return true;
+}
+
+bool SimMatrix::map(int fd, size_t size, bool writable) {
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  _addr = mmap(NULL, size, prot, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+
+  if (_addr == MAP_FAILED) {
+    _addr = NULL;
+    return false;
+  }
+
+  _size = size;
+  _header = (const SimMatrixHeader*) _addr;
+  _data = (char*) _addr + align(sizeof(SimMatrixHeader));
+  return true;
+}
+
+bool SimMatrix::sync() {
+  return _addr == NULL || msync(_addr, _size, MS_SYNC) == 0;
+}
+
+bool SimMatrix::sync(size_t rowBegin, size_t rowEnd) {
+  if (_addr == NULL || rowBegin >= rowEnd)
+    return true;
+
+  size_t size = elementSize(_header->type);
+  uint64_t first = _header->dataOffset + index(rowBegin, 0) * size;
+  uint64_t last = _header->dataOffset + index(rowEnd - 1, (_header->layout == SIM_MATRIX_LOWER) ? rowEnd - 1 : _header->N - 1) * size + size;
+
+  // msync() wants a page-aligned address
+  static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  first = first / pageSize * pageSize;
+
+  return msync((char*) _addr + first, last - first, MS_SYNC) == 0;
+}
+
+void SimMatrix::close() {
+  if (_addr != NULL)
+    munmap(_addr, _size);
+
+  _addr = NULL;
+  _size = 0;
+  _header = NULL;
+  _data = NULL;
+}
+
+uint64_t SimMatrix::index(size_t i, size_t j) const {
+  if (_header->layout == SIM_MATRIX_FULL)
+    return (uint64_t) i * _header->N + j;
+
+  if (j > i)
+    std::swap(i, j);
+  return (uint64_t) i * (i + 1) / 2 + j;
+}
+
+float SimMatrix::get(size_t i, size_t j) const {
+  uint64_t k = index(i, j);
+  if (_header->type == SIM_MATRIX_FLOAT16)
+    return half2float(((const uint16_t*) _data)[k]);
+  return ((const float*) _data)[k];
+}
+
+void SimMatrix::set(size_t i, size_t j, float value) {
+  uint64_t k = index(i, j);
+  if (_header->type == SIM_MATRIX_FLOAT16)
+    ((uint16_t*) _data)[k] = float2half(value);
+  else
+    ((float*) _data)[k] = value;
+}
+
+void SimMatrix::getRow(size_t i, float* row) const {
+  size_t N = _header->N;
+
+  // The stored part of row i is contiguous, the rest of a lower-triangle row
+  // is column i of the rows below.
+  size_t n = (_header->layout == SIM_MATRIX_LOWER) ? i + 1 : N;
+  uint64_t k = index(i, 0);
+
+  if (_header->type == SIM_MATRIX_FLOAT16) {
+    const uint16_t* src = (const uint16_t*) _data + k;
+    range (j, n)
+      row[j] = half2float(src[j]);
+  }
+  else
+    memcpy(row, (const float*) _data + k, n * sizeof(float));
+
+  for (size_t j=n; j<N; ++j)
+    row[j] = get(i, j);
+}
+
+void SimMatrix::setRow(size_t i, const float* row) {
+  size_t n = (_header->layout == SIM_MATRIX_LOWER) ? i + 1 : _header->N;
+  uint64_t k = index(i, 0);
+
+  if (_header->type == SIM_MATRIX_FLOAT16) {
+    uint16_t* dst = (uint16_t*) _data + k;
+    range (j, n)
+      dst[j] = float2half(row[j]);
+  }
+  else
+    memcpy((float*) _data + k, row, n * sizeof(float));
+}
+
+// =======================
+// ===== Tile Bitmap =====
+// =======================
+TileBitmap::TileBitmap(): _addr(NULL), _size(0), _header(NULL), _done(NULL) {}
+
+TileBitmap::~TileBitmap() {
+  this->close();
+}
+
+bool TileBitmap::open(string filename, size_t N, size_t tileSize, uint64_t fingerprint, bool& resumed) {
+  this->close();
+
+  size_t T = (N + tileSize - 1) / tileSize;
+
+  TileBitmapHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, TILE_BITMAP_MAGIC, sizeof(header.magic));
+  header.version = TILE_BITMAP_VERSION;
+  header.tileSize = tileSize;
+  header.N = N;
+  header.fingerprint = fingerprint;
+  header.nTiles = T * (T + 1) / 2;
+
+  size_t size = sizeof(TileBitmapHeader) + header.nTiles;
+
+  int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return false;
+
+  TileBitmapHeader old;
+  struct stat st;
+  resumed = fstat(fd, &st) == 0
+    && (size_t) st.st_size == size
+    && pread(fd, &old, sizeof(old), 0) == sizeof(old)
+    && memcmp(&old, &header, sizeof(header)) == 0;
+
+  bool ok = true;
+  if (!resumed) {
+    ok = ftruncate(fd, 0) == 0
+      && ftruncate(fd, size) == 0
+      && pwrite(fd, &header, sizeof(header), 0) == sizeof(header)
+      && fsync(fd) == 0;
+  }
+
+  if (ok) {
+    _addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ok = _addr != MAP_FAILED;
+  }
+  ::close(fd);
+
+  if (!ok) {
+    _addr = NULL;
+    return false;
+  }
+
+  _size = size;
+  _header = (const TileBitmapHeader*) _addr;
+  _done = (unsigned char*) _addr + sizeof(TileBitmapHeader);
+  return true;
+}
+
+void TileBitmap::close() {
+  if (_addr != NULL)
+    munmap(_addr, _size);
+
+  _addr = NULL;
+  _size = 0;
+  _header = NULL;
+  _done = NULL;
+}
+
+size_t TileBitmap::nDone() const {
+  size_t n = 0;
+  range (t, _header->nTiles)
+    n += isDone(t);
+  return n;
+}
+
+void TileBitmap::markDone(size_t t) {
+  _done[t] = 1;
+
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t offset = (sizeof(TileBitmapHeader) + t) / pageSize * pageSize;
+  msync((char*) _addr + offset, 1, MS_SYNC);
+}
+
+void TileBitmap::getTile(size_t t, size_t& rowBegin, size_t& rowEnd, size_t& colBegin, size_t& colEnd) const {
+  // Largest r such that r(r+1)/2 <= t
+  size_t r = (sqrt(8.0 * t + 1) - 1) / 2;
+  while (r * (r + 1) / 2 > t) --r;
+  while ((r + 1) * (r + 2) / 2 <= t) ++r;
+  size_t c = t - r * (r + 1) / 2;
+
+  size_t B = _header->tileSize, N = _header->N;
+  rowBegin = r * B;
+  rowEnd = std::min(rowBegin + B, N);
+  colBegin = c * B;
+  colEnd = std::min(colBegin + B, N);
+}
+
+// ==================================
+// ===== Save Similarity Matrix =====
+// ==================================
+void saveSimMatrix(string filename, const float* m, size_t N, int layout, int type, size_t nThreads) {
+
+  string tmp = filename + ".tmp";
+  SimMatrix matrix;
+  if (!matrix.create(tmp, N, layout, type)) {
+    fprintf(stderr, "Cannot create %s\n", tmp.c_str());
+    exit(-1);
+  }
+
+  // Blocks of rows with about the same number of elements each, since the
+  // rows of a lower triangle grow longer and longer
+  ThreadPool pool(nThreads);
+  size_t nBlocks = pool.size() * 4;
+  uint64_t perBlock = SimMatrix::nElements(N, layout) / nBlocks + 1;
+
+  size_t begin = 0;
+  while (begin < N) {
+    size_t end = begin;
+    uint64_t n = 0;
+    while (end < N && n < perBlock) {
+      ++end;
+      n += (layout == SIM_MATRIX_LOWER) ? end : N;
+    }
+
+    pool.submit([&matrix, m, N, begin, end] () {
+      for (size_t i=begin; i<end; ++i)
+	matrix.setRow(i, m + i * N);
+    });
+    begin = end;
+  }
+  pool.wait();
+
+  bool ok = matrix.sync();
+  matrix.close();
+
+  if (!ok || !atomicRename(tmp, filename)) {
+    fprintf(stderr, "Failed to save similarity matrix to %s\n", filename.c_str());
+    exit(-1);
+  }
+}
+
+int parseSimMatrixLayout(string layout) {
+  if (layout == "lower")
+    return SIM_MATRIX_LOWER;
+  if (layout == "full")
+    return SIM_MATRIX_FULL;
+
+  fprintf(stderr, "Unknown matrix layout \"%s\" (choose \"lower\" or \"full\")\n", layout.c_str());
+  exit(-1);
+}
+
+int parseSimMatrixType(string type) {
+  if (type == "float32")
+    return SIM_MATRIX_FLOAT32;
+  if (type == "float16")
+    return SIM_MATRIX_FLOAT16;
+
+  fprintf(stderr, "Unknown matrix precision \"%s\" (choose \"float32\" or \"float16\")\n", type.c_str());
+  exit(-1);
+}
@@ -0,0 +1,67 @@
+#include <thread_pool.h>
+
+ThreadPool::ThreadPool(size_t nThreads): _nBusy(0), _stop(false) {
+  if (nThreads == 0)
+    nThreads = hardwareConcurrency();
+
+  for (size_t i=0; i<nThreads; ++i)
+    _threads.push_back(std::thread(&ThreadPool::__run__, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_all();
+
+  for (size_t i=0; i<_threads.size(); ++i)
+    _threads[i].join();
+}
+
+size_t ThreadPool::hardwareConcurrency() {
+  size_t n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+void ThreadPool::submit(std::function<void ()> job) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _jobs.push(job);
+  }
+  _cond.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_jobs.empty() || _nBusy > 0)
+    _idle.wait(lock);
+}
+
+void ThreadPool::__run__() {
+  while (true) {
+    std::function<void ()> job;
+
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (_jobs.empty() && !_stop)
+	_cond.wait(lock);
+
+      // Remaining jobs are still run before the pool shuts down
+      if (_jobs.empty())
+	return;
+
+      job.swap(_jobs.front());
+      _jobs.pop();
+      ++_nBusy;
+    }
+
+    job();
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      --_nBusy;
+    }
+    _idle.notify_all();
+  }
+}
@@ -1,25 +1,126 @@
 #include <trainable_dtw.h>
 #include <pbar.h>
+#include <memory>
+
+// =================================
+// ===== Concurrent Validation =====
+// =================================
+// A validation running in the background on a snapshot of the parameters.
+// The validation set is split into chunks scored by the thread pool; the last
+// chunk to finish marks the result as ready.
+struct PendingValidation {
+  PendingValidation(size_t epoch, size_t nChunks, std::shared_ptr<void> snapshot):
+    epoch(epoch), nRemaining(nChunks), objective(0), snapshot(snapshot) {
+    timer.start();
+  }
 
-void dtw_model::validate(Corpus& corpus) {
-  static const size_t MINIATURE_SIZE = 10000;
-  static vector<tsample> samples = corpus.getSamples(MINIATURE_SIZE);
-  static double objective = 0;
-  static bool aboutToStop = false;
-  static const double SOFT_THRESHOLD = 2e-6 * _learning_rate;
-  static const double HARD_THRESHOLD = SOFT_THRESHOLD * 0.1;
+  std::mutex mutex;
+  std::condition_variable ready;
+
+  size_t epoch;
+  size_t nRemaining;
+  double objective;
+  std::shared_ptr<void> snapshot;
+  perf::Timer timer;
+};
+
+static const size_t VALIDATION_SIZE = 10000;
+
+void dtw_model::loadCorpus(Corpus& corpus) {
+  corpus.loadFeatures();
+  _arena = &corpus.getArena();
+}
+
+void dtw_model::loadValidationSet(Corpus& corpus) {
+  if (_validSet.size() > 0)
+    return;
+
+  loadCorpus(corpus);
+  _validSet = corpus.getSampleIDs(VALIDATION_SIZE);
+}
+
+void dtw_model::setValidationThreads(size_t nThreads) {
+  _nValidationThreads = nThreads;
+}
+
+void dtw_model::submitValidation(size_t epoch) {
+  if (!_validationPool)
+    _validationPool.reset(new ThreadPool(_nValidationThreads));
+
+  const size_t CHUNKS_PER_THREAD = 4;
+  size_t nChunks = MIN(_validationPool->size() * CHUNKS_PER_THREAD, _validSet.size());
+  size_t chunkSize = (_validSet.size() + nChunks - 1) / nChunks;
+  nChunks = (_validSet.size() + chunkSize - 1) / chunkSize;
+
+  std::shared_ptr<PendingValidation> pending(new PendingValidation(epoch, nChunks, this->snapshotParams()));
+  _pendingValidation = pending;
+
+  range (k, nChunks) {
+    size_t begin = k * chunkSize;
+    size_t end = MIN(begin + chunkSize, _validSet.size());
+
+    _validationPool->submit([this, pending, begin, end] () {
+      this->bindParams(pending->snapshot.get());
+      double obj = this->calcObjective(_validSet, begin, end);
+      this->bindParams(NULL);
+
+      std::lock_guard<std::mutex> lock(pending->mutex);
+      pending->objective += obj;
+      if (--pending->nRemaining == 0) {
+	pending->timer.stop();
+	pending->ready.notify_all();
+      }
+    });
+  }
+}
+
+// Apply the result of the validation in flight, if it is ready (or wait for it
+// to be). Returns true if early stopping decides the training is done.
+bool dtw_model::pollValidation(bool wait) {
+  if (!_pendingValidation)
+    return false;
+
+  PendingValidation& pending = *_pendingValidation;
+
+  perf::Timer waited;
+  {
+    std::unique_lock<std::mutex> lock(pending.mutex);
+    if (pending.nRemaining > 0 && !wait)
+      return false;
+
+    waited.start();
+    while (pending.nRemaining > 0)
+      pending.ready.wait(lock);
+    waited.stop();
+  }
+
+  float secs = pending.timer.getTime() / 1000;
+  float waitedSecs = waited.getTime() / 1000;
+  printf("Validation of iteration "BLUE"%lu"COLOREND" took %.2f secs on %lu threads, "
+      "training waited %.2f secs for it ("GREEN"%.2f"COLOREND" secs saved)\n",
+      pending.epoch, secs, _validationPool->size(), waitedSecs, secs - waitedSecs);
+
+  double obj = pending.objective;
+  _pendingValidation.reset();
+
+  return applyValidation(obj);
+}
+
+// Early stopping. Returns true when the objective on the dev-set is no longer
+// decreasing.
+bool dtw_model::applyValidation(double obj) {
+  const double SOFT_THRESHOLD = _soft_threshold;
+  const double HARD_THRESHOLD = SOFT_THRESHOLD * 0.1;
   static size_t MIN_ITERATION = 128;
-  static size_t itr = 0;
 
-  double obj = calcObjective(samples);
-  double diff = obj - objective;
-  double improveRate = abs(diff / objective);
+  double diff = obj - _objective;
+  double improveRate = abs(diff / _objective);
 
-  printf("objective = %.7f \t prev-objective = %.7f \n", obj, objective);
-  printf("improvement rate on dev-set of size %lu = %.6e ", samples.size(), improveRate);
+  printf("objective = %.7f \t prev-objective = %.7f \n", obj, _objective);
+  printf("improvement rate on dev-set of size %lu = %.6e ", _validSet.size(), improveRate);
   printf(", still "GREEN"%.0f"COLOREND" times of threshold \n", improveRate / SOFT_THRESHOLD);
 
-  if (itr > MIN_ITERATION) {
+  if (_nValidation > MIN_ITERATION) {
     if (improveRate != improveRate)
       exit(-1);
     
@@ -27,42 +128,52 @@ void dtw_model::validate(Corpus& corpus) {
       printf("\nObjective function on dev-set is no longer decreasing...\n");
       printf("Training process "GREEN"DONE"COLOREND"\n");
       // doPause();
-      exit(0);
+      return true;
     }
-    else if (aboutToStop || improveRate < SOFT_THRESHOLD) {
-      aboutToStop = true;
-      _learning_rate /= 2;
+    else if (_aboutToStop || improveRate < SOFT_THRESHOLD) {
+      _aboutToStop = true;
+      this->setLearningRate(_learning_rate / 2);
     }
   }
 
-  objective = obj;
-  ++itr;
+  _objective = obj;
+  ++_nValidation;
+
+  return false;
+}
+
+void dtw_model::validate(Corpus& corpus) {
+  loadValidationSet(corpus);
+
+  if (applyValidation(calcObjective(_validSet, 0, _validSet.size()))) {
+    _checkpointer.flush();
+    exit(0);
+  }
 }
 
-double dtw_model::calcObjective(const vector<tsample>& samples) {
+double dtw_model::calcObjective(const vector<isample>& samples, size_t begin, size_t end) {
   double obj = 0;
-  foreach (i, samples) {
-    double cscore = dtw(samples[i].first.first, samples[i].first.second);
+  for (size_t i=begin; i<end; ++i) {
+    if (!samples[i].positive)
+      continue;
+
+    double cscore = dtw(samples[i]);
     if (cscore == float_inf)
       continue;
-    bool positive = samples[i].second;
-    if (positive)
-      obj += cscore;
+    obj += cscore;
     // obj += (positive) ? cscore : (-_intra_inter_weight * cscore);
   }
 
   return obj;
 }
 
-double dtw_model::dtw(DtwParm& q_parm, DtwParm& d_parm, void *dTheta) {
-  vector<float> hypo_score;
-  vector<pair<int, int> > hypo_bound;
-
-  FrameDtwRunner::nsnippet_ = 10;
-
-  CumulativeDtwRunner dtwRunner = CumulativeDtwRunner(this->getDistFn());
-  dtwRunner.init(&hypo_score, &hypo_bound, &q_parm, &d_parm);
-  dtwRunner.DTW();
+double dtw_model::dtw(const isample& sample, void* dTheta) {
+  ArenaDtwRunner dtwRunner(this->getDistFn());
+  dtwRunner.init(
+      _arena->data(sample.first), _arena->length(sample.first),
+      _arena->data(sample.second), _arena->length(sample.second),
+      _arena->getDim());
+  dtwRunner.DTW(dTheta == NULL);
 
   if (dTheta != NULL)
     calcDeltaTheta(&dtwRunner, dTheta);
@@ -70,57 +181,108 @@ double dtw_model::dtw(DtwParm& q_parm, DtwParm& d_parm, void *dTheta) {
   return dtwRunner.getCumulativeScore();
 }
 
-double dtw_model::dtw(string f1, string f2, void* dTheta) {
-
-  DtwParm q_parm(f1);
-  DtwParm d_parm(f2);
-
-  return dtw(q_parm, d_parm, dTheta);
-}
-
 void dtw_model::selftest(Corpus& corpus) {
   const size_t MINIATURE_SIZE = 50;
-  vector<tsample> samples = corpus.getSamples(MINIATURE_SIZE);
+  loadCorpus(corpus);
+  vector<isample> samples = corpus.getSampleIDs(MINIATURE_SIZE);
 
   cout << "# of samples = " << BLUE << samples.size() << COLOREND << endl;
 
   for (size_t itr=0; itr<10000; ++itr) {
     __train__(samples, 0, samples.size());
-    double obj = calcObjective(samples);
+    double obj = calcObjective(samples, 0, samples.size());
     printf("%.8f\n", obj);
     saveModel();
   }
 }
 
-void dtw_model::train(Corpus& corpus, size_t batchSize) {
+void dtw_model::train(Corpus& corpus, size_t batchSize, bool resume) {
 
   size_t nBatch = 100000 / batchSize;
   size_t nTrainingSamples = nBatch * batchSize;
   const size_t MAX_ITERATION = 1024;
-  vector<tsample> samples = corpus.getSamples(nTrainingSamples);
+
+  TrainingState state;
+  if (resume && state.load(getStateFilename())) {
+    printf("Resuming from epoch "BLUE"%lu"COLOREND", batch "BLUE"%lu"COLOREND"\n", state.epoch, state.batch);
+    this->loadModel();
+    this->setLearningRate(state.learning_rate);
+    _seed	   = state.seed;
+    _objective	   = state.objective;
+    _aboutToStop   = state.aboutToStop;
+    _nValidation   = state.nValidation;
+  }
+  else
+    _seed = (unsigned int) std::time(0);
+
+  // Every phone instance is loaded once here; no feature file is opened
+  // after this point.
+  loadCorpus(corpus);
+
+  // The same seed always gives the same samples in the same order, which is
+  // how a resumed run picks up exactly where the previous one stopped.
+  std::srand(_seed);
+  vector<isample> samples = corpus.getSampleIDs(nTrainingSamples);
 
   // Random Shuffle for 10 times 
-  std::srand ( unsigned ( std::time(0) ) );
   range (i, 10)
     std::random_shuffle(samples.begin(), samples.end());
 
-  range (i, MAX_ITERATION) {
+  loadValidationSet(corpus);
+
+  size_t nBatchSinceCheckpoint = 0;
+  time_t lastCheckpoint = std::time(0);
+  bool done = false;
+
+  for (size_t i=state.epoch; i<MAX_ITERATION && !done; ++i) {
     showMsg(i);
 
     string msg = "Batch updates (" + int2str(nBatch) + " batches in total)";
     ProgressBar pbar;
-    range (j, nBatch) {
+    for (size_t j = (i == state.epoch) ? state.batch : 0; j<nBatch; ++j) {
       pbar.refresh(j, nBatch, int2str(j) + "-th " + msg);
 
       size_t begin = batchSize * j;
       size_t end   = batchSize * (j+1);
       __train__(samples, begin, end);
-      saveModel();
+
+      ++nBatchSinceCheckpoint;
+      bool due = (_checkpointBatches > 0 && nBatchSinceCheckpoint >= _checkpointBatches)
+	|| (_checkpointSecs > 0 && (size_t) (std::time(0) - lastCheckpoint) >= _checkpointSecs);
+
+      // The validation of the previous iteration runs concurrently with this
+      // one. Its early-stopping decision is applied between batches.
+      done = pollValidation(false);
+
+      if (due || done) {
+	checkpoint(i, j + 1);
+	nBatchSinceCheckpoint = 0;
+	lastCheckpoint = std::time(0);
+      }
+
+      if (done)
+	break;
     }
 
-    validate(corpus);
+    if (done)
+      break;
+
+    // At most one validation in flight
+    done = pollValidation(true);
+    if (!done)
+      submitValidation(i);
+
+    checkpoint(i + 1, 0);
   }
 
+  if (!done)
+    pollValidation(true);
+  else if (_validationPool)
+    _validationPool->wait();
+
+  _checkpointer.flush();
+  printf("%lu checkpoints written, %lu superseded before being written\n", _checkpointer.nWritten(), _checkpointer.nDropped());
+
   //vector<size_t> perm = randperm(nTrainingSamples);
 
   // TODO
@@ -150,6 +312,40 @@ void dtw_model::train(Corpus& corpus, size_t batchSize) {
 
 }
 
+void dtw_model::setCheckpointInterval(size_t nBatches, size_t nSecs) {
+  _checkpointBatches = nBatches;
+  _checkpointSecs = nSecs;
+}
+
+string dtw_model::getStateFilename() const {
+  string path = _model_output_path;
+  while (!path.empty() && path[path.size() - 1] == '/')
+    path.erase(path.size() - 1);
+  return path + ".state";
+}
+
+// Snapshot the parameters and the training state, and hand them over to the
+// background writer. The state is written after the parameters, so it never
+// points past the parameters on disk.
+void dtw_model::checkpoint(size_t epoch, size_t batch) {
+  TrainingState state;
+  state.epoch	      = epoch;
+  state.batch	      = batch;
+  state.learning_rate = _learning_rate;
+  state.seed	      = _seed;
+  state.objective     = _objective;
+  state.aboutToStop   = _aboutToStop;
+  state.nValidation   = _nValidation;
+
+  std::function<void ()> saveModel = this->snapshotModel();
+  string filename = getStateFilename();
+
+  _checkpointer.submit([saveModel, state, filename] () {
+    saveModel();
+    state.save(filename);
+  });
+}
+
 // +===============================================================+
 // +===== DTW with distance metric being Deep Nerual Network  =====+
 // +===============================================================+
@@ -158,11 +354,32 @@ VectorDistFn dtwdnn::getDistFn() {
   return ::dnn_fn;
 }
 
+// Snapshot bound to the calling thread by dtwdnn::bindParams()
+static __thread const Model* boundModel = NULL;
+static __thread HIDDEN_OUTPUT* boundHiddenOutput = NULL;
+
 float dnn_fn(const float* x, const float* y, const int size) {
+  if (boundModel)
+    return boundModel->evaluate(x, y, *boundHiddenOutput);
   return dtwdnn::getInstance().evaluate(x, y);
 }
 
-void dtwdnn::__train__(const vector<tsample>& samples, size_t begin, size_t end) {
+std::shared_ptr<void> dtwdnn::snapshotParams() {
+  return std::shared_ptr<Model>(new Model(getInstance()));
+}
+
+void dtwdnn::bindParams(const void* snapshot) {
+  boundModel = (const Model*) snapshot;
+  if (boundModel == NULL)
+    return;
+
+  // One buffer per thread, kept for the lifetime of the thread
+  if (boundHiddenOutput == NULL)
+    boundHiddenOutput = new HIDDEN_OUTPUT;
+  boundModel->initHiddenOutput(*boundHiddenOutput);
+}
+
+void dtwdnn::__train__(const vector<isample>& samples, size_t begin, size_t end) {
   Model &model = getInstance();
   GRADIENT dTheta, ddTheta;
   model.getEmptyGradient(dTheta);
@@ -173,11 +390,11 @@ void dtwdnn::__train__(const vector<tsample>& samples, size_t begin, size_t end)
   for (size_t i=begin; i<end; ++i) {
     pbar.refresh(i, samples.size());
 
-    auto cscore = dtw_model::dtw(samples[i].first.first, samples[i].first.second, (void*) &ddTheta);
+    auto cscore = dtw_model::dtw(samples[i], (void*) &ddTheta);
     if (cscore == float_inf)
       continue;
 
-    bool positive = samples[i].second;
+    bool positive = samples[i].positive;
     if (positive)
       dTheta += ddTheta;
     // dTheta = positive ? (dTheta + ddTheta) : (dTheta - _intra_inter_weight * ddTheta);
@@ -225,7 +442,22 @@ void dtwdnn::saveModel() {
   getInstance().save(_model_output_path);
 }
 
-void dtwdnn::calcDeltaTheta(const CumulativeDtwRunner* dtw, void* dThetaPtr) {
+void dtwdnn::loadModel() {
+  getInstance().load(_model_output_path);
+}
+
+void dtwdnn::setLearningRate(float learning_rate) {
+  dtw_model::setLearningRate(learning_rate);
+  getInstance().setLearningRate(learning_rate);
+}
+
+std::function<void ()> dtwdnn::snapshotModel() {
+  std::shared_ptr<Model> snapshot(new Model(getInstance()));
+  string path = _model_output_path;
+  return [snapshot, path] () { snapshot->save(path); };
+}
+
+void dtwdnn::calcDeltaTheta(const ArenaDtwRunner* dtw, void* dThetaPtr) {
   DTW_PARAM_ALIASING;
 
   GRADIENT& dTheta = *((GRADIENT*) dThetaPtr);
@@ -243,7 +475,11 @@ void dtwdnn::calcDeltaTheta(const CumulativeDtwRunner* dtw, void* dThetaPtr) {
 
       model.evaluate(qi, dj);
       model.calcGradient(qi, dj);
-      dTheta += coeff * (model.getGradient());
+
+      // Scale in place rather than through a temporary copy of GRADIENT
+      GRADIENT& g = model.getGradient();
+      g *= coeff;
+      dTheta += g;
     }
   }
 }
@@ -256,16 +492,16 @@ VectorDistFn dtwdiag::getDistFn() {
   return Bhattacharyya::fn;
 }
 
-void dtwdiag::__train__(const vector<tsample>& samples, size_t begin, size_t end) {
+void dtwdiag::__train__(const vector<isample>& samples, size_t begin, size_t end) {
   vector<double> dTheta(_dim);
   vector<double> ddTheta(_dim);
 
   for (size_t i=begin; i<end; ++i) {
-    auto cscore = dtw_model::dtw(samples[i].first.first, samples[i].first.second, (void*) &ddTheta);
+    auto cscore = dtw_model::dtw(samples[i], (void*) &ddTheta);
     if (cscore == float_inf)
       continue;
 
-    bool positive = samples[i].second;
+    bool positive = samples[i].positive;
     if (positive)
       dTheta += ddTheta;
     // dTheta = positive ? (dTheta + ddTheta) : (dTheta - _intra_inter_weight * ddTheta);
@@ -309,8 +545,41 @@ void dtwdiag::updateTheta(void* dThetaPtr) {
   Bhattacharyya::updateNormalizer();
 }
 
+static void saveTheta(const vector<double>& theta, const string& filename) {
+  if (!ends_with(filename, ".bin")) {
+    ext::save(theta, filename + ".tmp");
+    atomicRename(filename + ".tmp", filename);
+    return;
+  }
+
+  ModelFileWriter writer(DIAG_MODEL_FILE);
+  writer.add(theta);
+  if (!writer.save(filename))
+    fprintf(stderr, "[Warning] Failed to save theta to %s\n", filename.c_str());
+}
+
 void dtwdiag::saveModel() {
-  ext::save(Bhattacharyya::getDiag(), _model_output_path);
+  saveTheta(Bhattacharyya::getDiag(), _model_output_path);
+}
+
+void dtwdiag::loadModel() {
+  vector<double> theta;
+  loadTheta(theta, _model_output_path);
+  Bhattacharyya::setDiag(theta);
+}
+
+std::shared_ptr<void> dtwdiag::snapshotParams() {
+  return std::shared_ptr<vector<double> >(new vector<double>(Bhattacharyya::getDiag()));
+}
+
+void dtwdiag::bindParams(const void* snapshot) {
+  Bhattacharyya::bind((const vector<double>*) snapshot);
+}
+
+std::function<void ()> dtwdiag::snapshotModel() {
+  vector<double> theta = Bhattacharyya::getDiag();
+  string filename = _model_output_path;
+  return [theta, filename] () { saveTheta(theta, filename); };
 }
 
 void dtwdiag::initModel() {
@@ -319,7 +588,7 @@ void dtwdiag::initModel() {
   cout << "feature dim = " << _dim << endl;
 }
 
-void dtwdiag::calcDeltaTheta(const CumulativeDtwRunner* dtw, void* dThetaPtr) {
+void dtwdiag::calcDeltaTheta(const ArenaDtwRunner* dtw, void* dThetaPtr) {
   DTW_PARAM_ALIASING;
 
   vector<double>& dTheta = *((vector<double>*) dThetaPtr);
@@ -337,7 +606,7 @@ void dtwdiag::calcDeltaTheta(const CumulativeDtwRunner* dtw, void* dThetaPtr) {
     for (int j=0; j< dtw->dLength(); ++j) {
 
 #ifdef DTW_SLOPE_CONSTRAINT
-      if ( abs(i - j) > CumulativeDtwRunner::getWndSize() )
+      if ( abs(i - j) > (int) CumulativeDtwRunner::getWndSize() )
 	continue;
 #endif
       const float* qi = Q[i], *dj = D[j];
@@ -1,4 +1,5 @@
 #include <utility.h>
+#include <unistd.h>
 
 string int2str(int n) {
   char buf[32];
@@ -18,6 +19,19 @@ int str2int(const string& str) {
   return atoi(str.c_str());
 }
 
+size_t getResidentMemory() {
+  FILE* fid = fopen("/proc/self/statm", "r");
+  if (!fid)
+    return 0;
+
+  size_t size = 0, resident = 0;
+  if (fscanf(fid, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose(fid);
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
 vector<string>& split(const string &s, char delim, vector<string>& elems) {
   stringstream ss(s);
   string item;
@@ -53,6 +67,38 @@ string replace_all(const string& str, const string &token, const string &s) {
   return result;
 }
 
+vector<string> loadQueryList(string filename) {
+  ifstream file(filename.c_str());
+  if (!file.is_open()) {
+    fprintf(stderr, "Cannot open %s\n", filename.c_str());
+    exit(-1);
+  }
+
+  vector<string> queries;
+  string line;
+  while (std::getline(file, line)) {
+    size_t end = line.find_last_not_of(" \t\r");
+    if (end != string::npos)
+      queries.push_back(line.substr(0, end + 1));
+  }
+
+  return queries;
+}
+
+string cutoffWaveFilename(const string& utterance) {
+  size_t begin = utterance.find_last_of('/');
+  size_t end = utterance.find_last_of('_');
+  begin = (begin == string::npos) ? 0 : begin + 1;
+  if (end == string::npos || end < begin)
+    end = utterance.size();
+  return utterance.substr(begin, end - begin);
+}
+
+void cutoffWaveFilename(vector<string>& docid) {
+  foreach (i, docid)
+    docid[i] = cutoffWaveFilename(docid[i]);
+}
+
 bool isInt(string str) {
   int n = str2int(str);
   string s = int2str(n);
@@ -95,6 +141,15 @@ void doPause() {
   cin.ignore();
 }
 
+bool atomicRename(const string& tmp, const string& filename) {
+  if (rename(tmp.c_str(), filename.c_str()) == 0)
+    return true;
+
+  fprintf(stderr, "[Warning] Cannot rename %s to %s\n", tmp.c_str(), filename.c_str());
+  remove(tmp.c_str());
+  return false;
+}
+
 namespace bash {
   vector<string> ls(string path) {
     return split(exec("ls " + path), '\n');
@@ -0,0 +1,228 @@
+#include <vector_quantizer.h>
+#include <fast_dtw.h>
+#include <landmark.h>
+#include <thread_pool.h>
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+
+// ====================
+// ===== Codebook =====
+// ====================
+void Codebook::train(const float* frames, size_t nFrames, size_t dim, size_t K, size_t nIterations, size_t maxSamples, size_t nThreads, unsigned int seed) {
+
+  if (K == 0 || K > 65536) {
+    fprintf(stderr, "[Error] A codebook needs between 1 and 65536 centroids, not %lu\n", K);
+    exit(-1);
+  }
+
+  if (nFrames == 0) {
+    fprintf(stderr, "[Error] No frame to train a codebook on\n");
+    exit(-1);
+  }
+
+  // Every frame, or maxSamples of them drawn with replacement
+  std::srand(seed);
+  size_t n = std::min(nFrames, maxSamples);
+  vector<float> samples(n * dim);
+  range (s, n) {
+    size_t t = (n == nFrames) ? s : ((size_t) std::rand() * RAND_MAX + std::rand()) % nFrames;
+    std::copy(frames + t * dim, frames + (t + 1) * dim, samples.begin() + s * dim);
+  }
+
+  _K = std::min(K, n);
+  _dim = dim;
+  _centroids.resize(_K * _dim);
+
+  vector<int> seeds = selectLandmarks(samples.data(), n, dim, _K, "kmeans++", seed);
+  range (k, _K)
+    std::copy(&samples[seeds[k] * dim], &samples[(seeds[k] + 1) * dim], &_centroids[k * dim]);
+
+  ThreadPool pool(nThreads);
+  size_t nJobs = pool.size() * 4;
+  size_t chunk = (n + nJobs - 1) / nJobs;
+  vector<uint32_t> assignment(n, _K);
+
+  range (iteration, nIterations) {
+    vector<size_t> nChanged(nJobs, 0);
+    range (job, nJobs) {
+      pool.submit([&, job] () {
+	for (size_t s=job*chunk; s<std::min(n, (job + 1) * chunk); ++s) {
+	  uint32_t k = this->encode(&samples[s * dim]);
+	  nChanged[job] += (k != assignment[s]);
+	  assignment[s] = k;
+	}
+      });
+    }
+    pool.wait();
+
+    size_t changed = 0;
+    range (job, nJobs)
+      changed += nChanged[job];
+
+    if (changed == 0)
+      break;
+
+    // An empty cluster keeps its centroid
+    vector<double> sum(_K * dim, 0);
+    vector<size_t> count(_K, 0);
+    range (s, n) {
+      size_t k = assignment[s];
+      ++count[k];
+      range (d, dim)
+	sum[k * dim + d] += samples[s * dim + d];
+    }
+
+    range (k, _K) {
+      if (count[k] == 0)
+	continue;
+      range (d, dim)
+	_centroids[k * dim + d] = sum[k * dim + d] / count[k];
+    }
+  }
+}
+
+size_t Codebook::encode(const float* x) const {
+  size_t best = 0;
+  float min = FLT_MAX;
+
+  range (k, _K) {
+    const float* c = &_centroids[k * _dim];
+    float d = 0;
+    range (i, _dim)
+      d += (x[i] - c[i]) * (x[i] - c[i]);
+
+    if (d < min) {
+      min = d;
+      best = k;
+    }
+  }
+
+  return best;
+}
+
+vector<float> Codebook::distanceTable(distance_fn& fn, size_t nThreads) const {
+  vector<float> table(_K * _K);
+
+  ThreadPool pool(nThreads);
+  range (k, _K) {
+    pool.submit([&, k] () {
+      range (l, _K)
+	table[k * _K + l] = fn(this->centroid(k), this->centroid(l), _dim);
+    });
+  }
+  pool.wait();
+
+  return table;
+}
+
+bool Codebook::save(string filename) const {
+  FILE* fid = fopen(filename.c_str(), "w");
+  if (!fid)
+    return false;
+
+  bool ok = fprintf(fid, "%lu %lu\n", _K, _dim) > 0;
+  range (k, _K) {
+    range (d, _dim)
+      ok = ok && fprintf(fid, "%.9g ", _centroids[k * _dim + d]) > 0;
+    ok = ok && fprintf(fid, "\n") > 0;
+  }
+
+  // A truncated codebook would be loaded by the next run
+  if (fclose(fid) != 0 || !ok) {
+    remove(filename.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool Codebook::load(string filename, size_t dim) {
+  FILE* fid = fopen(filename.c_str(), "r");
+  if (!fid)
+    return false;
+
+  size_t K, d;
+  if (fscanf(fid, "%lu %lu", &K, &d) != 2 || K == 0 || K > 65536) {
+    fclose(fid);
+    return false;
+  }
+
+  if (d != dim) {
+    fprintf(stderr, "[Error] Codebook %s is for %lu-dimensional frames, not %lu\n", filename.c_str(), d, dim);
+    exit(-1);
+  }
+
+  vector<float> centroids(K * dim);
+  foreach (i, centroids) {
+    if (fscanf(fid, "%f", &centroids[i]) != 1) {
+      fclose(fid);
+      return false;
+    }
+  }
+  fclose(fid);
+
+  _K = K;
+  _dim = dim;
+  _centroids.swap(centroids);
+  return true;
+}
+
+// =============================
+// ===== Quantized Archive =====
+// =============================
+QuantizedArchive::QuantizedArchive(const Codebook& codebook): _codebook(codebook), _N(0), _K(codebook.size()), _offset(1, 0) {}
+
+void QuantizedArchive::append(const float* data, const unsigned int* offset, int N, int dim, size_t nThreads) {
+
+  if (_codebook.getDim() != (size_t) dim) {
+    fprintf(stderr, "[Error] The codebook is for %lu-dimensional frames, not %d\n", _codebook.getDim(), dim);
+    exit(-1);
+  }
+
+  for (int i=0; i<N; ++i)
+    _offset.push_back(_offset.back() + (offset[i + 1] - offset[i]) / dim);
+
+  size_t nFrames = _offset.back();
+  if (_K <= 256)
+    _codes8.resize(nFrames);
+  else
+    _codes16.resize(nFrames);
+
+  ThreadPool pool(nThreads);
+  for (int i=0; i<N; ++i) {
+    pool.submit([&, i] () {
+      size_t begin = _offset[_N + i], end = _offset[_N + i + 1];
+      for (size_t t=begin; t<end; ++t) {
+	size_t k = _codebook.encode(data + offset[i] + (t - begin) * dim);
+	if (_K <= 256)
+	  _codes8[t] = k;
+	else
+	  _codes16[t] = k;
+      }
+    });
+  }
+  pool.wait();
+
+  _N += N;
+}
+
+size_t QuantizedArchive::bytes() const {
+  return _codes8.size() * sizeof(uint8_t) + _codes16.size() * sizeof(uint16_t);
+}
+
+void QuantizedArchive::pair_distance(int i, int j, const float* table, float* pdist) const {
+  if (_K <= 256)
+    this->gather(_codes8.data() + _offset[i], _codes8.data() + _offset[j], this->length(i), this->length(j), table, pdist);
+  else
+    this->gather(_codes16.data() + _offset[i], _codes16.data() + _offset[j], this->length(i), this->length(j), table, pdist);
+}
+
+template <typename Code>
+void QuantizedArchive::gather(const Code* c1, const Code* c2, size_t rows, size_t cols, const float* table, float* pdist) const {
+  range (x, rows) {
+    const float* row = table + c1[x] * _K;
+    range (y, cols)
+      pdist[x * cols + y] = row[c2[y]];
+  }
+}
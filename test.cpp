@@ -17,7 +17,6 @@
 using namespace std;
 typedef Matrix2D<float> mat;
 
-void goAll();
 mat fast(const Array<string>& files);
 
 namespace golden {
@@ -90,8 +89,6 @@ int main (int argc, char* argv[]) {
   //   range (j, m.getCols())
   //     assert(!ext::is_inf(m[i][j]));
 
-  //goAll();
-
   //Array<string> files("test.list");
   //mat s1 = fast(files);
   //mat s2 = golden::go(files);
@@ -103,32 +100,6 @@ int main (int argc, char* argv[]) {
   return 0;
 }
 
-void goAll() {
-
-  string alignmentFile = "data/train.ali.txt";
-  string phoneTableFile = "data/phones.txt";
-  string modelFile = "data/final.mdl";
-  string featArk = "/media/Data1/LectureDSP_script/feat/train.39.ark";
-
-  vector<string> phones = getPhoneMapping(phoneTableFile);
-
-  map<string, vector<Phone> > phoneLabels;
-  int nInstance = load(alignmentFile, modelFile, phoneLabels);
-
-  map<size_t, vector<FeatureSeq> > phoneInstances;
-
-  if (featArk.empty())
-    return;
-
-  int n = loadFeatureArchive(featArk, phoneLabels, phoneInstances);
-  check_equal(n, nInstance);
-
-  run(phones, phoneInstances);
-  //size_t nMfccFiles = saveFeatureAsMFCC(phoneInstances, phones);
-
-  cout << "[Done]" << endl;
-}
-
 void toDenseFeature(const FeatureSeq& fs, DenseFeature& df) {
 
   TwoDimVector<float>& data = df.Data();
@@ -40,13 +40,22 @@ int main (int argc, char* argv[]) {
     .add("--model", "choose a distance model, either \"dnn\" or \"diag\"", false, "dnn")
     .add("--batch-size", "number of training samples per batch", false, "1000")
     .add("--learning-rate", "learning rate", false, "0.0001")
-    .add("--theta-output", "choose a file to save theta", false, ".theta.restore");
+    .add("--theta-output", "choose a file to save theta (binary model file if it ends with \".bin\")", false, ".theta.restore")
+    .add("--validation-threads", "number of threads validating in the background (0 for one per core)", false, "0");
+
+  cmdParser
+    .addGroup("Checkpoint options")
+    .add("--checkpoint-batches", "save a checkpoint every N batches (0 to disable)", false, "1")
+    .add("--checkpoint-secs", "save a checkpoint every N seconds (0 to disable)", false, "0")
+    .add("--resume", "resume training from the last checkpoint", false, "false");
 
   cmdParser
     .addGroup("Training Corpus options:")
     .add("--feat-dim", "dimension of feature vector (ex: 39 for mfcc)", false, "39")
-    .add("--feat-dir", "root directory of feature files ex: data/mfcc/", false, "/share/mlp_posterior/gaussian_posterior_noprior_no_log/")
-    .add("--phone-set", "choose \"CHT\" or \"EN\" as phone set", false, "EN");
+    .add("--feat-dir", "root directory of feature files ex: data/mfcc/, or a phone store from extract --phone-store", false, "/share/mlp_posterior/gaussian_posterior_noprior_no_log/")
+    .add("--phone-set", "choose \"CHT\" or \"EN\" as phone set", false, "EN")
+    .add("--frame-reduction", "shorten every phone instance once when it is loaded: \"skip:N\",\n"
+			      "\"average:N\" or \"merge:T\" (see frame_reduction.h)", false);
 
   cmdParser
     .addGroup("Deep Neural Network options:")
@@ -77,9 +86,15 @@ int main (int argc, char* argv[]) {
   string m		   = cmdParser.find("--model");
   string thetaFilename	   = cmdParser.find("--theta-output");
 
+  size_t ckptBatches	   = str2int(cmdParser.find("--checkpoint-batches"));
+  size_t ckptSecs	   = str2int(cmdParser.find("--checkpoint-secs"));
+  bool resume		   = cmdParser.find("--resume") == "true";
+  size_t nValidThreads	   = str2int(cmdParser.find("--validation-threads"));
+
   string feat_dir   	   = cmdParser.find("--feat-dir");
   size_t feat_dim	   = str2int(cmdParser.find("--feat-dim"));
   int phone_set		   = cmdParser.find("--phone-set") == "EN" ? EN_PHONE : CHT_PHONE;
+  string frame_reduction   = cmdParser.find("--frame-reduction");
 
   float intra_inter_weight = str2double(cmdParser.find("--weight"));
 
@@ -89,23 +104,30 @@ int main (int argc, char* argv[]) {
   SMIN::eta = eta;
   
   Corpus corpus(phone_set, "data/phones.txt", feat_dir);
+  corpus.setFrameReduction(frame_reduction);
 
   if (m == "dnn") {
     dtwdnn dnn(feat_dim, intra_inter_weight, lr, nHiddenLayer, nHiddenNodes);
 
+    dnn.setCheckpointInterval(ckptBatches, ckptSecs);
+    dnn.setValidationThreads(nValidThreads);
+
     if (phase == "selftest")
       dnn.selftest(corpus);
     else if (phase == "train")
-      dnn.train(corpus, batchSize);
+      dnn.train(corpus, batchSize, resume);
   }
   else if (m == "diag") {
 
     dtwdiag diag(feat_dim, intra_inter_weight, lr, thetaFilename);
 
+    diag.setCheckpointInterval(ckptBatches, ckptSecs);
+    diag.setValidationThreads(nValidThreads);
+
     if (phase == "selftest")
       diag.selftest(corpus);
     else if (phase == "train")
-      diag.train(corpus, batchSize);
+      diag.train(corpus, batchSize, resume);
   }
 
   profile.toc();